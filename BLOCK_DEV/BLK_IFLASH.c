@@ -0,0 +1,211 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : BLK_IFLASH.c
+* Description        : Block device backend for the UDISK region of the
+*                      internal code flash, reserved in Ld/Link.ld. Writes use
+*                      the 256-byte fast page erase and program and the 32K
+*                      fast block erase. The region lies in the zero-wait
+*                      part of the flash and is memory mapped, so reads are
+*                      plain copies and the USB disk sends straight from it.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include "BLOCK_DEV.h"
+
+#if DEF_BLK_IFLASH_EN
+#include "ch32v30x_flash.h"
+
+/******************************************************************************/
+/* Constant Definition */
+#define DEF_IFLASH_FPEC_BASE       0x08000000                                   /* Flash as addressed by the FPEC, Link.ld uses the alias at 0 */
+#define IFLASH_UDISK_START_ADDR    ( DEF_IFLASH_FPEC_BASE | (uint32_t)_iflash_udisk_start )
+#define IFLASH_UDISK_SIZE          ( (uint32_t)_iflash_udisk_size )
+
+/******************************************************************************/
+/* Variable Definition */
+extern uint8_t _iflash_udisk_start[ ];                                          /* Ld/Link.ld */
+extern uint8_t _iflash_udisk_size[ ];
+
+__attribute__ ((aligned(4))) static uint8_t BLK_IFlash_Page[ DEF_BLK_IFLASH_PAGE ]; /* Copy of an unaligned source page */
+
+static uint8_t BLK_IFlash_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint );
+static uint8_t BLK_IFlash_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+static uint8_t BLK_IFlash_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+static uint8_t BLK_IFlash_Erase( BLK_DEV *dev, uint32_t address, uint32_t len );
+
+BLK_DEV BLK_Dev_IFlash =
+{
+    "Internal flash",
+    0,                                                                          /* Capacity, set by BLK_IFlash_Init */
+    DEF_BLK_IFLASH_SECTOR,                                                      /* Sector_Size */
+    DEF_BLK_IFLASH_PAGE,                                                        /* Erase_Size */
+    0,                                                                          /* Block_Size */
+    DEF_BLK_IFLASH_PAGE,                                                        /* Prog_Size */
+    DEF_BLK_CAP_ERASE | DEF_BLK_CAP_MAPPED,                                     /* Caps */
+    NULL,                                                                       /* Base */
+    BLK_IFlash_Read,
+    BLK_IFlash_Write,
+    BLK_IFlash_Prog,
+    BLK_IFlash_Erase,
+    NULL,                                                                       /* Sync */
+    NULL,                                                                       /* Poll */
+    NULL,                                                                       /* Prepare */
+};
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Init
+* Description    : Set up the internal flash region from the linker symbols.
+*                  Block erase is offered when the region is 32K aligned.
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void BLK_IFlash_Init( void )
+{
+    BLK_Dev_IFlash.Base = (uint8_t *)IFLASH_UDISK_START_ADDR;
+    BLK_Dev_IFlash.Capacity = IFLASH_UDISK_SIZE & ~( DEF_BLK_IFLASH_SECTOR - 1 );
+    BLK_Dev_IFlash.Block_Size = 0;
+    if( ( ( IFLASH_UDISK_START_ADDR % DEF_BLK_IFLASH_BLOCK ) == 0 ) && ( BLK_Dev_IFlash.Capacity >= DEF_BLK_IFLASH_BLOCK ) )
+    {
+        BLK_Dev_IFlash.Block_Size = DEF_BLK_IFLASH_BLOCK;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Read
+* Description    : Copy from the mapped region
+* Input          : *dev, address, *pbuf, len, hint
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_IFlash_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint )
+{
+    (void)hint;
+    memcpy( pbuf, dev->Base + address, len );
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Page_Prog
+* Description    : Program one erased page and check it. The fast page
+*                  program takes whole words, an unaligned source is copied.
+* Input          : addr - FPEC address of the page
+*                  *pbuf - 256 bytes
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_IO
+*******************************************************************************/
+static uint8_t BLK_IFlash_Page_Prog( uint32_t addr, uint8_t *pbuf )
+{
+    if( (uint32_t)pbuf & 3 )
+    {
+        memcpy( BLK_IFlash_Page, pbuf, DEF_BLK_IFLASH_PAGE );
+        pbuf = BLK_IFlash_Page;
+    }
+    FLASH_ProgramPage_Fast( addr, (uint32_t *)pbuf );
+    if( memcmp( (uint8_t *)addr, pbuf, DEF_BLK_IFLASH_PAGE ) )
+    {
+        return DEF_BLK_ERR_IO;
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Erase
+* Description    : Erase pages, with one block erase for every aligned 32K
+* Input          : *dev, address, len - multiples of 256 bytes
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_IFlash_Erase( BLK_DEV *dev, uint32_t address, uint32_t len )
+{
+    uint32_t addr;
+
+    addr = (uint32_t)dev->Base + address;
+    FLASH_Unlock_Fast( );
+    while( len )
+    {
+        if( ( ( addr % DEF_BLK_IFLASH_BLOCK ) == 0 ) && ( len >= DEF_BLK_IFLASH_BLOCK ) )
+        {
+            FLASH_EraseBlock_32K_Fast( addr );
+            addr += DEF_BLK_IFLASH_BLOCK;
+            len -= DEF_BLK_IFLASH_BLOCK;
+        }
+        else
+        {
+            FLASH_ErasePage_Fast( addr );
+            addr += DEF_BLK_IFLASH_PAGE;
+            len -= DEF_BLK_IFLASH_PAGE;
+        }
+    }
+    FLASH_Lock_Fast( );
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Prog
+* Description    : Program erased pages and read each one back
+* Input          : *dev, *pbuf, address, len - multiples of 256 bytes, done
+* Output         : None
+* Return         : DEF_BLK_OK, DEF_BLK_ERR_RANGE or DEF_BLK_ERR_IO
+*******************************************************************************/
+static uint8_t BLK_IFlash_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    uint32_t addr, i;
+    uint8_t  s;
+
+    if( ( address % DEF_BLK_IFLASH_PAGE ) || ( len % DEF_BLK_IFLASH_PAGE ) )
+    {
+        return DEF_BLK_ERR_RANGE;
+    }
+    addr = (uint32_t)dev->Base + address;
+    s = DEF_BLK_OK;
+    FLASH_Unlock_Fast( );
+    for( i = 0; ( i < len ) && ( s == DEF_BLK_OK ); i += DEF_BLK_IFLASH_PAGE )
+    {
+        s = BLK_IFlash_Page_Prog( addr + i, pbuf + i );
+    }
+    FLASH_Lock_Fast( );
+    if( ( s == DEF_BLK_OK ) && done )
+    {
+        done( pbuf, DEF_BLK_OK );
+    }
+    return s;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_IFlash_Write
+* Description    : Rewrite whole sectors page by page. A page that already
+*                  holds the data is left alone, so a FAT or directory
+*                  sector written back with one entry changed costs one
+*                  page erase and program, and an unchanged one costs none.
+*                  Erased flash does not read as 0xFF on this part, so
+*                  every page that changes is erased.
+* Input          : *dev, *pbuf, address, len, done
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_IO
+*******************************************************************************/
+static uint8_t BLK_IFlash_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    uint32_t addr, i;
+    uint8_t  s;
+
+    addr = (uint32_t)dev->Base + address;
+    s = DEF_BLK_OK;
+    FLASH_Unlock_Fast( );
+    for( i = 0; ( i < len ) && ( s == DEF_BLK_OK ); i += DEF_BLK_IFLASH_PAGE )
+    {
+        if( memcmp( (uint8_t *)( addr + i ), pbuf + i, DEF_BLK_IFLASH_PAGE ) )
+        {
+            FLASH_ErasePage_Fast( addr + i );
+            s = BLK_IFlash_Page_Prog( addr + i, pbuf + i );
+        }
+    }
+    FLASH_Lock_Fast( );
+    if( ( s == DEF_BLK_OK ) && done )
+    {
+        done( pbuf, DEF_BLK_OK );
+    }
+    return s;
+}
+
+#endif
@@ -0,0 +1,299 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : BLK_SPI_FLASH.c
+* Description        : Block device backend for the external SPI NOR flash.
+*                      Writes go through the SPI_FLASH job queue, reads pick
+*                      the stream, the sector cache or the line cache by hint.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include "BLOCK_DEV.h"
+#include "SPI_FLASH.h"
+
+/******************************************************************************/
+/* Variable Definition */
+static uint8_t BLK_SPI_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint );
+static uint8_t BLK_SPI_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+static uint8_t BLK_SPI_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+static uint8_t BLK_SPI_Erase( BLK_DEV *dev, uint32_t address, uint32_t len );
+static uint8_t BLK_SPI_Sync( BLK_DEV *dev );
+static void BLK_SPI_Poll( BLK_DEV *dev );
+static void BLK_SPI_Prepare( BLK_DEV *dev );
+
+/* Writes in the job queue, oldest first. Jobs finish in queue order, so
+   the last job of a write completes the oldest entry. A write takes at
+   least one job, so the job queue size bounds this one. */
+typedef struct _BLK_SPI_WRITE
+{
+    uint8_t *pBuf;                                                              /* Buffer as passed to Write/Prog */
+    void    ( *Done )( uint8_t *pbuf, uint8_t status );
+}BLK_SPI_WRITE;
+
+static BLK_SPI_WRITE BLK_SPI_Write_Queue[ DEF_FLASH_JOB_QUEUE_SIZE ];
+static uint8_t BLK_SPI_Write_Head = 0;
+static uint8_t BLK_SPI_Write_Tail = 0;
+static volatile uint8_t BLK_SPI_Write_Status = DEF_BLK_OK;                      /* Worst status of the oldest write's jobs */
+static volatile uint8_t BLK_SPI_Failed = 0;                                     /* A write failed since the last Sync */
+
+BLK_DEV BLK_Dev_SPI_Flash =
+{
+    "SPI NOR",
+    0,                                                                          /* Capacity, set by BLK_SPI_Flash_Init */
+    SPI_FLASH_SectorSize,                                                       /* Sector_Size */
+    SPI_FLASH_SectorSize,                                                       /* Erase_Size */
+    0,                                                                          /* Block_Size */
+    SPI_FLASH_PageSize,                                                         /* Prog_Size */
+    DEF_BLK_CAP_ERASE | DEF_BLK_CAP_ASYNC | DEF_BLK_CAP_CACHED,                 /* Caps */
+    NULL,                                                                       /* Base */
+    BLK_SPI_Read,
+    BLK_SPI_Write,
+    BLK_SPI_Prog,
+    BLK_SPI_Erase,
+    BLK_SPI_Sync,
+    BLK_SPI_Poll,
+    BLK_SPI_Prepare,
+};
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Flash_Init
+* Description    : Fill in the SPI NOR geometry, call after FLASH_IC_Check
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void BLK_SPI_Flash_Init( void )
+{
+    uint8_t  i;
+    uint32_t size;
+
+    BLK_Dev_SPI_Flash.Capacity = Flash_Geometry.Capacity;
+    if( BLK_Dev_SPI_Flash.Capacity == 0 )
+    {
+        BLK_Dev_SPI_Flash.Capacity = Flash_Sector_Count * SPI_FLASH_SectorSize;
+    }
+    BLK_Dev_SPI_Flash.Prog_Size = Flash_Geometry.Page_Size;
+
+    /* Smallest erase above one sector, used to pre-erase long writes */
+    BLK_Dev_SPI_Flash.Block_Size = 0;
+    for( i = 0; i < 4; i++ )
+    {
+        size = Flash_Geometry.Erase_Size[ i ];
+        if( ( size > SPI_FLASH_SectorSize ) &&
+            ( ( BLK_Dev_SPI_Flash.Block_Size == 0 ) || ( size < BLK_Dev_SPI_Flash.Block_Size ) ) )
+        {
+            BLK_Dev_SPI_Flash.Block_Size = size;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Read
+* Description    : DEF_BLK_RD_SEQ continues the open read stream and leaves
+*                  it open, so the next sequential read costs no command.
+*                  DEF_BLK_RD_META goes through the sector cache and
+*                  DEF_BLK_RD_SMALL through the line cache; both end the
+*                  stream so CS# is not left low.
+* Input          : *dev, address, *pbuf, len, hint
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_SPI_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint )
+{
+    (void)dev;
+    FLASH_Wake( );
+    if( hint == DEF_BLK_RD_META )
+    {
+        FLASH_Cache_Read( address, pbuf, len );
+    }
+    else if( hint == DEF_BLK_RD_SMALL )
+    {
+        FLASH_Line_Read( address, pbuf, len );
+        FLASH_Stream_Close( );
+    }
+    else
+    {
+        FLASH_Stream_Read( address, pbuf, len );
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Sector_Done
+* Description    : Job callback of all but the last job of a write, keeps
+*                  the worst status for the last one
+* Input          : *pbuf
+*                  status - 0 = success, 1 = verify failed
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void BLK_SPI_Sector_Done( uint8_t *pbuf, uint8_t status )
+{
+    (void)pbuf;
+    if( status )
+    {
+        BLK_SPI_Write_Status = DEF_BLK_ERR_IO;
+        BLK_SPI_Failed = 1;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Write_Done
+* Description    : Job callback of the last job of a write, hands the status
+*                  of the whole write to its done callback
+* Input          : *pbuf
+*                  status - 0 = success, 1 = verify failed
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void BLK_SPI_Write_Done( uint8_t *pbuf, uint8_t status )
+{
+    BLK_SPI_WRITE *wr;
+
+    BLK_SPI_Sector_Done( pbuf, status );
+    wr = &BLK_SPI_Write_Queue[ BLK_SPI_Write_Tail ];
+    BLK_SPI_Write_Tail = ( BLK_SPI_Write_Tail + 1 ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+    status = BLK_SPI_Write_Status;
+    BLK_SPI_Write_Status = DEF_BLK_OK;
+    if( wr->Done )
+    {
+        wr->Done( wr->pBuf, status );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Write_Add
+* Description    : Note a write before its jobs are queued
+* Input          : *pbuf, done
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void BLK_SPI_Write_Add( uint8_t *pbuf, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    BLK_SPI_Write_Queue[ BLK_SPI_Write_Head ].pBuf = pbuf;
+    BLK_SPI_Write_Queue[ BLK_SPI_Write_Head ].Done = done;
+    BLK_SPI_Write_Head = ( BLK_SPI_Write_Head + 1 ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Write
+* Description    : Queue FLASH_Job_Update for every 4 KByte sector, which
+*                  skips sectors that already hold the data. Nothing is
+*                  queued unless the queue has room for all of them.
+* Input          : *dev, *pbuf, address, len
+*                  done - follows the last sector, with DEF_BLK_ERR_IO if
+*                  any sector still failed verify after the retries
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_BUSY
+*******************************************************************************/
+static uint8_t BLK_SPI_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    uint32_t n, i;
+
+    (void)dev;
+    n = len / SPI_FLASH_SectorSize;
+    if( n > (uint32_t)( DEF_FLASH_JOB_QUEUE_SIZE - 1 - FLASH_Job_Pending( ) ) )
+    {
+        return DEF_BLK_ERR_BUSY;
+    }
+    /* tRES1 runs out while the jobs wait for BLK_Poll */
+    FLASH_Wake( );
+    BLK_SPI_Write_Add( pbuf, done );
+    for( i = 0; i < n; i++ )
+    {
+        FLASH_Job_Update( pbuf + i * SPI_FLASH_SectorSize, address + i * SPI_FLASH_SectorSize,
+                          ( i == n - 1 ) ? BLK_SPI_Write_Done : BLK_SPI_Sector_Done );
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Prog
+* Description    : Queue a program of an erased range
+* Input          : *dev, *pbuf, address, len
+*                  done - with DEF_BLK_ERR_IO if the range failed verify
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_BUSY
+*******************************************************************************/
+static uint8_t BLK_SPI_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    (void)dev;
+    FLASH_Wake( );
+    BLK_SPI_Write_Add( pbuf, done );
+    if( FLASH_Job_Program( pbuf, address, len, BLK_SPI_Write_Done ) )
+    {
+        /* Not queued, nothing can have completed the entry */
+        BLK_SPI_Write_Head = ( BLK_SPI_Write_Head - 1 ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+        return DEF_BLK_ERR_BUSY;
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Erase
+* Description    : Queue an erase, the job engine picks the largest commands
+* Input          : *dev, address, len
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_BUSY
+*******************************************************************************/
+static uint8_t BLK_SPI_Erase( BLK_DEV *dev, uint32_t address, uint32_t len )
+{
+    (void)dev;
+    FLASH_Wake( );
+    if( FLASH_Job_Erase_Range( address, len, NULL ) )
+    {
+        return DEF_BLK_ERR_BUSY;
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Sync
+* Description    : End the read stream and run every queued job
+* Input          : *dev
+* Output         : None
+* Return         : DEF_BLK_OK, or DEF_BLK_ERR_IO if a write has failed verify
+*                  since the last call, after every retry
+*******************************************************************************/
+static uint8_t BLK_SPI_Sync( BLK_DEV *dev )
+{
+    (void)dev;
+    FLASH_Stream_Close( );
+    FLASH_Job_Flush( );
+    if( BLK_SPI_Failed )
+    {
+        BLK_SPI_Failed = 0;
+        return DEF_BLK_ERR_IO;
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Poll
+* Description    : Run the job engine a step
+* Input          : *dev
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void BLK_SPI_Poll( BLK_DEV *dev )
+{
+    (void)dev;
+    if( FLASH_Job_Pending( ) )
+    {
+        FLASH_Wake( );
+    }
+    FLASH_Job_Poll( );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_SPI_Prepare
+* Description    : Start the release from deep power-down, tRES1 then runs
+*                  while the caller gets ready for the access
+* Input          : *dev
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void BLK_SPI_Prepare( BLK_DEV *dev )
+{
+    (void)dev;
+    FLASH_Wake( );
+}
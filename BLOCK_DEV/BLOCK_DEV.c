@@ -0,0 +1,274 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : BLOCK_DEV.c
+* Description        : Block device calls and the RAM backend. The calls check
+*                      the range and fill in what a backend leaves out, so
+*                      the USB disk and FAT12 layers never test the medium.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include "BLOCK_DEV.h"
+
+/******************************************************************************/
+/* Variable Definition */
+static uint8_t BLK_RAM_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint );
+static uint8_t BLK_RAM_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+static uint8_t BLK_RAM_Erase( BLK_DEV *dev, uint32_t address, uint32_t len );
+
+BLK_DEV BLK_Dev_RAM =
+{
+    "RAM",
+    0,                                                                          /* Capacity, set by BLK_RAM_Init */
+    0,                                                                          /* Sector_Size */
+    0,                                                                          /* Erase_Size */
+    0,                                                                          /* Block_Size */
+    1,                                                                          /* Prog_Size */
+    DEF_BLK_CAP_MAPPED,                                                         /* Caps */
+    NULL,                                                                       /* Base */
+    BLK_RAM_Read,
+    BLK_RAM_Write,
+    BLK_RAM_Write,                                                              /* Prog */
+    BLK_RAM_Erase,
+    NULL,                                                                       /* Sync */
+    NULL,                                                                       /* Poll */
+    NULL,                                                                       /* Prepare */
+};
+
+/*******************************************************************************
+* Function Name  : BLK_Range
+* Description    : Check that a range lies inside the device
+* Input          : *dev, address, len
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx
+*******************************************************************************/
+static uint8_t BLK_Range( BLK_DEV *dev, uint32_t address, uint32_t len )
+{
+    if( ( dev == NULL ) || ( dev->Capacity == 0 ) )
+    {
+        return DEF_BLK_ERR_NO_DEV;
+    }
+    if( ( address > dev->Capacity ) || ( len > dev->Capacity - address ) )
+    {
+        return DEF_BLK_ERR_RANGE;
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Read
+* Description    : Read from a block device
+* Input          : *dev
+*                  address
+*                  *pbuf
+*                  len
+*                  hint - DEF_BLK_RD_xx, lets the backend pick its fastest path
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx
+*******************************************************************************/
+uint8_t BLK_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint )
+{
+    uint8_t s;
+
+    s = BLK_Range( dev, address, len );
+    if( s != DEF_BLK_OK )
+    {
+        return s;
+    }
+    if( len == 0 )
+    {
+        return DEF_BLK_OK;
+    }
+    return dev->Read( dev, address, pbuf, len, hint );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Write
+* Description    : Rewrite whole sectors, erasing first as the medium needs
+* Input          : *dev
+*                  *pbuf - kept until done( pbuf, status )
+*                  address, len - multiples of Sector_Size
+*                  done - completion callback, may be NULL
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx, done is not called on error
+*******************************************************************************/
+uint8_t BLK_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    uint8_t s;
+
+    s = BLK_Range( dev, address, len );
+    if( s != DEF_BLK_OK )
+    {
+        return s;
+    }
+    if( ( address % dev->Sector_Size ) || ( len % dev->Sector_Size ) )
+    {
+        return DEF_BLK_ERR_RANGE;
+    }
+    return dev->Write( dev, pbuf, address, len, done );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Prog
+* Description    : Program a range erased before by BLK_Erase
+* Input          : *dev
+*                  *pbuf - kept until done( pbuf, status )
+*                  address, len
+*                  done - completion callback, may be NULL
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx, done is not called on error
+*******************************************************************************/
+uint8_t BLK_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    uint8_t s;
+
+    s = BLK_Range( dev, address, len );
+    if( s != DEF_BLK_OK )
+    {
+        return s;
+    }
+    if( dev->Prog == NULL )
+    {
+        return dev->Write( dev, pbuf, address, len, done );
+    }
+    return dev->Prog( dev, pbuf, address, len, done );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Erase
+* Description    : Erase a range, a no-op on media without erase
+* Input          : *dev
+*                  address, len - multiples of Erase_Size
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx
+*******************************************************************************/
+uint8_t BLK_Erase( BLK_DEV *dev, uint32_t address, uint32_t len )
+{
+    uint8_t s;
+
+    s = BLK_Range( dev, address, len );
+    if( s != DEF_BLK_OK )
+    {
+        return s;
+    }
+    if( dev->Erase == NULL )
+    {
+        return DEF_BLK_OK;
+    }
+    if( dev->Erase_Size && ( ( address % dev->Erase_Size ) || ( len % dev->Erase_Size ) ) )
+    {
+        return DEF_BLK_ERR_RANGE;
+    }
+    return dev->Erase( dev, address, len );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Sync
+* Description    : Finish everything queued and end open reads, so the
+*                  medium holds all data written so far
+* Input          : *dev
+* Output         : None
+* Return         : DEF_BLK_OK or DEF_BLK_ERR_xx
+*******************************************************************************/
+uint8_t BLK_Sync( BLK_DEV *dev )
+{
+    if( ( dev == NULL ) || ( dev->Sync == NULL ) )
+    {
+        return DEF_BLK_OK;
+    }
+    return dev->Sync( dev );
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Poll
+* Description    : Run queued work of a DEF_BLK_CAP_ASYNC device a step
+*                  further, without waiting. Call it from the main loop.
+* Input          : *dev
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void BLK_Poll( BLK_DEV *dev )
+{
+    if( dev && dev->Poll )
+    {
+        dev->Poll( dev );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_Prepare
+* Description    : Tell the device an access is coming, so a medium that
+*                  sleeps can start waking up now. Returns at once, a no-op
+*                  on media that are always ready. Safe to call from an
+*                  interrupt.
+* Input          : *dev
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void BLK_Prepare( BLK_DEV *dev )
+{
+    if( dev && dev->Prepare )
+    {
+        dev->Prepare( dev );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : BLK_RAM_Init
+* Description    : Set up the RAM backend on a buffer. On the host the
+*                  buffer holds a disk image loaded from a file.
+* Input          : *pbuf - disk data, kept
+*                  size - bytes
+*                  sector_size - write unit
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void BLK_RAM_Init( uint8_t *pbuf, uint32_t size, uint32_t sector_size )
+{
+    BLK_Dev_RAM.Base = pbuf;
+    BLK_Dev_RAM.Capacity = size;
+    BLK_Dev_RAM.Sector_Size = sector_size;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_RAM_Read
+* Description    : RAM backend read
+* Input          : *dev, address, *pbuf, len, hint
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_RAM_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint )
+{
+    (void)hint;
+    memcpy( pbuf, dev->Base + address, len );
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_RAM_Write
+* Description    : RAM backend write and program
+* Input          : *dev, *pbuf, address, len, done
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_RAM_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    memcpy( dev->Base + address, pbuf, len );
+    if( done )
+    {
+        done( pbuf, DEF_BLK_OK );
+    }
+    return DEF_BLK_OK;
+}
+
+/*******************************************************************************
+* Function Name  : BLK_RAM_Erase
+* Description    : RAM backend erase, fills with 0xFF like flash
+* Input          : *dev, address, len
+* Output         : None
+* Return         : DEF_BLK_OK
+*******************************************************************************/
+static uint8_t BLK_RAM_Erase( BLK_DEV *dev, uint32_t address, uint32_t len )
+{
+    memset( dev->Base + address, 0xFF, len );
+    return DEF_BLK_OK;
+}
@@ -0,0 +1,93 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : BLOCK_DEV.h
+* Description        : Block device interface shared by the USB disk and the
+*                      FAT12 layer, with SPI NOR flash, internal flash and
+*                      RAM image backends
+*******************************************************************************/
+#ifndef __BLOCK_DEV_H
+#define __BLOCK_DEV_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+/******************************************************************************/
+/* header files */
+#include <stdint.h>
+#include <string.h>
+
+/******************************************************************************/
+/* Capabilities */
+#define DEF_BLK_CAP_ERASE          0x01                                         /* Prog only clears bits, the range must be erased first */
+#define DEF_BLK_CAP_ASYNC          0x02                                         /* Write/Prog/Erase are queued, Poll runs them */
+#define DEF_BLK_CAP_MAPPED         0x04                                         /* Base points at the data, reads may use it directly */
+#define DEF_BLK_CAP_CACHED         0x08                                         /* Read hints select RAM caches */
+
+/* Read hints */
+#define DEF_BLK_RD_SEQ             0x00                                         /* Long sequential read, may stay open for the next one */
+#define DEF_BLK_RD_META            0x01                                         /* Read again and again: boot sector, FAT, directory */
+#define DEF_BLK_RD_SMALL           0x02                                         /* A few bytes at scattered addresses */
+
+/* Return codes */
+#define DEF_BLK_OK                 0x00
+#define DEF_BLK_ERR_RANGE          0x01                                         /* Outside the device or not aligned */
+#define DEF_BLK_ERR_BUSY           0x02                                         /* Queue full, Poll and try again */
+#define DEF_BLK_ERR_IO             0x03                                         /* Medium reported a failure */
+#define DEF_BLK_ERR_NO_DEV         0x04                                         /* Backend not initialized */
+
+/******************************************************************************/
+/* Backend configuration */
+#define DEF_BLK_IFLASH_EN          1                                            /* 1: build the internal flash backend, region in Ld/Link.ld */
+#define DEF_BLK_IFLASH_PAGE        256                                          /* Fast erase/program page */
+#define DEF_BLK_IFLASH_BLOCK       32768                                        /* Fast block erase */
+#define DEF_BLK_IFLASH_SECTOR      512                                          /* Write unit */
+
+/******************************************************************************/
+/* Block device. Write and Prog take the buffer until done( pbuf, status )
+   is called; backends without DEF_BLK_CAP_ASYNC call it before returning.
+   status is DEF_BLK_OK, or DEF_BLK_ERR_IO when a queued write could not be
+   completed; a write that fails before returning returns the error and
+   does not call done. */
+typedef struct _BLK_DEV
+{
+    const char *Name;
+    uint32_t Capacity;                                                          /* Bytes */
+    uint32_t Sector_Size;                                                       /* Write unit, Write takes whole sectors */
+    uint32_t Erase_Size;                                                        /* Smallest erase, 0: no erase needed */
+    uint32_t Block_Size;                                                        /* Bulk erase above Sector_Size, 0: none */
+    uint16_t Prog_Size;                                                         /* Program page */
+    uint8_t  Caps;                                                              /* DEF_BLK_CAP_xx */
+    uint8_t  *Base;                                                             /* Data address with DEF_BLK_CAP_MAPPED */
+    uint8_t  ( *Read )( struct _BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint );
+    uint8_t  ( *Write )( struct _BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+    uint8_t  ( *Prog )( struct _BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+    uint8_t  ( *Erase )( struct _BLK_DEV *dev, uint32_t address, uint32_t len );
+    uint8_t  ( *Sync )( struct _BLK_DEV *dev );
+    void     ( *Poll )( struct _BLK_DEV *dev );
+    void     ( *Prepare )( struct _BLK_DEV *dev );                              /* An access is coming, may be NULL */
+}BLK_DEV;
+
+/******************************************************************************/
+/* Variable Definition */
+extern BLK_DEV BLK_Dev_SPI_Flash;                                               /* External SPI NOR over SPI_FLASH.h */
+extern BLK_DEV BLK_Dev_IFlash;                                                  /* Internal flash region */
+extern BLK_DEV BLK_Dev_RAM;                                                     /* RAM, or a file image on the host */
+
+/******************************************************************************/
+/* external functions */
+extern uint8_t BLK_Read( BLK_DEV *dev, uint32_t address, uint8_t *pbuf, uint32_t len, uint8_t hint );
+extern uint8_t BLK_Write( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern uint8_t BLK_Prog( BLK_DEV *dev, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern uint8_t BLK_Erase( BLK_DEV *dev, uint32_t address, uint32_t len );
+extern uint8_t BLK_Sync( BLK_DEV *dev );
+extern void BLK_Poll( BLK_DEV *dev );
+extern void BLK_Prepare( BLK_DEV *dev );
+extern void BLK_SPI_Flash_Init( void );
+extern void BLK_IFlash_Init( void );
+extern void BLK_RAM_Init( uint8_t *pbuf, uint32_t size, uint32_t sector_size );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -1,6 +1,6 @@
 
 #include <stdint.h>
-#include "SPI_FLASH.h"
+#include "BLOCK_DEV.h"
 #include "FAT12.h"
 
 
@@ -24,45 +24,130 @@ uint32_t read32(const uint8_t *buf, uint16_t offset) {
     return result;
 }
 
+// Block device of the last mounted volume, the SPI flash until then
+static BLK_DEV *fat12_dev = &BLK_Dev_SPI_Flash;
+
+// Unpacked FAT of the last mounted volume. A FAT12 volume has at most
+// 4084 clusters, so the whole table is 8 KByte at most.
+static uint16_t fat12_fat_cache[FAT12_MAX_CLUSTERS + 2];
+static struct FAT12_VOLUME *fat12_fat_owner = NULL;
+
+// The _spi readers pass BLK_RD_SMALL, which the SPI flash serves from its
+// line cache: the first read of a line costs one short read command,
+// nearby fields come from RAM.
+// The boot sector is read with BLK_RD_META, through the sector cache, the
+// root directory in one stream by fat12_dir_next.
 uint16_t read16_spi(uint32_t address) {
     uint8_t buf[2];
-    FLASH_RD_Block_Start(address);
-    FLASH_RD_Block(buf, sizeof(buf));
-    FLASH_RD_Block_End();
+    BLK_Read(fat12_dev, address, buf, sizeof(buf), DEF_BLK_RD_SMALL);
     return read16(buf, 0);
 }
 
 uint32_t read32_spi(uint32_t address) {
     uint8_t buf[4];
-    FLASH_RD_Block_Start(address);
-    FLASH_RD_Block(buf, sizeof(buf));
-    FLASH_RD_Block_End();
+    BLK_Read(fat12_dev, address, buf, sizeof(buf), DEF_BLK_RD_SMALL);
     return read32(buf, 0);
 }
 
 
-void load_bpb_spi(struct BPB *bpb) {
-    uint32_t bpb_address = 0;  // Address where BPB is located in the flash
-    uint8_t buffer[BPB_SIZE];  // Adjust BPB_SIZE to your BPB size
+static int is_power_of_2(uint32_t v) {
+    return v && !(v & (v - 1));
+}
+
+// Read the first FAT in one sequential stream and unpack the 12-bit
+// entries, two per three bytes, into fat12_fat_cache
+static int fat12_load_fat(struct FAT12_VOLUME *vol) {
+    uint8_t chunk[192];     // 128 entries, a multiple of 3 bytes
+    uint32_t entries = vol->cluster_count + 2;
+    uint32_t packed = (entries * 3 + 1) / 2;
+    uint32_t done, len, i, n;
+    uint16_t *fat = fat12_fat_cache;
+
+    vol->fat_dirty = 0;
+    n = 0;
+    for (done = 0; done < packed; done += len) {
+        len = packed - done;
+        if (len > sizeof(chunk)) len = sizeof(chunk);
+        if (BLK_Read(vol->dev, vol->fat_offset + done, chunk, len, DEF_BLK_RD_SEQ) != DEF_BLK_OK) {
+            vol->fat = NULL;
+            return FAT12_ERR_IO;
+        }
+        for (i = 0; i + 1 < len && n < entries; i += 3) {
+            fat[n++] = chunk[i] | ((chunk[i + 1] & 0x0F) << 8);
+            if (n < entries) fat[n++] = (chunk[i + 1] >> 4) | (chunk[i + 2] << 4);
+        }
+    }
+    fat12_fat_owner = vol;
+    vol->fat = fat;
+    return FAT12_OK;
+}
 
-    FLASH_RD_Block_Start(bpb_address);
-    FLASH_RD_Block(buffer, sizeof(buffer));
-    FLASH_RD_Block_End();
+// Mount the FAT12 volume on dev: one boot sector read, every BPB field is
+// parsed from that buffer. The signature and geometry are checked and the
+// FAT, root directory and data offsets are worked out once for the reads
+// that follow.
+int fat12_mount(struct FAT12_VOLUME *vol, BLK_DEV *dev) {
+    uint8_t buffer[BPB_SIZE];
+    struct BPB *bpb = &vol->bpb;
+    uint32_t clusters;
+
+    memset(vol, 0, sizeof(*vol));
+    if (BLK_Read(dev, 0, buffer, sizeof(buffer), DEF_BLK_RD_META) != DEF_BLK_OK) {
+        return FAT12_ERR_IO;
+    }
+    if (buffer[510] != 0x55 || buffer[511] != 0xAA) {
+        return FAT12_ERR_SIGNATURE;
+    }
 
-    bpb->bytes_per_sector = read16_spi(bpb_address + 11);
+    bpb->bytes_per_sector = read16(buffer, 11);
     bpb->sectors_per_cluster = buffer[13];
-    bpb->reserved_sectors = read16_spi(bpb_address + 14);
+    bpb->reserved_sectors = read16(buffer, 14);
     bpb->num_fats = buffer[16];
-    bpb->root_dir_entries = read16_spi(bpb_address + 17);
-    bpb->total_sectors = read16_spi(bpb_address + 19);
-    bpb->sectors_per_fat = read16_spi(bpb_address + 22);
+    bpb->root_dir_entries = read16(buffer, 17);
+    bpb->total_sectors = read16(buffer, 19);
+    bpb->sectors_per_fat = read16(buffer, 22);
+    vol->total_sectors = bpb->total_sectors ? bpb->total_sectors : read32(buffer, 32);
+
+    if (bpb->bytes_per_sector < 512 || bpb->bytes_per_sector > 4096 || !is_power_of_2(bpb->bytes_per_sector) ||
+        !is_power_of_2(bpb->sectors_per_cluster) || bpb->reserved_sectors == 0 ||
+        bpb->num_fats == 0 || bpb->num_fats > 2 || bpb->root_dir_entries == 0 || bpb->sectors_per_fat == 0) {
+        return FAT12_ERR_GEOMETRY;
+    }
 
-    // Calculate root directory sector and size
     bpb->root_dir_sector = bpb->reserved_sectors + (bpb->num_fats * bpb->sectors_per_fat);
     bpb->root_dir_size = (bpb->root_dir_entries * FAT12_ENTRY_SIZE + bpb->bytes_per_sector - 1) / bpb->bytes_per_sector;
-
-    // Calculate start of data region
     bpb->data_start_sector = bpb->root_dir_sector + bpb->root_dir_size;
+    if (vol->total_sectors <= bpb->data_start_sector ||
+        (uint64_t)vol->total_sectors * bpb->bytes_per_sector > dev->Capacity) {
+        return FAT12_ERR_GEOMETRY;
+    }
+
+    // FAT12 has fewer than 4085 clusters and a FAT big enough to hold them
+    clusters = (vol->total_sectors - bpb->data_start_sector) / bpb->sectors_per_cluster;
+    if (clusters == 0 || clusters >= 4085 ||
+        (clusters + 2) * 3 / 2 > (uint32_t)bpb->sectors_per_fat * bpb->bytes_per_sector) {
+        return FAT12_ERR_GEOMETRY;
+    }
+
+    vol->dev = dev;
+    vol->fat_offset = (uint32_t)bpb->reserved_sectors * bpb->bytes_per_sector;
+    vol->fat_size = (uint32_t)bpb->sectors_per_fat * bpb->bytes_per_sector;
+    vol->root_dir_offset = bpb->root_dir_sector * bpb->bytes_per_sector;
+    vol->root_dir_bytes = (uint32_t)bpb->root_dir_entries * FAT12_ENTRY_SIZE;
+    vol->data_offset = bpb->data_start_sector * bpb->bytes_per_sector;
+    vol->cluster_size = (uint32_t)bpb->sectors_per_cluster * bpb->bytes_per_sector;
+    vol->cluster_count = clusters;
+    vol->mounted = 1;
+    fat12_dev = dev;
+
+    // The cache holds one volume, mounting another takes it over
+    if (fat12_fat_owner && fat12_fat_owner != vol) {
+        fat12_fat_owner->fat = NULL;
+    }
+    if (fat12_load_fat(vol) != FAT12_OK) {
+        vol->mounted = 0;
+        return FAT12_ERR_IO;
+    }
 
 #ifdef DEBUGFAT12
     printf("        FAT12 data\n");
@@ -79,6 +164,112 @@ void load_bpb_spi(struct BPB *bpb) {
     printf("Data_start_sector: %d\n", bpb->data_start_sector);
     printf("=========================\n");
 #endif
+    return FAT12_OK;
+}
+
+void fat12_unmount(struct FAT12_VOLUME *vol) {
+    vol->mounted = 0;
+    vol->fat = NULL;
+    if (fat12_fat_owner == vol) {
+        fat12_fat_owner = NULL;
+    }
+}
+
+// Next cluster of a chain, one array lookup. A FAT written since the last
+// lookup is reloaded first, after the device has finished its writes.
+// Clusters outside the volume, or a volume without the cache, end the chain.
+uint16_t fat12_next_cluster(struct FAT12_VOLUME *vol, uint16_t cluster) {
+    if (!vol->mounted || cluster < 2 || cluster > vol->cluster_count + 1) {
+        return 0xFFF;
+    }
+    if (vol->fat_dirty || vol->fat == NULL) {
+        BLK_Sync(vol->dev);
+        if (fat12_load_fat(vol) != FAT12_OK) {
+            return 0xFFF;
+        }
+    }
+    return vol->fat[cluster];
+}
+
+// Tell the FAT cache that a range of dev has been written, for example by
+// the USB host through SW_UDISK. Only sets a flag, so interrupts may call it.
+void fat12_disk_written(BLK_DEV *dev, uint32_t address, uint32_t len) {
+    struct FAT12_VOLUME *vol = fat12_fat_owner;
+
+    if (vol && vol->dev == dev &&
+        address < vol->fat_offset + vol->fat_size && address + len > vol->fat_offset) {
+        vol->fat_dirty = 1;
+    }
+}
+
+// Older entry point: mounts the last used device and returns its BPB,
+// all zero when there is no valid volume so the listings find nothing.
+// The volume lives on the stack, so it is unmounted again before return
+// and the FAT cache never points at it afterwards.
+void load_bpb_spi(struct BPB *bpb) {
+    struct FAT12_VOLUME vol;
+
+    fat12_mount(&vol, fat12_dev);
+    *bpb = vol.bpb;
+    if (!vol.mounted) {
+        memset(bpb, 0, sizeof(*bpb));
+    }
+    fat12_unmount(&vol);
+}
+
+
+// Root directory scan. The directory is read in sector-sized chunks with
+// BLK_RD_SEQ, so a whole listing or lookup is one streamed read (by DMA on
+// the SPI flash) and the entries are handed out from RAM.
+#define FAT12_DIR_CHUNK     512
+
+struct FAT12_DIR {
+    BLK_DEV *dev;
+    uint32_t address;       // Next chunk
+    uint16_t left;          // Entries not read yet
+    uint16_t count;         // Entries in the chunk
+    uint16_t index;         // Next entry in the chunk
+    uint8_t error;          // The scan stopped on a read error
+};
+
+static uint8_t fat12_dir_buf[FAT12_DIR_CHUNK];
+
+static void fat12_dir_open(struct FAT12_DIR *dir, BLK_DEV *dev, uint32_t offset, uint16_t entries) {
+    dir->dev = dev;
+    dir->address = offset;
+    dir->left = entries;
+    dir->count = 0;
+    dir->index = 0;
+    dir->error = 0;
+}
+
+// Next 32-byte entry, NULL past the last used entry or on a read error
+static const uint8_t *fat12_dir_next(struct FAT12_DIR *dir) {
+    const uint8_t *entry;
+    uint32_t len;
+
+    if (dir->index == dir->count) {
+        if (!dir->left) {
+            return NULL;
+        }
+        dir->count = dir->left < FAT12_DIR_CHUNK / FAT12_ENTRY_SIZE ? dir->left : FAT12_DIR_CHUNK / FAT12_ENTRY_SIZE;
+        len = (uint32_t)dir->count * FAT12_ENTRY_SIZE;
+        if (BLK_Read(dir->dev, dir->address, fat12_dir_buf, len, DEF_BLK_RD_SEQ) != DEF_BLK_OK) {
+            dir->left = dir->count = dir->index = 0;
+            dir->error = 1;
+            return NULL;
+        }
+        dir->address += len;
+        dir->left -= dir->count;
+        dir->index = 0;
+    }
+    entry = fat12_dir_buf + dir->index * FAT12_ENTRY_SIZE;
+    if (entry[0] == 0x00) {     // No more entries
+        dir->left = dir->count = dir->index = 0;
+        return NULL;
+    }
+    dir->index++;
+    return entry;
 }
 
 
@@ -97,34 +288,28 @@ uint32_t get_file_location_spi(const struct BPB *bpb, uint16_t starting_cluster)
 // Function to list files from the root directory and their locations
 void list_files_spi(struct BPB *bpb) {
     uint32_t root_dir_offset = bpb->root_dir_sector * bpb->bytes_per_sector;
-    uint8_t entry[FAT12_ENTRY_SIZE];
+    struct FAT12_DIR dir;
+    const uint8_t *entry;
+    uint16_t i = 0;
 #ifdef DEBUGFAT12
     printf("Start listing files from the FLASH\n");
     printf("Number of root dir entry %d\n", bpb->root_dir_entries);
 #endif
     // The entry address refers to the location of the file's metadata (e.g., name, size, starting cluster) in the root directory
 
-    for (uint16_t i = 0; i < bpb->root_dir_entries; i++) {
-        uint32_t entry_address = root_dir_offset + i * FAT12_ENTRY_SIZE; // entry adr + file number * entry size
-
+    fat12_dir_open(&dir, fat12_dev, root_dir_offset, bpb->root_dir_entries);
+    for (; (entry = fat12_dir_next(&dir)) != NULL; i++) {
 #ifdef DEBUGFAT12
-        printf("File %d starts at entry address 0x%X\n", i, entry_address);
+        printf("File %d starts at entry address 0x%X\n", i, root_dir_offset + i * FAT12_ENTRY_SIZE);
 #endif
-        FLASH_RD_Block_Start(entry_address);
-        FLASH_RD_Block(entry, sizeof(entry));
-        FLASH_RD_Block_End();
-
-        // First byte 0x00 indicates no more entries
-        if (entry[0] == 0x00) break;
-
         // Check if it's a valid file (skip deleted/unused entries)
         if ((uint8_t)entry[0] == 0xE5 || (entry[11] & 0x08)) continue;
 
         // Extract filename (8 chars) and extension (3 chars)
         char filename[9] = {0};  // 8 characters + null terminator
         char ext[4] = {0};       // 3 characters + null terminator
-        strncpy(filename, (char*)entry, 8);
-        strncpy(ext, (char*)entry + 8, 3);
+        strncpy(filename, (const char*)entry, 8);
+        strncpy(ext, (const char*)entry + 8, 3);
 
         // ================================================================
 
@@ -154,27 +339,20 @@ void list_files_spi(struct BPB *bpb) {
 // Function to get the size of a specific file
 uint32_t get_file_size_spi(struct BPB *bpb, const char *filename_to_find) {
     uint32_t root_dir_offset = bpb->root_dir_sector * bpb->bytes_per_sector;
-    uint8_t entry[FAT12_ENTRY_SIZE];
+    struct FAT12_DIR dir;
+    const uint8_t *entry;
 
     // Iterate through the root directory entries
-    for (uint16_t i = 0; i < bpb->root_dir_entries; i++) {
-        uint32_t entry_address = root_dir_offset + i * FAT12_ENTRY_SIZE;
-
-        FLASH_RD_Block_Start(entry_address);
-        FLASH_RD_Block(entry, sizeof(entry));
-        FLASH_RD_Block_End();
-
-        // First byte 0x00 indicates no more entries
-        if (entry[0] == 0x00) break;
-
+    fat12_dir_open(&dir, fat12_dev, root_dir_offset, bpb->root_dir_entries);
+    while ((entry = fat12_dir_next(&dir)) != NULL) {
         // Check if it's a valid file (skip deleted/unused entries)
         if ((uint8_t)entry[0] == 0xE5 || (entry[11] & 0x08)) continue;
 
         // Extract filename (8 chars) and extension (3 chars)
         char filename[9] = {0};
         char ext[4] = {0};
-        strncpy(filename, entry, 8);
-        strncpy(ext, entry + 8, 3);
+        strncpy(filename, (const char*)entry, 8);
+        strncpy(ext, (const char*)entry + 8, 3);
 
         // Make the file name to be normal, not 8.3 !!!
 
@@ -205,166 +383,234 @@ uint32_t get_file_size_spi(struct BPB *bpb, const char *filename_to_find) {
 }
 
 
-/*
-// Function to get the next cluster from the FAT12 table using SPI
-uint16_t get_next_cluster_spi(const struct BPB *bpb, uint16_t current_cluster) {
-    // FAT12 uses 1.5 bytes per cluster entry (12 bits)
-    uint32_t fat_offset = bpb->reserved_sectors * bpb->bytes_per_sector;
-    uint32_t entry_offset = current_cluster + (current_cluster / 2);  // 1.5-byte entries
-
-    // Compute the starting byte for the FAT entry
-    uint32_t fat_start_byte = fat_offset + entry_offset;
+// Build "NAME.EXT" from an 8.3 directory entry, without the padding
+static void fat12_entry_name(const uint8_t *entry, char *name) {
+    char filename[9] = {0};
+    char ext[4] = {0};
 
-    uint16_t next_cluster = 0;
-    
-    if (current_cluster & 1) {
-        // Odd cluster, read 12-bit value spanning 1.5 bytes
-        uint8_t entry_value1 = spi_read_byte(fat_start_byte);
-        uint8_t entry_value2 = spi_read_byte(fat_start_byte + 1);
-        next_cluster = (entry_value1 >> 4) | (entry_value2 << 4);
-    } else {
-        // Even cluster, read 12-bit value spanning 2 bytes
-        uint8_t entry_value1 = spi_read_byte(fat_start_byte);
-        uint8_t entry_value2 = spi_read_byte(fat_start_byte + 1);
-        next_cluster = (entry_value1 | (entry_value2 << 8)) & 0x0FFF;
+    memcpy(filename, entry, 8);
+    memcpy(ext, entry + 8, 3);
+    for (int j = 7; j >= 0 && filename[j] == ' '; j--) {
+        filename[j] = '\0';
     }
-
-    return next_cluster;
+    for (int j = 2; j >= 0 && ext[j] == ' '; j--) {
+        ext[j] = '\0';
+    }
+    snprintf(name, FAT12_FILENAME_LENGTH + 2, "%.8s.%.3s", filename, ext);
 }
-*/
-
-
-
 
+// Find a file in the root directory, entry receives its 32 bytes
+static int fat12_find(struct FAT12_VOLUME *vol, const char *name, uint8_t *entry) {
+    char full_filename[FAT12_FILENAME_LENGTH + 2];
+    struct FAT12_DIR dir;
+    const uint8_t *e;
 
-/*
-// Function to get the next cluster from the FAT12 table
-uint16_t get_next_cluster(const struct BPB *bpb, uint16_t current_cluster, const char *buffer) {
-    // FAT12 uses 1.5 bytes per cluster entry (12 bits)
-    uint32_t fat_offset = bpb->reserved_sectors * bpb->bytes_per_sector;
-    uint32_t entry_offset = current_cluster + (current_cluster / 2);  // 1.5-byte entries
+    fat12_dir_open(&dir, vol->dev, vol->root_dir_offset, vol->bpb.root_dir_entries);
+    while ((e = fat12_dir_next(&dir)) != NULL) {
+        if (e[0] == 0xE5 || (e[11] & 0x18)) continue;   // Deleted, volume label or directory
 
-    // Extract FAT12 12-bit value
-    uint16_t next_cluster;
-    if (current_cluster & 1) {
-		uint16_t entry_value = (uint16_t)buffer[fat_offset + entry_offset];
-		uint16_t next_value = (uint16_t)buffer[fat_offset + entry_offset + 1] << 4;
-		next_cluster = (entry_value >> 4) | next_value;
-    } else {
-        next_cluster = read16((uint8_t*)buffer, fat_offset + entry_offset) & 0x0FFF;
+        fat12_entry_name(e, full_filename);
+        if (strcmp(full_filename, name) == 0) {
+            memcpy(entry, e, FAT12_ENTRY_SIZE);
+            return FAT12_OK;
+        }
     }
-
-    return next_cluster;
+    return dir.error ? FAT12_ERR_IO : FAT12_ERR_NOT_FOUND;
 }
 
+// Collapse the cluster chain into runs of consecutive clusters. A file
+// with more runs than FAT12_MAX_EXTENTS keeps extent_count 0 and is read
+// by walking the chain instead.
+static int fat12_map(struct FAT12_FILE *file) {
+    struct FAT12_VOLUME *vol = file->vol;
+    struct FAT12_EXTENT *e = file->extent;
+    uint32_t clusters = (file->size + vol->cluster_size - 1) / vol->cluster_size;
+    uint16_t cluster = file->first_cluster;
+    uint8_t n = 0;
+
+    while (clusters--) {
+        if (cluster < 2 || cluster > vol->cluster_count + 1) {
+            return FAT12_ERR_CHAIN;
+        }
+        if (n && cluster == e[n - 1].cluster + e[n - 1].count) {
+            e[n - 1].count++;
+        } else if (n < FAT12_MAX_EXTENTS) {
+            e[n].file_pos = n ? e[n - 1].file_pos + (uint32_t)e[n - 1].count * vol->cluster_size : 0;
+            e[n].cluster = cluster;
+            e[n].count = 1;
+            n++;
+        } else {
+            n = 0;  // Too fragmented, the chain walk checks the rest as it goes
+            break;
+        }
+        if (clusters) {
+            cluster = fat12_next_cluster(vol, cluster);
+        }
+    }
+    file->extent_count = n;
+    return FAT12_OK;
+}
 
+// Open a file of the root directory for reading, at position 0. The
+// cluster chain is mapped into extents here, once.
+int fat12_open(struct FAT12_VOLUME *vol, struct FAT12_FILE *file, const char *name) {
+    uint8_t entry[FAT12_ENTRY_SIZE];
+    int ret;
 
+    memset(file, 0, sizeof(*file));
+    if (!vol->mounted) {
+        return FAT12_ERR_NOT_MOUNTED;
+    }
+    ret = fat12_find(vol, name, entry);
+    if (ret != FAT12_OK) {
+        return ret;
+    }
+    file->vol = vol;
+    file->size = read32(entry, 28);
+    file->first_cluster = read16(entry, 26);
+    file->cluster = file->first_cluster;
+    ret = fat12_map(file);
+    if (ret != FAT12_OK) {
+        return ret;
+    }
+    file->open = 1;
+    return FAT12_OK;
+}
 
-// Function to load a file into the buffer
-int load_file_to_buffer(struct BPB *bpb, const char *buffer, const char *filename_to_find, char *fileBuffer, uint32_t buffer_size) {
-    uint32_t root_dir_offset = bpb->root_dir_sector * bpb->bytes_per_sector;
+// Move file->cluster forward to the cluster holding byte pos. A position
+// on a cluster boundary stays in the cluster before it, so reading up to
+// the end of the file never follows the end-of-chain mark.
+static int fat12_walk(struct FAT12_FILE *file, uint32_t pos) {
+    struct FAT12_VOLUME *vol = file->vol;
+    uint16_t next;
 
-    // Iterate through the root directory entries
-    for (uint16_t i = 0; i < bpb->root_dir_entries; i++) {
-        const char *entry = buffer + root_dir_offset + i * FAT12_ENTRY_SIZE;
+    if (pos < file->cluster_pos) {
+        file->cluster = file->first_cluster;
+        file->cluster_pos = 0;
+    }
+    while (pos > file->cluster_pos + vol->cluster_size) {
+        next = fat12_next_cluster(vol, file->cluster);
+        if (next < 2 || next > vol->cluster_count + 1) {
+            return FAT12_ERR_CHAIN;
+        }
+        file->cluster = next;
+        file->cluster_pos += vol->cluster_size;
+    }
+    return FAT12_OK;
+}
 
-        // First byte 0x00 indicates no more entries
-        if (entry[0] == 0x00) break;
+static uint32_t fat12_extent_end(const struct FAT12_FILE *file, const struct FAT12_EXTENT *e) {
+    return e->file_pos + (uint32_t)e->count * file->vol->cluster_size;
+}
 
-        // Check if it's a valid file (skip deleted/unused entries)
-        if ((uint8_t)entry[0] == 0xE5 || (entry[11] & 0x08)) continue;
+// Extent holding byte pos (below the file size): the current one or the
+// next for sequential reads, else a binary search
+static struct FAT12_EXTENT *fat12_extent_find(struct FAT12_FILE *file, uint32_t pos) {
+    struct FAT12_EXTENT *e = &file->extent[file->extent_cur];
+    uint8_t lo, hi, mid;
 
-        // Extract filename (8 chars) and extension (3 chars)
-        char filename[9] = {0};
-        char ext[4] = {0};
-        strncpy(filename, entry, 8);
-        strncpy(ext, entry + 8, 3);
+    if (pos >= e->file_pos && pos < fat12_extent_end(file, e)) {
+        return e;
+    }
+    if (file->extent_cur + 1 < file->extent_count && pos >= e[1].file_pos && pos < fat12_extent_end(file, &e[1])) {
+        file->extent_cur++;
+        return &e[1];
+    }
+    lo = 0;
+    hi = file->extent_count - 1;
+    while (lo < hi) {
+        mid = (lo + hi + 1) / 2;
+        if (file->extent[mid].file_pos <= pos) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+    file->extent_cur = lo;
+    return &file->extent[lo];
+}
 
-        // Combine the filename and extension to compare with the target
-        char full_filename[FAT12_FILENAME_LENGTH + 2] = {0};  // 8.3 format + dot
-        snprintf(full_filename, sizeof(full_filename), "%.8s.%.3s", filename, ext);
+// Disk address of byte pos (below the file size) and how many bytes from
+// there on are contiguous on the disk: the rest of the extent, or of the
+// cluster when the file is walked by chain
+static int fat12_locate(struct FAT12_FILE *file, uint32_t pos, uint32_t *address, uint32_t *avail) {
+    struct FAT12_VOLUME *vol = file->vol;
+    struct FAT12_EXTENT *e;
+    uint32_t offset;
+    int ret;
+
+    if (file->extent_count) {
+        e = fat12_extent_find(file, pos);
+        offset = pos - e->file_pos;
+        *address = vol->data_offset + (uint32_t)(e->cluster - 2) * vol->cluster_size + offset;
+        *avail = (uint32_t)e->count * vol->cluster_size - offset;
+        return FAT12_OK;
+    }
+    ret = fat12_walk(file, pos + 1);
+    if (ret != FAT12_OK) {
+        return ret;
+    }
+    offset = pos - file->cluster_pos;
+    *address = vol->data_offset + (uint32_t)(file->cluster - 2) * vol->cluster_size + offset;
+    *avail = vol->cluster_size - offset;
+    return FAT12_OK;
+}
 
-        // Remove trailing spaces from filename and extension
-        for (int j = 7; j >= 0 && filename[j] == ' '; j--) {
-            filename[j] = '\0';
+// Read up to len bytes at the current position straight into buf, any
+// length. Bytes that are contiguous on the disk, a whole extent at most,
+// go in one sequential read; the SPI flash streams them with a single
+// read command. Returns the number of bytes read, 0 at the end of the
+// file, or an error.
+int32_t fat12_read(struct FAT12_FILE *file, void *buf, uint32_t len) {
+    struct FAT12_VOLUME *vol = file->vol;
+    uint8_t *p = buf;
+    uint32_t done = 0, address, n;
+    int ret;
+
+    if (!file->open || !vol->mounted) {
+        return FAT12_ERR_NOT_MOUNTED;
+    }
+    if (len > file->size - file->pos) {
+        len = file->size - file->pos;
+    }
+    while (done < len) {
+        ret = fat12_locate(file, file->pos, &address, &n);
+        if (ret != FAT12_OK) {
+            return done ? (int32_t)done : ret;
         }
-        for (int j = 2; j >= 0 && ext[j] == ' '; j--) {
-            ext[j] = '\0';
+        if (n > len - done) n = len - done;
+        if (n > FAT12_READ_MAX) n = FAT12_READ_MAX;
+        if (BLK_Read(vol->dev, address, p + done, n, DEF_BLK_RD_SEQ) != DEF_BLK_OK) {
+            return done ? (int32_t)done : FAT12_ERR_IO;
         }
+        done += n;
+        file->pos += n;
+    }
+    return done;
+}
 
-        // Compare with the target file name (case-sensitive)
-        if (strcmp(full_filename, filename_to_find) == 0) {
-            
-            
-            // Extract the file size (little endian, 4 bytes at offset 28)
-            uint32_t file_size = read32((uint8_t*)entry, 28);
-            
-            printf("File size %u\n", file_size); // =================================================================================================
-            
-            if (file_size > buffer_size) {
-                printf("Error: Buffer too small for file %s (size: %u bytes)\n", filename_to_find, file_size);
-                return -1;  // File size exceeds buffer
-            }
-
-            // Extract the starting cluster (little endian)
-            uint16_t starting_cluster = read16((uint8_t*)entry, 26);
-            uint16_t current_cluster = starting_cluster;
-
-            // Read the file data cluster by cluster
-            uint32_t bytes_read = 0;
-            
-            while (bytes_read < file_size) {
-                uint32_t cluster_location = get_file_location(bpb, current_cluster);
-                
-                //#define INVALID_CLUSTER_LOCATION 0xFFFF
-                //if (cluster_location == INVALID_CLUSTER_LOCATION) {
-                //    fprintf(stderr, "Error: Invalid cluster location for cluster %u\n", current_cluster);
-                //    break;
-                //}
-            
-                uint32_t cluster_size = bpb->sectors_per_cluster * bpb->bytes_per_sector;
-                uint32_t remaining_bytes = file_size - bytes_read;
-                uint32_t bytes_to_copy = (remaining_bytes < cluster_size) ? remaining_bytes : cluster_size;
-            
-                // Ensure buffer has enough space
-                if (bytes_read + bytes_to_copy > FILEBUFFER_SIZE) {
-                    fprintf(stderr, "Error: Buffer overflow. fileBuffer size: %u, bytes to copy: %u\n", FILEBUFFER_SIZE, bytes_to_copy);
-                    break;
-                }
-            
-                // Copy data from the cluster to the file buffer
-                memcpy(fileBuffer + bytes_read, buffer + cluster_location, bytes_to_copy);
-                bytes_read += bytes_to_copy;
-            
-                // If we've read all the bytes needed, we are done
-                if (bytes_read >= file_size) {
-                    break;
-                }
-            
-                // Get the next cluster from the FAT
-                current_cluster = get_next_cluster(bpb, current_cluster, buffer);
-            
-                // Check if we have reached the end of the file
-                if (current_cluster >= 0xFF8) {  // End-of-file marker
-                    if (bytes_read < file_size) {
-                        // Calculate how many bytes are still needed
-                        uint32_t bytes_needed = file_size - bytes_read;
-                        // Copy the remaining bytes from the current cluster
-                        memcpy(fileBuffer + bytes_read, buffer + cluster_location, bytes_needed);
-                        bytes_read += bytes_needed;
-                        fprintf(stderr, "Warning: Reached end-of-file marker, but copied remaining %u bytes from the last cluster\n", bytes_needed);
-                    }
-                    break;
-                }
-            }
-
-            printf("==== File %s loaded into buffer (size: %u bytes)\n", filename_to_find, bytes_read);
-            return bytes_read;  // Return the actual number of bytes read
-        }
+// Set the position, at most the file size. With extents the next read
+// finds its extent by binary search; otherwise forward seeks walk the
+// chain from the current cluster, backward ones from the first.
+int fat12_seek(struct FAT12_FILE *file, uint32_t pos) {
+    int ret = FAT12_OK;
+
+    if (!file->open) {
+        return FAT12_ERR_NOT_MOUNTED;
+    }
+    if (pos > file->size) {
+        pos = file->size;
     }
+    if (!file->extent_count) {
+        ret = fat12_walk(file, pos);
+    }
+    if (ret == FAT12_OK) {
+        file->pos = pos;
+    }
+    return ret;
+}
 
-    printf("File %s not found\n", filename_to_find);
-    return -1;  // File not found
+void fat12_close(struct FAT12_FILE *file) {
+    file->open = 0;
 }
 
-*/
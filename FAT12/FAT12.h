@@ -6,6 +6,7 @@
 #include <string.h>
 #include <stdint.h>
 #include <ctype.h>
+#include "BLOCK_DEV.h"
 
 
 #define BPB_SIZE 512
@@ -27,14 +28,75 @@ struct BPB {
     uint32_t data_start_sector; // New field to store the start of data region
 };
 
+// fat12_mount() results
+#define FAT12_OK             0
+#define FAT12_ERR_IO        -1  // Boot sector could not be read
+#define FAT12_ERR_SIGNATURE -2  // No 0x55AA boot signature
+#define FAT12_ERR_GEOMETRY  -3  // BPB values out of range, not FAT12 or larger than the device
+#define FAT12_ERR_NOT_FOUND -4  // No such file
+#define FAT12_ERR_CHAIN     -5  // Cluster chain ends before the file size
+#define FAT12_ERR_NOT_MOUNTED -6 // Volume not mounted or file not open
 
+#define FAT12_MAX_CLUSTERS  4084    // FAT12 limit, sizes the FAT cache
+#define FAT12_CLUSTER_BAD   0xFF7
+#define FAT12_CLUSTER_EOC   0xFF8   // Values from here on end a chain
+
+// Mounted volume: geometry checked and byte offsets worked out once at mount
+struct FAT12_VOLUME {
+    BLK_DEV *dev;
+    struct BPB bpb;
+    uint32_t total_sectors;     // 16-bit field, or the 32-bit one when that is 0
+    uint32_t fat_offset;        // First FAT
+    uint32_t fat_size;          // Bytes per FAT
+    uint32_t root_dir_offset;   // Root directory
+    uint32_t root_dir_bytes;
+    uint32_t data_offset;       // Cluster 2
+    uint32_t cluster_size;      // Bytes per cluster
+    uint16_t cluster_count;     // Data clusters, the last one is cluster_count + 1
+    uint16_t *fat;              // Unpacked FAT, one entry per cluster, NULL if not cached
+    volatile uint8_t fat_dirty; // FAT written on the device, reload before the next lookup
+    uint8_t mounted;
+};
+
+#define FAT12_MAX_EXTENTS   8   // Runs of consecutive clusters mapped per open file
+#define FAT12_READ_MAX      0x8000  // Largest single BLK_Read of fat12_read
+
+// Run of consecutive clusters of a file
+struct FAT12_EXTENT {
+    uint32_t file_pos;          // File offset of the run
+    uint16_t cluster;           // First cluster
+    uint16_t count;             // Clusters in the run
+};
+
+// Open file: the extent map, plus the position and the cluster holding it
+// for files too fragmented to map, so sequential reads never walk the
+// chain from the start
+struct FAT12_FILE {
+    struct FAT12_VOLUME *vol;
+    uint32_t size;
+    uint32_t pos;               // Next byte to read
+    uint32_t cluster_pos;       // File offset of the start of cluster
+    uint16_t first_cluster;
+    uint16_t cluster;
+    struct FAT12_EXTENT extent[FAT12_MAX_EXTENTS];
+    uint8_t extent_count;       // 0: not mapped, walk the chain
+    uint8_t extent_cur;         // Extent of the last read
+    uint8_t open;
+};
+
+
+int fat12_mount(struct FAT12_VOLUME *vol, BLK_DEV *dev);
+void fat12_unmount(struct FAT12_VOLUME *vol);
+uint16_t fat12_next_cluster(struct FAT12_VOLUME *vol, uint16_t cluster);
+void fat12_disk_written(BLK_DEV *dev, uint32_t address, uint32_t len);
+int fat12_open(struct FAT12_VOLUME *vol, struct FAT12_FILE *file, const char *name);
+int32_t fat12_read(struct FAT12_FILE *file, void *buf, uint32_t len);
+int fat12_seek(struct FAT12_FILE *file, uint32_t pos);
+void fat12_close(struct FAT12_FILE *file);
 void load_bpb_spi(struct BPB *bpb);
 uint32_t get_file_location_spi(const struct BPB *bpb, uint16_t starting_cluster);
 uint32_t get_file_size_spi(struct BPB *bpb, const char *filename_to_find);
 void list_files_spi(struct BPB *bpb);
 
 
-//uint16_t get_next_cluster(const struct BPB *bpb, uint16_t current_cluster, const char *buffer);
-// int load_file_to_buffer(struct BPB *bpb, const char *buffer, const char *filename_to_find, char *fileBuffer, uint32_t buffer_size);
-
 #endif // FAT12_H
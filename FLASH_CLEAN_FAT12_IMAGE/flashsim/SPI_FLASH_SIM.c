@@ -0,0 +1,801 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : SPI_FLASH_SIM.c
+* Description        : Host model of a W25Qxx SPI NOR flash, backed by an
+*                      image file. The chip sees the bytes SPI1 of
+*                      ch32v30x_sim.c clocks while CS# is low and decodes
+*                      them like the real part, so the unchanged SPI_FLASH.c
+*                      drives it.
+*                      Program only clears bits, erase sets 0xFF, page
+*                      program wraps inside the page. Program and erase set
+*                      WIP for their typical time, commands the part would
+*                      ignore (busy, deep power-down, no WEL, CS# raised at
+*                      the wrong point) are reported. So are a suspend
+*                      sooner than tSUS after a resume and a read inside
+*                      the range of a suspended erase, which answers 0x00.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include "SPI_FLASH.h"
+#include "SPI_FLASH_SIM.h"
+
+/******************************************************************************/
+/* Constant Definition */
+#define DEF_SIM_SFDP_SIZE          0x100                                        /* SFDP space answered, 0xFF above */
+#define DEF_SIM_SFDP_BFPT          0x80                                         /* Basic parameter table address */
+#define DEF_SIM_SR1_WIP            0x01
+#define DEF_SIM_SR1_WEL            0x02
+#define DEF_SIM_SR2_SUS            0x80
+#define DEF_SIM_UNIQUE_ID          0xD267A4B1C3902E15ULL                        /* Answer of Read Unique ID */
+
+/******************************************************************************/
+/* Variable Definition */
+SIM_TIMING Sim_Timing =
+{
+    DEF_SIM_PCLK2_HZ,
+    0,
+    DEF_SIM_CS_GAP_NS,
+    DEF_SIM_PAGE_PROG_US,
+    DEF_SIM_SECTOR_ERASE_US,
+    DEF_SIM_BLOCK32_ERASE_US,
+    DEF_SIM_BLOCK64_ERASE_US,
+    DEF_SIM_CHIP_ERASE_MS,
+    DEF_SIM_SUSPEND_US,
+    DEF_SIM_RELEASE_PD_US,
+};
+SIM_STATS Sim_Stats;
+uint64_t  Sim_Now_Ns = 0;
+uint32_t  Sim_Stuck_Addr = 0xFFFFFFFF;
+
+static uint8_t  *Sim_Array = NULL;                                              /* Array contents */
+static uint32_t Sim_Size = 0;                                                   /* Array size in bytes */
+static uint32_t Sim_ID = 0;                                                     /* JEDEC ID answered */
+static uint8_t  Sim_Sfdp[ DEF_SIM_SFDP_SIZE ];                                  /* SFDP space */
+static uint64_t Sim_Busy_Until = 0;                                             /* WIP=1 until this time */
+static uint8_t  Sim_Busy_Cmd = 0x00;                                            /* Operation that set WIP */
+static uint8_t  Sim_Suspended = 0;                                              /* SUS bit */
+static uint64_t Sim_Suspend_Left = 0;                                           /* Erase time left at suspend */
+static uint64_t Sim_Resume_At = 0;                                              /* Time of the last resume */
+static uint32_t Sim_Erase_Addr = 0;                                             /* Range of the last erase */
+static uint32_t Sim_Erase_Len = 0;
+static uint8_t  Sim_Read_Bad = 0;                                               /* Command read the suspended range */
+static uint8_t  Sim_Deep_Pd = 0;                                                /* Chip in deep power-down */
+static uint64_t Sim_Awake_At = 0;                                               /* End of tRES1 after a release */
+static uint8_t  Sim_Wel = 0;                                                    /* WEL bit */
+static uint8_t  Sim_Addr4 = 0;                                                  /* 4-byte address mode */
+
+/* Command in progress, from CS# low to CS# high */
+static uint8_t  Sim_Selected = 0;
+static uint8_t  Sim_Cmd = 0x00;                                                 /* Opcode, the first byte */
+static uint8_t  Sim_Cmd_Drop = 0;                                               /* Ignored by the chip */
+static uint8_t  Sim_Cmd_Alen = 0;                                               /* Address bytes */
+static uint8_t  Sim_Cmd_Dummy = 0;                                              /* Dummy bytes */
+static uint8_t  Sim_Cmd_Busy = 0;                                               /* WIP was set at the opcode */
+static uint32_t Sim_Cmd_Count = 0;                                              /* Bytes since CS# fell */
+static uint32_t Sim_Cmd_Addr = 0;
+static uint64_t Sim_Cmd_Start = 0;                                              /* Time CS# fell */
+static uint8_t  Sim_Page_Buf[ DEF_SIM_PAGE_SIZE ];                              /* Page program data by page offset */
+static uint8_t  Sim_Page_Set[ DEF_SIM_PAGE_SIZE ];                              /* Offsets loaded */
+static uint32_t Sim_Page_Count = 0;                                             /* Data bytes clocked in */
+
+/*******************************************************************************
+* Function Name  : Sim_Sfdp_Build
+* Description    : SFDP header and a 16 DWORD basic parameter table laid
+*                  out like a W25Q32JV, density and address mode from the
+*                  modelled size
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Sfdp_Build( void )
+{
+    uint32_t bfpt[ 16 ] =
+    {
+        0xFFF920E5,                                                             /* 4K erase 0x20, 1-1-2, 1-1-4 */
+        0x00000000,                                                             /* Density, set below */
+        0x6B08EB44,                                                             /* 1-1-4 read 0x6B, 8 dummy clocks */
+        0xBB423B08,                                                             /* 1-1-2 read 0x3B, 8 dummy clocks */
+        0xFFFFFFEE,
+        0xFF00FFFF,
+        0xFF00FFFF,
+        0x520F200C,                                                             /* Erase 4K 0x20, 32K 0x52 */
+        0xFF00D810,                                                             /* Erase 64K 0xD8 */
+        0x00A60221,
+        0xF4D14582,                                                             /* 256 byte page */
+        0x33EA6CEC,                                                             /* Suspend supported */
+        0x757A757A,                                                             /* Suspend 0x75, resume 0x7A */
+        0xFFFFFFFF,
+        0xFFFFFFFF,
+        0xFFFFFFFF,
+    };
+    uint32_t i;
+
+    bfpt[ 1 ] = Sim_Size * 8 - 1;
+    if( Sim_Size > 0x1000000 )
+    {
+        bfpt[ 0 ] |= (uint32_t)1 << 17;                                         /* 3- or 4-byte address */
+    }
+
+    memset( Sim_Sfdp, 0xFF, sizeof( Sim_Sfdp ) );
+    memcpy( Sim_Sfdp, "SFDP", 4 );
+    Sim_Sfdp[ 4 ] = 0x06;                                                       /* JESD216B */
+    Sim_Sfdp[ 5 ] = 0x01;
+    Sim_Sfdp[ 6 ] = 0x00;                                                       /* One parameter header */
+    Sim_Sfdp[ 8 ] = 0x00;                                                       /* BFPT ID LSB */
+    Sim_Sfdp[ 9 ] = 0x06;
+    Sim_Sfdp[ 10 ] = 0x01;
+    Sim_Sfdp[ 11 ] = 16;                                                        /* Length in DWORDs */
+    Sim_Sfdp[ 12 ] = DEF_SIM_SFDP_BFPT;
+    Sim_Sfdp[ 13 ] = 0x00;
+    Sim_Sfdp[ 14 ] = 0x00;
+    Sim_Sfdp[ 15 ] = 0xFF;                                                      /* BFPT ID MSB */
+    for( i = 0; i < 16; i++ )
+    {
+        Sim_Sfdp[ DEF_SIM_SFDP_BFPT + i * 4 ] = (uint8_t)bfpt[ i ];
+        Sim_Sfdp[ DEF_SIM_SFDP_BFPT + i * 4 + 1 ] = (uint8_t)( bfpt[ i ] >> 8 );
+        Sim_Sfdp[ DEF_SIM_SFDP_BFPT + i * 4 + 2 ] = (uint8_t)( bfpt[ i ] >> 16 );
+        Sim_Sfdp[ DEF_SIM_SFDP_BFPT + i * 4 + 3 ] = (uint8_t)( bfpt[ i ] >> 24 );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Open
+* Description    : Load an image file as the array of a chip with the given
+*                  JEDEC ID. A short image is padded with 0xFF (erased).
+* Input          : *image - file name, NULL for a blank chip
+*                  jedec_id - ID answered to CMD_FLASH_JEDEC_ID
+* Output         : None
+* Return         : 0 = success, 1 = error
+*******************************************************************************/
+uint8_t Sim_Open( const char *image, uint32_t jedec_id )
+{
+    FILE     *fp;
+    uint32_t bits;
+
+    bits = jedec_id & 0xFF;
+    if( ( bits < 0x11 ) || ( bits > 0x1A ) )
+    {
+        printf( "Sim: unsupported capacity code %02x\n", (unsigned)bits );
+        return 1;
+    }
+    Sim_Size = (uint32_t)1 << bits;
+    Sim_ID = jedec_id;
+    Sim_Array = malloc( Sim_Size );
+    if( Sim_Array == NULL )
+    {
+        return 1;
+    }
+    memset( Sim_Array, 0xFF, Sim_Size );
+    memset( &Sim_Stats, 0, sizeof( Sim_Stats ) );
+    FLASH_Stats_Reset( );
+    Sim_Sfdp_Build( );
+    Sim_Now_Ns = 0;
+    Sim_Busy_Until = 0;
+    Sim_Suspended = 0;
+    Sim_Resume_At = 0;
+    Sim_Erase_Len = 0;
+    Sim_Deep_Pd = 0;
+    Sim_Wel = 0;
+    Sim_Addr4 = 0;
+
+    if( image )
+    {
+        fp = fopen( image, "rb" );
+        if( fp == NULL )
+        {
+            printf( "Sim: cannot open %s\n", image );
+            return 1;
+        }
+        if( fread( Sim_Array, 1, Sim_Size, fp ) == 0 )
+        {
+            printf( "Sim: %s is empty\n", image );
+        }
+        fclose( fp );
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Save
+* Description    : Write the array back to an image file
+* Input          : *image - file name
+* Output         : None
+* Return         : 0 = success, 1 = error
+*******************************************************************************/
+uint8_t Sim_Save( const char *image )
+{
+    FILE    *fp;
+    uint8_t ret;
+
+    fp = fopen( image, "wb" );
+    if( fp == NULL )
+    {
+        return 1;
+    }
+    ret = ( fwrite( Sim_Array, 1, Sim_Size, fp ) == Sim_Size ) ? 0 : 1;
+    fclose( fp );
+    return ret;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Close
+* Description    : Release the array
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Close( void )
+{
+    free( Sim_Array );
+    Sim_Array = NULL;
+    Sim_Size = 0;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Advance
+* Description    : Let simulated time pass, e.g. for USB transfers
+* Input          : ns
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Advance( uint64_t ns )
+{
+    Sim_Now_Ns += ns;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Print_Stats
+* Description    : Print the counters and the simulated time
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Print_Stats( void )
+{
+    printf( "Sim: time %.3f ms, SCK %u Hz\n", Sim_Now_Ns / 1e6, (unsigned)Sim_Spi_Hz( ) );
+    printf( "Sim: bus %llu bytes, read %llu bytes, programmed %llu bytes in %u pages\n",
+            (unsigned long long)Sim_Stats.Spi_Bytes, (unsigned long long)Sim_Stats.Read_Bytes,
+            (unsigned long long)Sim_Stats.Prog_Bytes, (unsigned)Sim_Stats.Prog_Pages );
+    printf( "Sim: erase 4K %u, 32K %u, 64K %u, chip %u, suspended %u, power-downs %u\n",
+            (unsigned)Sim_Stats.Erase_4K, (unsigned)Sim_Stats.Erase_32K, (unsigned)Sim_Stats.Erase_64K,
+            (unsigned)Sim_Stats.Erase_Chip, (unsigned)Sim_Stats.Suspends, (unsigned)Sim_Stats.Power_Downs );
+    printf( "Sim: busy %.3f ms, busy wait %.3f ms, commands while busy %u, bits not programmable %u, bus errors %u\n",
+            Sim_Stats.Busy_Ns / 1e6, Sim_Stats.Busy_Wait_Ns / 1e6, (unsigned)Sim_Stats.Busy_Violations, (unsigned)Sim_Stats.Lost_Bits,
+            (unsigned)Sim_Stats.Bus_Errors );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Bus_Error
+* Description    : Report a command the part would not execute as sent or
+*                  a misuse of SPI1/DMA, counted in Bus_Errors
+* Input          : *fmt, ... - printf style message
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Bus_Error( const char *fmt, ... )
+{
+    va_list ap;
+
+    Sim_Stats.Bus_Errors++;
+    printf( "Sim: " );
+    va_start( ap, fmt );
+    vprintf( fmt, ap );
+    va_end( ap );
+    printf( " at %.3f ms\n", Sim_Now_Ns / 1e6 );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Busy
+* Description    : WIP bit of the model
+* Input          : None
+* Output         : None
+* Return         : 1 = busy
+*******************************************************************************/
+static uint8_t Sim_Busy( void )
+{
+    return ( Sim_Now_Ns < Sim_Busy_Until ) ? 1 : 0;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Program
+* Description    : Page program of the loaded page buffer, offsets that
+*                  were not loaded stay as they are
+* Input          : address - any address in the page
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Program( uint32_t address )
+{
+    uint32_t base, i, len;
+    uint8_t  *p, b;
+
+    base = ( address % Sim_Size ) & ~( DEF_SIM_PAGE_SIZE - 1 );
+    len = 0;
+    for( i = 0; i < DEF_SIM_PAGE_SIZE; i++ )
+    {
+        if( Sim_Page_Set[ i ] == 0 )
+        {
+            continue;
+        }
+        p = &Sim_Array[ base + i ];
+        b = *p & Sim_Page_Buf[ i ];
+        if( ( Sim_Stuck_Addr < Sim_Size ) && ( p == &Sim_Array[ Sim_Stuck_Addr ] ) )
+        {
+            /* Worn cell, a failure the driver must report */
+            b |= 0x01;
+        }
+        else if( b != Sim_Page_Buf[ i ] )
+        {
+            Sim_Stats.Lost_Bits += __builtin_popcount( (unsigned)( b ^ Sim_Page_Buf[ i ] ) );
+        }
+        *p = b;
+        len++;
+    }
+    Sim_Stats.Prog_Bytes += len;
+    Sim_Stats.Prog_Pages++;
+    Sim_Busy_Cmd = CMD_FLASH_BYTE_PROG;
+    Sim_Busy_Until = Sim_Now_Ns + (uint64_t)Sim_Timing.Page_Prog_Us * 1000;
+    Sim_Stats.Busy_Ns += (uint64_t)Sim_Timing.Page_Prog_Us * 1000;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Erase
+* Description    : Erase command of the model
+* Input          : cmd - erase opcode, 3- or 4-byte address form
+*                  address
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Erase( uint8_t cmd, uint32_t address )
+{
+    uint32_t size;
+    uint64_t us;
+
+    if( ( cmd == CMD_FLASH_CHIP_ERASE ) || ( cmd == 0x60 ) )
+    {
+        size = Sim_Size;
+        us = (uint64_t)Sim_Timing.Chip_Erase_Ms * 1000;
+        Sim_Stats.Erase_Chip++;
+    }
+    else if( ( cmd == CMD_FLASH_BLOCK_ERASE_64K ) || ( cmd == CMD_FLASH_BLOCK_ERASE_64K_4B ) )
+    {
+        size = 65536;
+        us = Sim_Timing.Block64_Erase_Us;
+        Sim_Stats.Erase_64K++;
+    }
+    else if( ( cmd == CMD_FLASH_BLOCK_ERASE_32K ) || ( cmd == CMD_FLASH_BLOCK_ERASE_32K_4B ) )
+    {
+        size = 32768;
+        us = Sim_Timing.Block32_Erase_Us;
+        Sim_Stats.Erase_32K++;
+    }
+    else
+    {
+        size = 4096;
+        us = Sim_Timing.Sector_Erase_Us;
+        Sim_Stats.Erase_4K++;
+    }
+    address = ( address % Sim_Size ) & ~( size - 1 );
+    memset( &Sim_Array[ address ], 0xFF, size );
+    Sim_Erase_Addr = address;
+    Sim_Erase_Len = size;
+    Sim_Busy_Cmd = cmd;
+    Sim_Busy_Until = Sim_Now_Ns + us * 1000;
+    Sim_Stats.Busy_Ns += us * 1000;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Cmd_Layout
+* Description    : Address and dummy bytes that follow an opcode
+* Input          : cmd
+* Output         : *alen, *dummy
+* Return         : 0 = known opcode, 1 = not decoded by the model
+*******************************************************************************/
+static uint8_t Sim_Cmd_Layout( uint8_t cmd, uint8_t *alen, uint8_t *dummy )
+{
+    *alen = 0;
+    *dummy = 0;
+    switch( cmd )
+    {
+        case CMD_FLASH_READ:
+        case CMD_FLASH_BYTE_PROG:
+        case CMD_FLASH_SECTOR_ERASE:
+        case CMD_FLASH_BLOCK_ERASE_32K:
+        case CMD_FLASH_BLOCK_ERASE_64K:
+            *alen = Sim_Addr4 ? 4 : 3;
+            return 0;
+
+        case CMD_FLASH_FAST_READ:
+            *alen = Sim_Addr4 ? 4 : 3;
+            *dummy = 1;
+            return 0;
+
+        case CMD_FLASH_READ_4B:
+        case CMD_FLASH_BYTE_PROG_4B:
+        case CMD_FLASH_SECTOR_ERASE_4B:
+        case CMD_FLASH_BLOCK_ERASE_32K_4B:
+        case CMD_FLASH_BLOCK_ERASE_64K_4B:
+            *alen = 4;
+            return 0;
+
+        case CMD_FLASH_FAST_READ_4B:
+            *alen = 4;
+            *dummy = 1;
+            return 0;
+
+        case CMD_FLASH_READ_SFDP:
+            *alen = 3;
+            *dummy = 1;
+            return 0;
+
+        case CMD_FLASH_UNIQUE_ID:
+            *dummy = 4;
+            return 0;
+
+        case CMD_FLASH_JEDEC_ID:
+        case CMD_FLASH_RDSR:
+        case CMD_FLASH_RDSR2:
+        case CMD_FLASH_WREN:
+        case CMD_FLASH_WRDI:
+        case CMD_FLASH_CHIP_ERASE:
+        case 0x60:
+        case CMD_FLASH_SUSPEND:
+        case CMD_FLASH_RESUME:
+        case CMD_FLASH_POWER_DOWN:
+        case CMD_FLASH_RELEASE_PD:
+        case CMD_FLASH_ENTER_4B:
+        case CMD_FLASH_EXIT_4B:
+            return 0;
+
+        default:
+            return 1;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Cmd_Begin
+* Description    : Decide at the opcode whether the part takes the command
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Cmd_Begin( void )
+{
+    uint8_t cmd = Sim_Cmd;
+
+    Sim_Cmd_Busy = Sim_Busy( );
+    if( Sim_Cmd_Layout( cmd, &Sim_Cmd_Alen, &Sim_Cmd_Dummy ) )
+    {
+        Sim_Bus_Error( "unknown command %02x", (unsigned)cmd );
+        Sim_Cmd_Drop = 1;
+        return;
+    }
+    if( Sim_Deep_Pd || ( Sim_Now_Ns < Sim_Awake_At ) )
+    {
+        /* Only release from power-down is decoded */
+        if( ( cmd != CMD_FLASH_RELEASE_PD ) || ( Sim_Deep_Pd == 0 ) )
+        {
+            Sim_Stats.Busy_Violations++;
+            printf( "Sim: command %02x sent in deep power-down at %.3f ms\n", (unsigned)cmd, Sim_Now_Ns / 1e6 );
+            Sim_Cmd_Drop = 1;
+        }
+        return;
+    }
+    if( Sim_Cmd_Busy )
+    {
+        if( ( cmd != CMD_FLASH_RDSR ) && ( cmd != CMD_FLASH_RDSR2 ) && ( cmd != CMD_FLASH_SUSPEND ) )
+        {
+            Sim_Stats.Busy_Violations++;
+            printf( "Sim: %02x sent while busy at %.3f ms\n", (unsigned)cmd, Sim_Now_Ns / 1e6 );
+            Sim_Cmd_Drop = 1;
+        }
+        return;
+    }
+    if( Sim_Suspended )
+    {
+        /* Reads are allowed while an erase is suspended */
+        switch( cmd )
+        {
+            case CMD_FLASH_BYTE_PROG:
+            case CMD_FLASH_BYTE_PROG_4B:
+            case CMD_FLASH_SECTOR_ERASE:
+            case CMD_FLASH_SECTOR_ERASE_4B:
+            case CMD_FLASH_BLOCK_ERASE_32K:
+            case CMD_FLASH_BLOCK_ERASE_32K_4B:
+            case CMD_FLASH_BLOCK_ERASE_64K:
+            case CMD_FLASH_BLOCK_ERASE_64K_4B:
+            case CMD_FLASH_CHIP_ERASE:
+            case 0x60:
+                Sim_Stats.Busy_Violations++;
+                printf( "Sim: %02x sent while an erase is suspended at %.3f ms\n", (unsigned)cmd, Sim_Now_Ns / 1e6 );
+                Sim_Cmd_Drop = 1;
+                break;
+
+            default:
+                break;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Flash_Select
+* Description    : CS# fell, a new command starts
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Flash_Select( void )
+{
+    Sim_Selected = 1;
+    Sim_Cmd = 0x00;
+    Sim_Cmd_Drop = 0;
+    Sim_Read_Bad = 0;
+    Sim_Cmd_Count = 0;
+    Sim_Cmd_Addr = 0;
+    Sim_Cmd_Start = Sim_Now_Ns;
+    Sim_Page_Count = 0;
+    memset( Sim_Page_Set, 0, sizeof( Sim_Page_Set ) );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Flash_Byte
+* Description    : One byte clocked while CS# is low
+* Input          : mosi - byte from the MCU
+* Output         : None
+* Return         : byte the chip drives on MISO
+*******************************************************************************/
+uint8_t Sim_Flash_Byte( uint8_t mosi )
+{
+    uint32_t n;
+    uint8_t  miso;
+
+    if( Sim_Selected == 0 )
+    {
+        return 0xFF;
+    }
+    n = Sim_Cmd_Count++;
+    if( n == 0 )
+    {
+        Sim_Cmd = mosi;
+        Sim_Cmd_Begin( );
+        return 0xFF;
+    }
+    if( Sim_Cmd_Drop )
+    {
+        return 0xFF;
+    }
+    if( n <= Sim_Cmd_Alen )
+    {
+        Sim_Cmd_Addr = ( Sim_Cmd_Addr << 8 ) | mosi;
+        return 0xFF;
+    }
+    if( n <= (uint32_t)Sim_Cmd_Alen + Sim_Cmd_Dummy )
+    {
+        return 0xFF;
+    }
+
+    /* Data phase, n counts from 0 */
+    n -= 1 + Sim_Cmd_Alen + Sim_Cmd_Dummy;
+    miso = 0xFF;
+    switch( Sim_Cmd )
+    {
+        case CMD_FLASH_JEDEC_ID:
+            if( n < 3 )
+            {
+                miso = (uint8_t)( Sim_ID >> ( 16 - n * 8 ) );
+            }
+            break;
+
+        case CMD_FLASH_UNIQUE_ID:
+            if( n < 8 )
+            {
+                miso = (uint8_t)( DEF_SIM_UNIQUE_ID >> ( 56 - n * 8 ) );
+            }
+            break;
+
+        case CMD_FLASH_RDSR:
+            miso = ( Sim_Busy( ) ? DEF_SIM_SR1_WIP : 0 ) | ( Sim_Wel ? DEF_SIM_SR1_WEL : 0 );
+            break;
+
+        case CMD_FLASH_RDSR2:
+            miso = Sim_Suspended ? DEF_SIM_SR2_SUS : 0;
+            break;
+
+        case CMD_FLASH_READ:
+        case CMD_FLASH_FAST_READ:
+        case CMD_FLASH_READ_4B:
+        case CMD_FLASH_FAST_READ_4B:
+            miso = Sim_Array[ Sim_Cmd_Addr % Sim_Size ];
+            if( Sim_Suspended && ( Sim_Cmd_Addr % Sim_Size - Sim_Erase_Addr < Sim_Erase_Len ) )
+            {
+                /* Contents of a suspended erase are undefined */
+                miso = 0x00;
+                if( Sim_Read_Bad == 0 )
+                {
+                    Sim_Read_Bad = 1;
+                    Sim_Bus_Error( "read %08x inside a suspended erase", (unsigned)( Sim_Cmd_Addr % Sim_Size ) );
+                }
+            }
+            Sim_Cmd_Addr++;
+            Sim_Stats.Read_Bytes++;
+            break;
+
+        case CMD_FLASH_READ_SFDP:
+            if( Sim_Cmd_Addr < DEF_SIM_SFDP_SIZE )
+            {
+                miso = Sim_Sfdp[ Sim_Cmd_Addr ];
+            }
+            Sim_Cmd_Addr++;
+            break;
+
+        case CMD_FLASH_BYTE_PROG:
+        case CMD_FLASH_BYTE_PROG_4B:
+            /* Later bytes overwrite earlier ones, as the page buffer wraps */
+            Sim_Page_Buf[ ( Sim_Cmd_Addr + n ) % DEF_SIM_PAGE_SIZE ] = mosi;
+            Sim_Page_Set[ ( Sim_Cmd_Addr + n ) % DEF_SIM_PAGE_SIZE ] = 1;
+            Sim_Page_Count++;
+            break;
+
+        default:
+            break;
+    }
+    return miso;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Flash_Deselect
+* Description    : CS# rose, commands that act on it run now
+* Input          : cut - 1: CS# rose inside a frame, the last byte is partial
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Flash_Deselect( uint8_t cut )
+{
+    uint32_t count;
+    uint8_t  cmd;
+
+    count = Sim_Cmd_Count;
+    cmd = Sim_Cmd;
+    Sim_Selected = 0;
+    if( ( count == 0 ) || Sim_Cmd_Drop )
+    {
+        return;
+    }
+
+    switch( cmd )
+    {
+        case CMD_FLASH_RDSR:
+        case CMD_FLASH_RDSR2:
+            if( Sim_Cmd_Busy )
+            {
+                Sim_Stats.Busy_Wait_Ns += Sim_Now_Ns - Sim_Cmd_Start;
+            }
+            return;
+
+        case CMD_FLASH_JEDEC_ID:
+        case CMD_FLASH_READ:
+        case CMD_FLASH_FAST_READ:
+        case CMD_FLASH_READ_4B:
+        case CMD_FLASH_FAST_READ_4B:
+        case CMD_FLASH_READ_SFDP:
+            /* Reads may end anywhere */
+            return;
+
+        default:
+            break;
+    }
+
+    /* Everything else runs only if CS# rises on a byte boundary */
+    if( cut )
+    {
+        Sim_Bus_Error( "CS# raised inside a byte of command %02x", (unsigned)cmd );
+        return;
+    }
+
+    switch( cmd )
+    {
+        case CMD_FLASH_WREN:
+            Sim_Wel = 1;
+            break;
+
+        case CMD_FLASH_WRDI:
+            Sim_Wel = 0;
+            break;
+
+        case CMD_FLASH_BYTE_PROG:
+        case CMD_FLASH_BYTE_PROG_4B:
+            if( count <= Sim_Cmd_Alen )
+            {
+                Sim_Bus_Error( "page program %02x without a full address", (unsigned)cmd );
+            }
+            else if( Sim_Wel == 0 )
+            {
+                Sim_Bus_Error( "page program without write enable" );
+            }
+            else
+            {
+                if( Sim_Page_Count )
+                {
+                    Sim_Program( Sim_Cmd_Addr );
+                }
+                Sim_Wel = 0;
+            }
+            break;
+
+        case CMD_FLASH_SECTOR_ERASE:
+        case CMD_FLASH_SECTOR_ERASE_4B:
+        case CMD_FLASH_BLOCK_ERASE_32K:
+        case CMD_FLASH_BLOCK_ERASE_32K_4B:
+        case CMD_FLASH_BLOCK_ERASE_64K:
+        case CMD_FLASH_BLOCK_ERASE_64K_4B:
+        case CMD_FLASH_CHIP_ERASE:
+        case 0x60:
+            if( count != 1 + (uint32_t)Sim_Cmd_Alen )
+            {
+                Sim_Bus_Error( "erase %02x with %u bytes", (unsigned)cmd, (unsigned)count );
+            }
+            else if( Sim_Wel == 0 )
+            {
+                Sim_Bus_Error( "erase %02x without write enable", (unsigned)cmd );
+            }
+            else
+            {
+                Sim_Erase( cmd, Sim_Cmd_Addr );
+                Sim_Wel = 0;
+            }
+            break;
+
+        case CMD_FLASH_SUSPEND:
+            /* Page program and chip erase are not suspended by the model */
+            if( Sim_Busy( ) && ( Sim_Suspended == 0 )
+             && ( Sim_Busy_Cmd != CMD_FLASH_BYTE_PROG ) && ( Sim_Busy_Cmd != CMD_FLASH_CHIP_ERASE ) && ( Sim_Busy_Cmd != 0x60 ) )
+            {
+                if( Sim_Now_Ns - Sim_Resume_At < (uint64_t)Sim_Timing.Suspend_Us * 1000 )
+                {
+                    Sim_Bus_Error( "suspend sooner than tSUS after a resume" );
+                }
+                Sim_Suspend_Left = Sim_Busy_Until - Sim_Now_Ns;
+                Sim_Busy_Until = Sim_Now_Ns + (uint64_t)Sim_Timing.Suspend_Us * 1000;
+                Sim_Suspended = 1;
+                Sim_Stats.Suspends++;
+            }
+            break;
+
+        case CMD_FLASH_RESUME:
+            if( Sim_Suspended )
+            {
+                Sim_Suspended = 0;
+                Sim_Busy_Until = Sim_Now_Ns + Sim_Suspend_Left;
+                Sim_Resume_At = Sim_Now_Ns;
+            }
+            break;
+
+        case CMD_FLASH_POWER_DOWN:
+            Sim_Deep_Pd = 1;
+            Sim_Stats.Power_Downs++;
+            break;
+
+        case CMD_FLASH_RELEASE_PD:
+            if( Sim_Deep_Pd )
+            {
+                Sim_Deep_Pd = 0;
+                Sim_Awake_At = Sim_Now_Ns + (uint64_t)Sim_Timing.Release_Pd_Us * 1000;
+            }
+            break;
+
+        case CMD_FLASH_ENTER_4B:
+            Sim_Addr4 = 1;
+            break;
+
+        case CMD_FLASH_EXIT_4B:
+            Sim_Addr4 = 0;
+            break;
+
+        default:
+            break;
+    }
+}
@@ -0,0 +1,90 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : SPI_FLASH_SIM.h
+* Description        : Host model of a W25Qxx SPI NOR flash on SPI1 of the
+*                      host peripheral model, backed by an image file
+*******************************************************************************/
+
+#ifndef __SPI_FLASH_SIM_H
+#define __SPI_FLASH_SIM_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdint.h>
+
+/******************************************************************************/
+/* Defaults of the timing model (W25Q32JV typical values, CH32V307 @ 96 MHz) */
+#define DEF_SIM_PCLK2_HZ           96000000                                     /* SPI1 kernel clock */
+#define DEF_SIM_CS_GAP_NS          500                                          /* CS# toggle and driver code per command */
+#define DEF_SIM_PAGE_PROG_US       400                                          /* tPP */
+#define DEF_SIM_SECTOR_ERASE_US    45000                                        /* tSE, 4 KByte */
+#define DEF_SIM_BLOCK32_ERASE_US   120000                                       /* tBE1, 32 KByte */
+#define DEF_SIM_BLOCK64_ERASE_US   150000                                       /* tBE2, 64 KByte */
+#define DEF_SIM_CHIP_ERASE_MS      10000                                        /* tCE */
+#define DEF_SIM_SUSPEND_US         20                                           /* tSUS */
+#define DEF_SIM_RELEASE_PD_US      3                                            /* tRES1 */
+#define DEF_SIM_PAGE_SIZE          256                                          /* Page program buffer */
+
+/* Timing model */
+typedef struct _SIM_TIMING
+{
+    uint32_t Pclk2_Hz;                                                          /* SCK = Pclk2_Hz / SPI prescaler */
+    uint32_t Spi_Max_Hz;                                                        /* Upper limit on SCK, 0: none */
+    uint32_t Cs_Gap_Ns;                                                         /* Fixed cost of every command */
+    uint32_t Page_Prog_Us;
+    uint32_t Sector_Erase_Us;
+    uint32_t Block32_Erase_Us;
+    uint32_t Block64_Erase_Us;
+    uint32_t Chip_Erase_Ms;
+    uint32_t Suspend_Us;
+    uint32_t Release_Pd_Us;
+}SIM_TIMING;
+
+/* Counters collected while the model runs */
+typedef struct _SIM_STATS
+{
+    uint64_t Spi_Bytes;                                                         /* Bytes clocked on the bus */
+    uint64_t Read_Bytes;                                                        /* Array bytes read */
+    uint64_t Prog_Bytes;                                                        /* Array bytes programmed */
+    uint32_t Prog_Pages;                                                        /* Page program commands */
+    uint32_t Erase_4K;                                                          /* Erase commands by size */
+    uint32_t Erase_32K;
+    uint32_t Erase_64K;
+    uint32_t Erase_Chip;
+    uint32_t Suspends;                                                          /* Erases suspended for a read */
+    uint32_t Power_Downs;                                                       /* Deep power-down entries */
+    uint64_t Busy_Ns;                                                           /* Program and erase time, WIP=1 */
+    uint64_t Busy_Wait_Ns;                                                      /* Time spent polling WIP */
+    uint32_t Busy_Violations;                                                   /* Commands sent while WIP=1 or powered down */
+    uint32_t Lost_Bits;                                                         /* 0->1 changes a program could not make */
+    uint32_t Bus_Errors;                                                        /* Cut or unknown commands, SPI1/DMA misuse */
+}SIM_STATS;
+
+/******************************************************************************/
+/* Variable extern */
+extern SIM_TIMING Sim_Timing;
+extern SIM_STATS  Sim_Stats;
+extern uint64_t   Sim_Now_Ns;                                                   /* Simulated time since Sim_Open */
+extern uint32_t   Sim_Stuck_Addr;                                               /* Byte whose bit 0 no program clears, 0xFFFFFFFF: none */
+
+/******************************************************************************/
+/* external functions */
+extern uint8_t Sim_Open( const char *image, uint32_t jedec_id );
+extern uint8_t Sim_Save( const char *image );
+extern void Sim_Close( void );
+extern void Sim_Advance( uint64_t ns );
+extern uint32_t Sim_Spi_Hz( void );
+extern void Sim_Print_Stats( void );
+extern void Sim_Bus_Error( const char *fmt, ... );
+
+/* Chip side of the bus, driven by SPI1 in ch32v30x_sim.c */
+extern void Sim_Flash_Select( void );
+extern uint8_t Sim_Flash_Byte( uint8_t mosi );
+extern void Sim_Flash_Deselect( uint8_t cut );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
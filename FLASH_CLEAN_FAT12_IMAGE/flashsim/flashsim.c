@@ -0,0 +1,956 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : flashsim.c
+* Description        : Runs the unchanged FAT12.c, SW_UDISK.c and
+*                      SPI_FLASH.c on a PC, with SPI1/DMA1 modelled by
+*                      host/ch32v30x_sim.c and the flash chip by
+*                      SPI_FLASH_SIM.c, and prints the throughput the board
+*                      would reach.
+*
+*                      flashsim [options] [image]
+*                        -j id    JEDEC ID of the modelled chip (EF4016)
+*                        -c hz    limit SCK
+*                        -p us    page program time
+*                        -e us    4K sector erase time
+*                        -b us    64K block erase time
+*                        -u us    USB time per 64 byte bulk packet
+*                        -n sec   4 KByte sectors moved per test (64)
+*                        -o file  save the array when done
+*                        -m dev   block device under FAT12 and the disk:
+*                                 spi (default) or ram, a RAM copy of the
+*                                 image that shows the USB-bound ceiling
+*
+*                      The default image is ../readFAT12/FLASH_CARE_NU_MERGE.
+*                      Exit status is 1 when the written data does not read
+*                      back, the model saw a NOR rule broken or the driver
+*                      misused the bus.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include <stdlib.h>
+#include <unistd.h>
+#include "ch32v30x.h"
+#include "SPI_FLASH.h"
+#include "BLOCK_DEV.h"
+#include "SW_UDISK.h"
+#include "FAT12.h"
+#include "ch32v30x_usbfs_device.h"
+#include "SPI_FLASH_SIM.h"
+
+/******************************************************************************/
+/* Constant Definition */
+#define DEF_HOST_IMAGE             "../readFAT12/FLASH_CARE_NU_MERGE"
+#define DEF_HOST_JEDEC_ID          W25Q32_FLASH_ID1
+#define DEF_HOST_USB_PACK_US       53                                           /* 19 bulk packets per 1 ms frame */
+#define DEF_HOST_SECTORS           64
+#define DEF_HOST_CMD_SECTORS       16                                           /* 64 KByte per READ10/WRITE10, as Windows */
+#define DEF_HOST_STREAM_FILE       "WSCLI.HTM"                                  /* File read through fat12_read */
+#define DEF_HOST_BIG_NAME          "BIG     BIN"                                 /* Directory name of the file Host_Big_File_Test adds */
+#define DEF_HOST_BIG_FILE          "BIG.BIN"
+#define DEF_HOST_BIG_SIZE          ( 96 * 1024 + 100 )                          /* Over 64 KByte, more than one DMA transfer */
+#define DEF_HOST_PARTIAL_LBA       1000                                         /* Flash sector rewritten by Host_Partial_Test */
+#define DEF_HOST_BAD_LBA           900                                          /* Flash sector with a worn cell in Host_Bad_Write_Test */
+#define DEF_HOST_SUSPEND_ADDR      0x300000                                     /* 64 KByte block erased by Host_Suspend_Test */
+#define DEF_HOST_SUSPEND_READ      0x1000                                       /* Bytes read per pass during the erase */
+
+/******************************************************************************/
+/* Variable Definition */
+SIM_USBFSD_TypeDef Sim_USBFSD;
+struct FAT12_VOLUME vol;
+
+static uint8_t  Host_In_Buf[ DEF_UDISK_PACK_64 ];                               /* Last IN packet */
+static uint16_t Host_In_Len = 0;
+static uint64_t Host_Usb_Pack_Ns = DEF_HOST_USB_PACK_US * 1000;
+static uint32_t Host_Tag = 0;
+static BLK_DEV  *Host_Dev = &BLK_Dev_SPI_Flash;                                 /* Device under test */
+static uint64_t Host_Cost_Ns = 0;                                               /* Last Host_Transfer until the flash was idle */
+static uint32_t Host_Cost_Erases = 0;                                           /* Erase commands of the last Host_Transfer */
+
+/*******************************************************************************
+* Function Name  : USBFS_Endp_DataUp
+* Description    : Device loads an IN packet, the host picks it up
+* Input          : endp, *pbuf, len, mod
+* Output         : None
+* Return         : 0
+*******************************************************************************/
+uint8_t USBFS_Endp_DataUp( uint8_t endp, uint8_t *pbuf, uint16_t len, uint8_t mod )
+{
+    (void)endp;
+    (void)mod;
+    memcpy( Host_In_Buf, pbuf, len );
+    Host_In_Len = len;
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Idle_Until
+* Description    : Run the firmware main loop until a point in time
+* Input          : t - simulated time in ns
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Host_Idle_Until( uint64_t t )
+{
+    uint64_t before;
+
+    while( Sim_Now_Ns < t )
+    {
+        /* A poll that clocked nothing only spent CPU cycles, skip ahead */
+        before = Sim_Stats.Spi_Bytes;
+        BLK_Poll( Host_Dev );
+        if( Sim_Stats.Spi_Bytes == before )
+        {
+            Sim_Now_Ns = t;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Host_Out_Packet
+* Description    : One OUT packet: EP3 interrupt, then main loop for the
+*                  rest of the packet slot
+* Input          : *pbuf, len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Host_Out_Packet( uint8_t *pbuf, uint16_t len )
+{
+    uint64_t t0;
+
+    /* EP3 answers NAK while no sector buffer is free */
+    while( Udisk_Down_Wait )
+    {
+        Host_Idle_Until( Sim_Now_Ns + Host_Usb_Pack_Ns );
+    }
+    t0 = Sim_Now_Ns;
+    UDISK_Out_EP_Deal( pbuf, len );
+    Host_Idle_Until( t0 + Host_Usb_Pack_Ns );
+}
+
+/*******************************************************************************
+* Function Name  : Host_In_Packet
+* Description    : Take the loaded IN packet, the EP2 interrupt then loads
+*                  the next one
+* Input          : *pbuf - receives the packet
+* Output         : None
+* Return         : packet length, 0 if nothing was loaded
+*******************************************************************************/
+static uint16_t Host_In_Packet( uint8_t *pbuf )
+{
+    uint64_t t0;
+    uint16_t len;
+
+    len = Host_In_Len;
+    if( len == 0 )
+    {
+        return 0;
+    }
+    memcpy( pbuf, Host_In_Buf, len );
+    Host_In_Len = 0;
+    t0 = Sim_Now_Ns;
+    UDISK_In_EP_Deal( );
+    Host_Idle_Until( t0 + Host_Usb_Pack_Ns );
+    return len;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Command
+* Description    : Send a command block wrapper
+* Input          : *cb - SCSI command block, 16 bytes
+*                  len - data transfer length
+*                  in - 1: data to the host
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Host_Command( const uint8_t *cb, uint32_t len, uint8_t in )
+{
+    uint8_t cbw[ 31 ];
+
+    memset( cbw, 0, sizeof( cbw ) );
+    memcpy( cbw, "USBC", 4 );
+    Host_Tag++;
+    memcpy( &cbw[ 4 ], &Host_Tag, 4 );
+    cbw[ 8 ] = (uint8_t)len;
+    cbw[ 9 ] = (uint8_t)( len >> 8 );
+    cbw[ 10 ] = (uint8_t)( len >> 16 );
+    cbw[ 11 ] = (uint8_t)( len >> 24 );
+    cbw[ 12 ] = in ? 0x80 : 0x00;
+    cbw[ 14 ] = 10;
+    memcpy( &cbw[ 15 ], cb, 16 );
+    Host_Out_Packet( cbw, sizeof( cbw ) );
+}
+
+/*******************************************************************************
+* Function Name  : Host_CBW
+* Description    : Send a READ10/WRITE10 command block wrapper
+* Input          : op, lba, count - sectors
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Host_CBW( uint8_t op, uint32_t lba, uint16_t count )
+{
+    uint8_t cb[ 16 ];
+
+    memset( cb, 0, sizeof( cb ) );
+    cb[ 0 ] = op;
+    cb[ 2 ] = (uint8_t)( lba >> 24 );
+    cb[ 3 ] = (uint8_t)( lba >> 16 );
+    cb[ 4 ] = (uint8_t)( lba >> 8 );
+    cb[ 5 ] = (uint8_t)lba;
+    cb[ 7 ] = (uint8_t)( count >> 8 );
+    cb[ 8 ] = (uint8_t)count;
+    Host_Command( cb, (uint32_t)count * DEF_UDISK_SECTOR_SIZE, op == CMD_U_READ10 );
+}
+
+/*******************************************************************************
+* Function Name  : Host_CSW
+* Description    : Receive the command status wrapper. A stalled endpoint
+*                  is cleared first, as the host does after a failed command;
+*                  the device then sends the CSW.
+* Input          : None
+* Output         : None
+* Return         : CSW status, 0xFF if none came
+*******************************************************************************/
+static uint8_t Host_CSW( void )
+{
+    uint8_t pack[ DEF_UDISK_PACK_64 ];
+
+    if( ( Host_In_Len == 0 ) && ( Udisk_Transfer_Status & DEF_UDISK_CSW_UP_FLAG ) &&
+        ( ( ( Sim_USBFSD.UEP2_TX_CTRL & USBFS_UEP_T_RES_MASK ) == USBFS_UEP_T_RES_STALL ) ||
+          ( ( Sim_USBFSD.UEP3_RX_CTRL & USBFS_UEP_R_RES_MASK ) == USBFS_UEP_R_RES_STALL ) ) )
+    {
+        /* CLEAR_FEATURE( ENDPOINT_HALT ), as ch32v30x_usbfs_device.c answers it */
+        Sim_USBFSD.UEP2_TX_CTRL = 0;
+        Sim_USBFSD.UEP3_RX_CTRL = USBFS_UEP_R_RES_ACK;
+        UDISK_Up_CSW( );
+    }
+    if( ( Host_In_Packet( pack ) != 13 ) || memcmp( pack, "USBS", 4 ) )
+    {
+        return 0xFF;
+    }
+    return pack[ 12 ];
+}
+
+/*******************************************************************************
+* Function Name  : Host_Sense
+* Description    : REQUEST SENSE
+* Input          : None
+* Output         : None
+* Return         : sense key << 8 | additional sense code, 0xFFFF on error
+*******************************************************************************/
+static uint16_t Host_Sense( void )
+{
+    uint8_t cb[ 16 ], pack[ DEF_UDISK_PACK_64 ];
+
+    memset( cb, 0, sizeof( cb ) );
+    cb[ 0 ] = CMD_U_REQUEST_SENSE;
+    cb[ 4 ] = 18;
+    Host_Command( cb, 18, 1 );
+    if( ( Host_In_Packet( pack ) != 18 ) || Host_CSW( ) )
+    {
+        return 0xFFFF;
+    }
+    return (uint16_t)( ( pack[ 2 ] & 0x0F ) << 8 ) | pack[ 12 ];
+}
+
+/*******************************************************************************
+* Function Name  : Host_Test_Ready
+* Description    : TEST UNIT READY
+* Input          : None
+* Output         : None
+* Return         : CSW status
+*******************************************************************************/
+static uint8_t Host_Test_Ready( void )
+{
+    uint8_t cb[ 16 ];
+
+    memset( cb, 0, sizeof( cb ) );
+    cb[ 0 ] = CMD_U_TEST_READY;
+    Host_Command( cb, 0, 0 );
+    return Host_CSW( );
+}
+
+/*******************************************************************************
+* Function Name  : Host_Read10
+* Description    : READ10 of count sectors
+* Input          : lba, count, *pbuf
+* Output         : None
+* Return         : CSW status
+*******************************************************************************/
+static uint8_t Host_Read10( uint32_t lba, uint16_t count, uint8_t *pbuf )
+{
+    uint32_t len;
+
+    Host_CBW( CMD_U_READ10, lba, count );
+    len = (uint32_t)count * DEF_UDISK_SECTOR_SIZE;
+    while( len )
+    {
+        if( Host_In_Packet( pbuf ) != UDISK_Pack_Size )
+        {
+            return 0xFF;
+        }
+        pbuf += UDISK_Pack_Size;
+        len -= UDISK_Pack_Size;
+    }
+    return Host_CSW( );
+}
+
+/*******************************************************************************
+* Function Name  : Host_Write10
+* Description    : WRITE10 of count sectors
+* Input          : lba, count, *pbuf
+* Output         : None
+* Return         : CSW status
+*******************************************************************************/
+static uint8_t Host_Write10( uint32_t lba, uint16_t count, uint8_t *pbuf )
+{
+    uint32_t len;
+
+    Host_CBW( CMD_U_WRITE10, lba, count );
+    len = (uint32_t)count * DEF_UDISK_SECTOR_SIZE;
+    while( len )
+    {
+        Host_Out_Packet( pbuf, UDISK_Pack_Size );
+        pbuf += UDISK_Pack_Size;
+        len -= UDISK_Pack_Size;
+    }
+    return Host_CSW( );
+}
+
+/*******************************************************************************
+* Function Name  : Host_Transfer
+* Description    : Move sectors in 64 KByte commands and print the rate
+* Input          : *name, write, lba, count, *pbuf
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Transfer( const char *name, uint8_t write, uint32_t lba, uint32_t count, uint8_t *pbuf )
+{
+    uint64_t t0, t1;
+    uint32_t n, done, erases;
+    uint8_t  status;
+
+    t0 = Sim_Now_Ns;
+    erases = Sim_Stats.Erase_4K + Sim_Stats.Erase_32K + Sim_Stats.Erase_64K + Sim_Stats.Erase_Chip;
+    for( done = 0; done < count; done += n )
+    {
+        n = count - done;
+        if( n > DEF_HOST_CMD_SECTORS )
+        {
+            n = DEF_HOST_CMD_SECTORS;
+        }
+        if( write )
+        {
+            status = Host_Write10( lba + done, n, pbuf + done * DEF_UDISK_SECTOR_SIZE );
+        }
+        else
+        {
+            status = Host_Read10( lba + done, n, pbuf + done * DEF_UDISK_SECTOR_SIZE );
+        }
+        if( status )
+        {
+            printf( "%s: command failed at sector %u\n", name, (unsigned)( lba + done ) );
+            return 1;
+        }
+    }
+    t1 = Sim_Now_Ns;
+    BLK_Sync( Host_Dev );
+    Host_Cost_Ns = Sim_Now_Ns - t0;
+    Host_Cost_Erases = Sim_Stats.Erase_4K + Sim_Stats.Erase_32K + Sim_Stats.Erase_64K + Sim_Stats.Erase_Chip - erases;
+    printf( "%-22s %6u KByte  %9.3f ms  %8.1f KByte/s  (flash idle after %.3f ms, %u erases)\n",
+            name, (unsigned)( count * DEF_UDISK_SECTOR_SIZE / 1024 ), ( t1 - t0 ) / 1e6,
+            count * DEF_UDISK_SECTOR_SIZE / 1024.0 / ( ( t1 - t0 ) / 1e9 ), Host_Cost_Ns / 1e6,
+            (unsigned)Host_Cost_Erases );
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Disk_Access
+* Description    : Read or write whole sectors by byte address, in commands
+*                  of DEF_HOST_CMD_SECTORS at most
+* Input          : write, address, len - sector multiples, *pbuf
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Disk_Access( uint8_t write, uint32_t address, uint32_t len, uint8_t *pbuf )
+{
+    uint32_t lba, count, n;
+    uint8_t  status;
+
+    lba = address / DEF_UDISK_SECTOR_SIZE;
+    for( count = len / DEF_UDISK_SECTOR_SIZE; count; count -= n )
+    {
+        n = ( count > DEF_HOST_CMD_SECTORS ) ? DEF_HOST_CMD_SECTORS : count;
+        status = write ? Host_Write10( lba, n, pbuf ) : Host_Read10( lba, n, pbuf );
+        if( status )
+        {
+            return 1;
+        }
+        lba += n;
+        pbuf += n * DEF_UDISK_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Fat_Set
+* Description    : Set a 12-bit FAT entry
+* Input          : *fat, cluster, value
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Host_Fat_Set( uint8_t *fat, uint32_t cluster, uint16_t value )
+{
+    uint8_t *p = fat + cluster * 3 / 2;
+
+    if( cluster & 1 )
+    {
+        p[ 0 ] = (uint8_t)( ( p[ 0 ] & 0x0F ) | ( value << 4 ) );
+        p[ 1 ] = (uint8_t)( value >> 4 );
+    }
+    else
+    {
+        p[ 0 ] = (uint8_t)value;
+        p[ 1 ] = (uint8_t)( ( p[ 1 ] & 0xF0 ) | ( value >> 8 ) );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Host_Big_File_Add
+* Description    : Write a file to consecutive clusters through the USB
+*                  disk, as a PC would: the data, the chain in every FAT,
+*                  then the directory entry
+* Input          : first - first cluster, free like the ones after it
+*                  *data - cluster-sized buffer with the file contents
+*                  *fat, *root - buffers of the FAT and root directory size
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Big_File_Add( uint32_t first, uint8_t *data, uint8_t *fat, uint8_t *root )
+{
+    uint32_t clusters, c, i;
+    uint8_t  *e;
+
+    clusters = ( DEF_HOST_BIG_SIZE + vol.cluster_size - 1 ) / vol.cluster_size;
+    if( Host_Disk_Access( 1, vol.data_offset + ( first - 2 ) * vol.cluster_size, clusters * vol.cluster_size, data )
+     || Host_Disk_Access( 0, vol.fat_offset, vol.fat_size, fat )
+     || Host_Disk_Access( 0, vol.root_dir_offset, vol.root_dir_bytes, root ) )
+    {
+        return 1;
+    }
+    for( c = first; c < first + clusters; c++ )
+    {
+        Host_Fat_Set( fat, c, ( c + 1 < first + clusters ) ? (uint16_t)( c + 1 ) : FAT12_CLUSTER_EOC );
+    }
+    for( i = 0; i < vol.bpb.num_fats; i++ )
+    {
+        if( Host_Disk_Access( 1, vol.fat_offset + i * vol.fat_size, vol.fat_size, fat ) )
+        {
+            return 1;
+        }
+    }
+
+    for( e = root; ( e < root + vol.root_dir_bytes ) && ( e[ 0 ] != 0x00 ) && ( e[ 0 ] != 0xE5 ); e += FAT12_ENTRY_SIZE );
+    if( e >= root + vol.root_dir_bytes )
+    {
+        return 1;
+    }
+    memset( e, 0, FAT12_ENTRY_SIZE );
+    memcpy( e, DEF_HOST_BIG_NAME, FAT12_FILENAME_LENGTH );
+    e[ 11 ] = 0x20;                                                             /* Archive */
+    e[ 26 ] = (uint8_t)first;
+    e[ 27 ] = (uint8_t)( first >> 8 );
+    e[ 28 ] = (uint8_t)DEF_HOST_BIG_SIZE;
+    e[ 29 ] = (uint8_t)( DEF_HOST_BIG_SIZE >> 8 );
+    e[ 30 ] = (uint8_t)( DEF_HOST_BIG_SIZE >> 16 );
+    i = ( e - root ) / DEF_UDISK_SECTOR_SIZE * DEF_UDISK_SECTOR_SIZE;
+    if( Host_Disk_Access( 1, vol.root_dir_offset + i, DEF_UDISK_SECTOR_SIZE, root + i ) )
+    {
+        return 1;
+    }
+    return BLK_Sync( Host_Dev ) ? 1 : 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Big_File_Test
+* Description    : Add a file of DEF_HOST_BIG_SIZE bytes in consecutive free
+*                  clusters, then read it with a single fat12_read and its
+*                  clusters with a single BLK_Read. Both are longer than
+*                  one DMA transfer.
+* Input          : None
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Big_File_Test( void )
+{
+    struct FAT12_FILE file;
+    uint8_t  *data, *back, *fat, *root;
+    uint32_t clusters, first, run, c, i, len;
+    uint64_t t0;
+    int32_t  n;
+    uint8_t  ret;
+
+    /* First run of free clusters long enough for the file */
+    clusters = ( DEF_HOST_BIG_SIZE + vol.cluster_size - 1 ) / vol.cluster_size;
+    first = 0;
+    for( run = 0, c = 2; ( run < clusters ) && ( c <= vol.cluster_count + 1u ); c++ )
+    {
+        if( fat12_next_cluster( &vol, c ) != 0 )
+        {
+            run = 0;
+        }
+        else if( run++ == 0 )
+        {
+            first = c;
+        }
+    }
+    if( run < clusters )
+    {
+        printf( "Big file test: no %u free clusters in a row\n", (unsigned)clusters );
+        return 1;
+    }
+    len = clusters * vol.cluster_size;
+    data = malloc( len );
+    back = malloc( len );
+    fat = malloc( vol.fat_size );
+    root = malloc( vol.root_dir_bytes );
+    if( ( data == NULL ) || ( back == NULL ) || ( fat == NULL ) || ( root == NULL ) )
+    {
+        return 2;
+    }
+    for( i = 0; i < len; i++ )
+    {
+        data[ i ] = (uint8_t)( ( i * 13 ) ^ ( i >> 9 ) );
+    }
+
+    ret = Host_Big_File_Add( first, data, fat, root );
+    if( ret )
+    {
+        printf( "Big file test: cannot add %s\n", DEF_HOST_BIG_FILE );
+    }
+    else if( fat12_open( &vol, &file, DEF_HOST_BIG_FILE ) != FAT12_OK )
+    {
+        printf( "Big file test: %s not found\n", DEF_HOST_BIG_FILE );
+        ret = 1;
+    }
+    else
+    {
+        t0 = Sim_Now_Ns;
+        n = fat12_read( &file, back, len );
+        printf( "fat12_read %s %d bytes in one call, %.3f ms\n", DEF_HOST_BIG_FILE, (int)n, ( Sim_Now_Ns - t0 ) / 1e6 );
+        fat12_close( &file );
+        if( ( n != DEF_HOST_BIG_SIZE ) || memcmp( back, data, DEF_HOST_BIG_SIZE ) )
+        {
+            printf( "Big file test: fat12_read returned wrong data\n" );
+            ret = 1;
+        }
+        memset( back, 0, len );
+        if( BLK_Read( Host_Dev, vol.data_offset + ( first - 2 ) * vol.cluster_size, back, len, DEF_BLK_RD_SEQ )
+         || memcmp( back, data, len ) )
+        {
+            printf( "Big file test: BLK_Read of %u bytes returned wrong data\n", (unsigned)len );
+            ret = 1;
+        }
+    }
+    free( data );
+    free( back );
+    free( fat );
+    free( root );
+    return ret;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Stream_Test
+* Description    : Stream a file with fat12_read in 512 byte pieces, then
+*                  seek back and forth and check each piece against the
+*                  first pass
+* Input          : *name
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Stream_Test( const char *name )
+{
+    struct FAT12_FILE file;
+    uint8_t  *whole, piece[ 700 ];
+    uint64_t t0;
+    uint32_t pos, len, i;
+    int32_t  n;
+
+    if( fat12_open( &vol, &file, name ) != FAT12_OK )
+    {
+        printf( "%s not found\n", name );
+        return 0;
+    }
+    whole = malloc( file.size + 1 );
+    if( whole == NULL )
+    {
+        return 2;
+    }
+    t0 = Sim_Now_Ns;
+    for( pos = 0; ( n = fat12_read( &file, whole + pos, 512 ) ) > 0; pos += n );
+    printf( "fat12_read %s %u bytes in %.3f ms\n", name, (unsigned)pos, ( Sim_Now_Ns - t0 ) / 1e6 );
+    if( pos != file.size )
+    {
+        printf( "fat12_read stopped at %u\n", (unsigned)pos );
+        free( whole );
+        return 1;
+    }
+
+    /* Pieces across cluster boundaries, backwards and past the end */
+    for( i = 0; i < 64; i++ )
+    {
+        pos = (uint32_t)( ( i * 2654435761u ) % ( file.size + 100 ) );
+        len = ( i * 97 ) % sizeof( piece );
+        fat12_seek( &file, pos );
+        n = fat12_read( &file, piece, len );
+        if( pos > file.size )
+        {
+            pos = file.size;
+        }
+        if( ( n < 0 ) || ( (uint32_t)n != ( ( file.size - pos < len ) ? file.size - pos : len ) )
+         || memcmp( piece, whole + pos, n ) )
+        {
+            printf( "fat12_seek/read mismatch at %u\n", (unsigned)pos );
+            free( whole );
+            return 1;
+        }
+    }
+    fat12_close( &file );
+    free( whole );
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Partial_Test
+* Description    : Read a flash sector into the caches, then rewrite it with
+*                  one page cleared, so the update job programs only that
+*                  page in the middle of the sector, and read it again.
+*                  The second read must not come from a stale cache.
+* Input          : lba - first of the sectors, on a flash sector boundary
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Partial_Test( uint32_t lba )
+{
+    uint8_t  data[ DEF_FLASH_SECTOR_SIZE ], back[ DEF_FLASH_SECTOR_SIZE ];
+    uint16_t count;
+
+    count = DEF_FLASH_SECTOR_SIZE / DEF_UDISK_SECTOR_SIZE;
+    memset( data, 0xFF, sizeof( data ) );
+    if( Host_Write10( lba, count, data ) || BLK_Sync( Host_Dev ) || Host_Read10( lba, count, back ) )
+    {
+        printf( "Partial program test: command failed\n" );
+        return 1;
+    }
+    memset( &data[ 6 * SPI_FLASH_PageSize ], 0x00, SPI_FLASH_PageSize );
+    if( Host_Write10( lba, count, data ) || BLK_Sync( Host_Dev ) || Host_Read10( lba, count, back ) )
+    {
+        printf( "Partial program test: command failed\n" );
+        return 1;
+    }
+    if( memcmp( data, back, sizeof( data ) ) )
+    {
+        printf( "Partial program test: stale data after programming page 6\n" );
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Bad_Write_Test
+* Description    : Write a sector over a cell that cannot be programmed. The
+*                  verify fails on every retry; the failure must reach the
+*                  host as sense 03/0C, after the CSW of the WRITE10 as a
+*                  deferred error on the next command.
+* Input          : lba - first of the sectors, on a flash sector boundary
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Bad_Write_Test( uint32_t lba )
+{
+    uint8_t  data[ DEF_FLASH_SECTOR_SIZE ];
+    uint8_t  status;
+    uint16_t sense;
+
+    memset( data, 0x00, sizeof( data ) );
+    Sim_Stuck_Addr = lba * DEF_UDISK_SECTOR_SIZE + 0x123;
+    status = Host_Write10( lba, DEF_FLASH_SECTOR_SIZE / DEF_UDISK_SECTOR_SIZE, data );
+    BLK_Sync( Host_Dev );
+    if( status == 0 )
+    {
+        status = Host_Test_Ready( );
+    }
+    sense = Host_Sense( );
+    Sim_Stuck_Addr = 0xFFFFFFFF;
+    if( ( status != 0x01 ) || ( sense != 0x030C ) || Host_Test_Ready( ) )
+    {
+        printf( "Bad write test: status %02x sense %04x, want 01 030c\n", status, sense );
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : Host_Suspend_Test
+* Description    : Erase a 64 KByte block through the job engine while reads
+*                  keep coming, most outside the block and every 64th
+*                  inside it. The outside reads suspend the erase; the
+*                  erase must still finish, the outside data must be
+*                  intact and the inside reads must see 0xFF, never the
+*                  undefined contents of a suspended erase.
+* Input          : address - 64 KByte aligned, a block this test may erase
+* Output         : None
+* Return         : 0 = success
+*******************************************************************************/
+static uint8_t Host_Suspend_Test( uint32_t address )
+{
+    static uint8_t data[ DEF_HOST_SUSPEND_READ ], back[ DEF_HOST_SUSPEND_READ ], ref[ DEF_HOST_SUSPEND_READ ];
+    uint32_t erases, suspends, pass, i;
+    uint64_t t0;
+
+    for( i = 0; i < sizeof( data ); i++ )
+    {
+        data[ i ] = (uint8_t)( i * 13 + 1 );
+    }
+    for( i = 0; i < 0x10000; i += sizeof( data ) )
+    {
+        BLK_Write( Host_Dev, data, address + i, sizeof( data ), NULL );
+        BLK_Sync( Host_Dev );
+    }
+    BLK_Read( Host_Dev, 0, ref, sizeof( ref ), DEF_BLK_RD_SMALL );
+    BLK_Sync( Host_Dev );
+
+    erases = Sim_Stats.Erase_64K;
+    suspends = Sim_Stats.Suspends;
+    t0 = Sim_Now_Ns;
+    BLK_Erase( Host_Dev, address, 0x10000 );
+    BLK_Poll( Host_Dev );
+    for( pass = 0; FLASH_Job_Pending( ); pass++ )
+    {
+        if( Sim_Now_Ns - t0 > (uint64_t)Sim_Timing.Block64_Erase_Us * 4000 )
+        {
+            printf( "Suspend test: erase not done after %.3f ms\n", ( Sim_Now_Ns - t0 ) / 1e6 );
+            return 1;
+        }
+        if( pass % 64 == 63 )
+        {
+            BLK_Read( Host_Dev, address + ( pass * sizeof( back ) ) % 0x10000, back, sizeof( back ), DEF_BLK_RD_SMALL );
+            memset( data, 0xFF, sizeof( data ) );
+        }
+        else
+        {
+            BLK_Read( Host_Dev, 0, back, sizeof( back ), DEF_BLK_RD_SMALL );
+            memcpy( data, ref, sizeof( data ) );
+        }
+        if( memcmp( data, back, sizeof( back ) ) )
+        {
+            printf( "Suspend test: pass %u read wrong data during the erase\n", (unsigned)pass );
+            return 1;
+        }
+        BLK_Poll( Host_Dev );
+    }
+    printf( "64 KByte erase with %u reads, %u suspends, %.3f ms\n", (unsigned)pass,
+            (unsigned)( Sim_Stats.Suspends - suspends ), ( Sim_Now_Ns - t0 ) / 1e6 );
+    if( ( Sim_Stats.Erase_64K == erases ) || ( Sim_Stats.Suspends == suspends ) )
+    {
+        printf( "Suspend test: %u 64 KByte erases, %u suspends, want 1 and more than 0\n",
+                (unsigned)( Sim_Stats.Erase_64K - erases ), (unsigned)( Sim_Stats.Suspends - suspends ) );
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : main
+* Description    : Main program.
+* Input          : None
+* Return         : None
+*******************************************************************************/
+int main( int argc, char *argv[] )
+{
+    const char *image = DEF_HOST_IMAGE;
+    const char *out = NULL;
+    uint32_t   jedec = DEF_HOST_JEDEC_ID;
+    uint32_t   count = DEF_HOST_SECTORS;
+    uint32_t   top, i;
+    uint64_t   t0, same_ns;
+    uint32_t   same_erases;
+    uint8_t    *data, *back, *ram;
+    int        opt, ret, use_ram = 0;
+
+    while( ( opt = getopt( argc, argv, "j:c:p:e:b:u:n:o:m:" ) ) != -1 )
+    {
+        switch( opt )
+        {
+            case 'j': jedec = strtoul( optarg, NULL, 16 );                  break;
+            case 'c': Sim_Timing.Spi_Max_Hz = strtoul( optarg, NULL, 0 );   break;
+            case 'p': Sim_Timing.Page_Prog_Us = strtoul( optarg, NULL, 0 ); break;
+            case 'e': Sim_Timing.Sector_Erase_Us = strtoul( optarg, NULL, 0 ); break;
+            case 'b': Sim_Timing.Block64_Erase_Us = strtoul( optarg, NULL, 0 ); break;
+            case 'u': Host_Usb_Pack_Ns = strtoull( optarg, NULL, 0 ) * 1000; break;
+            case 'n': count = strtoul( optarg, NULL, 0 );                   break;
+            case 'o': out = optarg;                                         break;
+            case 'm': use_ram = ( strcmp( optarg, "ram" ) == 0 );           break;
+            default:
+                printf( "usage: flashsim [-j id] [-c hz] [-p us] [-e us] [-b us] [-u us] [-n sectors] [-o out] [-m spi|ram] [image]\n" );
+                return 2;
+        }
+    }
+    if( optind < argc )
+    {
+        image = argv[ optind ];
+    }
+    if( Sim_Open( image, jedec ) )
+    {
+        return 2;
+    }
+
+    FLASH_Port_Init( );
+    FLASH_IC_Check( );
+    printf( "Flash unique chip ID: %016llX\n", (unsigned long long)FLASH_ReadUNIQUEID( ) );
+    printf( "SCK %u Hz, %u sectors of %u bytes\n", (unsigned)Sim_Spi_Hz( ),
+            (unsigned)Flash_Sector_Count, (unsigned)Flash_Sector_Size );
+    BLK_SPI_Flash_Init( );
+    ram = NULL;
+    if( use_ram )
+    {
+        /* Copy the image to RAM and run everything below on that instead */
+        ram = malloc( BLK_Dev_SPI_Flash.Capacity );
+        if( ram == NULL )
+        {
+            return 2;
+        }
+        BLK_Read( &BLK_Dev_SPI_Flash, 0, ram, BLK_Dev_SPI_Flash.Capacity, DEF_BLK_RD_SEQ );
+        BLK_Sync( &BLK_Dev_SPI_Flash );
+        BLK_RAM_Init( ram, BLK_Dev_SPI_Flash.Capacity, DEF_UDISK_SECTOR_SIZE );
+        Host_Dev = &BLK_Dev_RAM;
+    }
+    printf( "Block device: %s, %u KByte\n", Host_Dev->Name, (unsigned)( Host_Dev->Capacity / 1024 ) );
+
+    /* FAT12 layer, as main.c */
+    printf( "==============================================\n" );
+    t0 = Sim_Now_Ns;
+    if( fat12_mount( &vol, Host_Dev ) != FAT12_OK )
+    {
+        /* vol holds no valid BPB, nothing to list or stream */
+        printf( "No valid FAT12 volume\n" );
+        ret = 1;
+    }
+    else
+    {
+        list_files_spi( &vol.bpb );
+        printf( "==================== END =====================\n" );
+        printf( "FAT12 listing took %.3f ms\n", ( Sim_Now_Ns - t0 ) / 1e6 );
+        ret = Host_Stream_Test( DEF_HOST_STREAM_FILE );
+    }
+    printf( "\n" );
+
+    /* USB disk layer */
+    UDISK_Init( Host_Dev );
+    UDisk_Write_Notify = fat12_disk_written;
+    if( count > Udisk_Capability / 2 )
+    {
+        count = Udisk_Capability / 2;
+    }
+    data = malloc( count * DEF_UDISK_SECTOR_SIZE );
+    back = malloc( count * DEF_UDISK_SECTOR_SIZE );
+    if( ( data == NULL ) || ( back == NULL ) )
+    {
+        return 2;
+    }
+#if DEF_FLASH_PD_EN
+    /* Host idle long enough for the flash to power down, the first CBW wakes it */
+    Host_Idle_Until( Sim_Now_Ns + (uint64_t)DEF_FLASH_PD_IDLE_MS * 2000000 );
+    FLASH_Job_Poll( );
+#endif
+    ret |= Host_Transfer( "READ10 from sector 0", 0, 0, count, data );
+    ret |= Host_Transfer( "WRITE10 same data", 1, 0, count, data );
+    same_ns = Host_Cost_Ns;
+    same_erases = Host_Cost_Erases;
+    ret |= Host_Partial_Test( DEF_HOST_PARTIAL_LBA );
+    if( vol.mounted )
+    {
+        ret |= Host_Big_File_Test( );
+    }
+    if( Host_Dev == &BLK_Dev_SPI_Flash )
+    {
+        ret |= Host_Bad_Write_Test( DEF_HOST_BAD_LBA );
+        ret |= Host_Suspend_Test( DEF_HOST_SUSPEND_ADDR );
+    }
+
+    top = Udisk_Capability - count;
+    for( i = 0; i < count * DEF_UDISK_SECTOR_SIZE; i++ )
+    {
+        data[ i ] = (uint8_t)( ( i * 7 ) ^ ( i >> 12 ) );
+    }
+    ret |= Host_Transfer( "WRITE10 new data", 1, top, count, data );
+#if DEF_UDISK_WRITE_COMPARE
+    /* Rewriting what the disk holds must be cheaper than writing new data */
+    if( ( Host_Dev == &BLK_Dev_SPI_Flash ) && ( ( same_erases >= Host_Cost_Erases ) || ( same_ns >= Host_Cost_Ns ) ) )
+    {
+        printf( "Same data not skipped: %u erases %.3f ms, new data %u erases %.3f ms\n",
+                (unsigned)same_erases, same_ns / 1e6, (unsigned)Host_Cost_Erases, Host_Cost_Ns / 1e6 );
+        ret = 1;
+    }
+#endif
+    ret |= Host_Transfer( "READ10 back", 0, top, count, back );
+    if( memcmp( data, back, count * DEF_UDISK_SECTOR_SIZE ) )
+    {
+        printf( "Read back differs from the written data\n" );
+        ret = 1;
+    }
+    printf( "\n" );
+
+    Sim_Print_Stats( );
+    FLASH_Stats_Dump( );
+    if( Sim_Stats.Busy_Violations || Sim_Stats.Lost_Bits || Sim_Stats.Bus_Errors )
+    {
+        ret = 1;
+    }
+#if DEF_FLASH_STATS_EN
+    /* Every counted operation leaves exactly one latency sample */
+    for( i = 0; i < DEF_FLASH_OP_NUM; i++ )
+    {
+        uint32_t n, samples = 0;
+
+        for( n = 0; n < DEF_FLASH_STATS_BUCKETS; n++ )
+        {
+            samples += Flash_Stats.Latency_Hist[ i ][ n ];
+        }
+        if( samples != Flash_Stats.Op_Count[ i ] )
+        {
+            printf( "Flash_Stats op %u: %u ops, %u latency samples\n", (unsigned)i,
+                    (unsigned)Flash_Stats.Op_Count[ i ], (unsigned)samples );
+            ret = 1;
+        }
+    }
+
+    /* Program/erase busy time seen by the driver, whichever path polled it,
+       cannot be shorter than the time the model held WIP */
+    if( Host_Dev == &BLK_Dev_SPI_Flash )
+    {
+        uint64_t busy = 0;
+
+        for( i = DEF_FLASH_OP_PROG; i < DEF_FLASH_OP_NUM; i++ )
+        {
+            busy += Flash_Stats.Busy_Total[ i ];
+        }
+        busy = busy * 1000 / ( SystemCoreClock / 1000000 );
+        if( busy < Sim_Stats.Busy_Ns )
+        {
+            printf( "Flash_Stats busy %.3f ms, model busy %.3f ms\n", busy / 1e6, Sim_Stats.Busy_Ns / 1e6 );
+            ret = 1;
+        }
+    }
+#endif
+    if( out && Sim_Save( out ) )
+    {
+        printf( "Cannot write %s\n", out );
+        ret = 2;
+    }
+    free( data );
+    free( back );
+    free( ram );
+    Sim_Close( );
+    return ret;
+}
@@ -0,0 +1,212 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : ch32v30x.h
+* Description        : Host stand-in for the device header, enough of GPIOA,
+*                      SPI1, DMA1, CRC, RCC and the PFIC for SPI_FLASH.c.
+*                      The peripherals are modelled by ch32v30x_sim.c.
+*
+*                      Register members are macros that index Reg[] through
+*                      a hook, so every SPI1->STATR or GPIOA->BCR access in
+*                      the driver calls the model once, in program order.
+*******************************************************************************/
+
+#ifndef __CH32V30x_H
+#define __CH32V30x_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define __I     volatile const
+#define __O     volatile
+#define __IO    volatile
+
+/* The WCH interrupt attribute has an argument, x86 gcc rejects it */
+#define interrupt( x )
+
+typedef enum {DISABLE = 0, ENABLE = !DISABLE} FunctionalState;
+typedef enum {RESET = 0, SET = !RESET} FlagStatus, ITStatus;
+
+/* Interrupt Number Definition, the entries SPI_FLASH.c uses */
+typedef enum IRQn
+{
+  DMA1_Channel2_IRQn          = 28,      /* DMA1 Channel 2 global Interrupt                      */
+  DMA1_Channel3_IRQn          = 29,      /* DMA1 Channel 3 global Interrupt                      */
+  USBFS_IRQn                  = 83,      /* USBFS global Interrupt                               */
+} IRQn_Type;
+
+extern uint32_t SystemCoreClock;
+
+/******************************************************************************/
+/* Peripheral registers, member names are defined below */
+typedef struct
+{
+    __IO uint32_t Reg[ 4 ];
+} SPI_TypeDef;
+
+typedef struct
+{
+    __IO uint32_t Reg[ 2 ];
+} GPIO_TypeDef;
+
+typedef struct
+{
+    __IO uint32_t  CFGR;
+    __IO uint32_t  CNTR;
+    __IO uintptr_t PADDR;                                                       /* 64-bit on the host */
+    __IO uintptr_t MADDR;
+} DMA_Channel_TypeDef;
+
+#define SIM_SPI_CTLR1              0
+#define SIM_SPI_STATR              1
+#define SIM_SPI_DATAR              2
+#define SIM_SPI_HSCR               3
+
+#define SIM_GPIO_BSHR              0
+#define SIM_GPIO_BCR               1
+
+#define CTLR1                      Reg[ Sim_SPI_Reg( SIM_SPI_CTLR1 ) ]
+#define STATR                      Reg[ Sim_SPI_Reg( SIM_SPI_STATR ) ]
+#define DATAR                      Reg[ Sim_SPI_Reg( SIM_SPI_DATAR ) ]
+#define HSCR                       Reg[ Sim_SPI_Reg( SIM_SPI_HSCR ) ]
+#define BSHR                       Reg[ Sim_GPIO_Reg( SIM_GPIO_BSHR ) ]
+#define BCR                        Reg[ Sim_GPIO_Reg( SIM_GPIO_BCR ) ]
+
+extern SPI_TypeDef         Sim_SPI1;
+extern GPIO_TypeDef        Sim_GPIOA;
+extern DMA_Channel_TypeDef Sim_DMA1_Channel2;
+extern DMA_Channel_TypeDef Sim_DMA1_Channel3;
+
+#define SPI1                       ( &Sim_SPI1 )
+#define GPIOA                      ( &Sim_GPIOA )
+#define DMA1_Channel2              ( &Sim_DMA1_Channel2 )
+#define DMA1_Channel3              ( &Sim_DMA1_Channel3 )
+
+/* Bit definition for SPI_HSCR register */
+#define  SPI_HSCR_HSRXEN                     ((uint16_t)0x0001)
+
+/******************************************************************************/
+/* GPIO */
+#define GPIO_Pin_2                 ((uint16_t)0x0004)
+#define GPIO_Pin_5                 ((uint16_t)0x0020)
+#define GPIO_Pin_6                 ((uint16_t)0x0040)
+#define GPIO_Pin_7                 ((uint16_t)0x0080)
+
+typedef enum
+{
+  GPIO_Speed_10MHz = 1,
+  GPIO_Speed_2MHz,
+  GPIO_Speed_50MHz
+}GPIOSpeed_TypeDef;
+
+typedef enum
+{
+  GPIO_Mode_AIN = 0x0,
+  GPIO_Mode_IN_FLOATING = 0x04,
+  GPIO_Mode_IPD = 0x28,
+  GPIO_Mode_IPU = 0x48,
+  GPIO_Mode_Out_OD = 0x14,
+  GPIO_Mode_Out_PP = 0x10,
+  GPIO_Mode_AF_OD = 0x1C,
+  GPIO_Mode_AF_PP = 0x18
+}GPIOMode_TypeDef;
+
+typedef struct
+{
+  uint16_t GPIO_Pin;
+  GPIOSpeed_TypeDef GPIO_Speed;
+  GPIOMode_TypeDef GPIO_Mode;
+}GPIO_InitTypeDef;
+
+/******************************************************************************/
+/* DMA */
+typedef struct
+{
+  uintptr_t DMA_PeripheralBaseAddr;
+  uintptr_t DMA_MemoryBaseAddr;
+  uint32_t DMA_DIR;
+  uint32_t DMA_BufferSize;
+  uint32_t DMA_PeripheralInc;
+  uint32_t DMA_MemoryInc;
+  uint32_t DMA_PeripheralDataSize;
+  uint32_t DMA_MemoryDataSize;
+  uint32_t DMA_Mode;
+  uint32_t DMA_Priority;
+  uint32_t DMA_M2M;
+}DMA_InitTypeDef;
+
+#define DMA_DIR_PeripheralDST              ((uint32_t)0x00000010)
+#define DMA_DIR_PeripheralSRC              ((uint32_t)0x00000000)
+#define DMA_PeripheralInc_Enable           ((uint32_t)0x00000040)
+#define DMA_PeripheralInc_Disable          ((uint32_t)0x00000000)
+#define DMA_MemoryInc_Enable               ((uint32_t)0x00000080)
+#define DMA_MemoryInc_Disable              ((uint32_t)0x00000000)
+#define DMA_PeripheralDataSize_Byte        ((uint32_t)0x00000000)
+#define DMA_MemoryDataSize_Byte            ((uint32_t)0x00000000)
+#define DMA_Mode_Normal                    ((uint32_t)0x00000000)
+#define DMA_Priority_VeryHigh              ((uint32_t)0x00003000)
+#define DMA_Priority_High                  ((uint32_t)0x00002000)
+#define DMA_M2M_Disable                    ((uint32_t)0x00000000)
+
+#define DMA_IT_TC                          ((uint32_t)0x00000002)
+
+#define DMA1_IT_GL2                        ((uint32_t)0x00000010)
+#define DMA1_IT_TC2                        ((uint32_t)0x00000020)
+#define DMA1_IT_GL3                        ((uint32_t)0x00000100)
+#define DMA1_IT_TC3                        ((uint32_t)0x00000200)
+#define DMA1_FLAG_GL2                      ((uint32_t)0x00000010)
+#define DMA1_FLAG_TC2                      ((uint32_t)0x00000020)
+#define DMA1_FLAG_GL3                      ((uint32_t)0x00000100)
+#define DMA1_FLAG_TC3                      ((uint32_t)0x00000200)
+
+/******************************************************************************/
+/* RCC */
+typedef struct
+{
+  uint32_t SYSCLK_Frequency;
+  uint32_t HCLK_Frequency;
+  uint32_t PCLK1_Frequency;
+  uint32_t PCLK2_Frequency;
+  uint32_t ADCCLK_Frequency;
+}RCC_ClocksTypeDef;
+
+#define RCC_AHBPeriph_DMA1               ((uint32_t)0x00000001)
+#define RCC_AHBPeriph_CRC                ((uint32_t)0x00000040)
+#define RCC_APB2Periph_GPIOA             ((uint32_t)0x00000004)
+#define RCC_APB2Periph_SPI1              ((uint32_t)0x00001000)
+
+/******************************************************************************/
+/* Library functions, model in ch32v30x_sim.c */
+extern void GPIO_Init( GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct );
+extern void GPIO_SetBits( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin );
+extern void DMA_DeInit( DMA_Channel_TypeDef *DMAy_Channelx );
+extern void DMA_Init( DMA_Channel_TypeDef *DMAy_Channelx, DMA_InitTypeDef *DMA_InitStruct );
+extern void DMA_Cmd( DMA_Channel_TypeDef *DMAy_Channelx, FunctionalState NewState );
+extern void DMA_ITConfig( DMA_Channel_TypeDef *DMAy_Channelx, uint32_t DMA_IT, FunctionalState NewState );
+extern FlagStatus DMA_GetFlagStatus( uint32_t DMAy_FLAG );
+extern void DMA_ClearFlag( uint32_t DMAy_FLAG );
+extern ITStatus DMA_GetITStatus( uint32_t DMAy_IT );
+extern void DMA_ClearITPendingBit( uint32_t DMAy_IT );
+extern void CRC_ResetDR( void );
+extern uint32_t CRC_CalcCRC( uint32_t Data );
+extern uint32_t CRC_GetCRC( void );
+extern void RCC_GetClocksFreq( RCC_ClocksTypeDef *RCC_Clocks );
+extern void RCC_AHBPeriphClockCmd( uint32_t RCC_AHBPeriph, FunctionalState NewState );
+extern void RCC_APB2PeriphClockCmd( uint32_t RCC_APB2Periph, FunctionalState NewState );
+extern void NVIC_EnableIRQ( IRQn_Type IRQn );
+extern void NVIC_DisableIRQ( IRQn_Type IRQn );
+extern uint32_t NVIC_GetStatusIRQ( IRQn_Type IRQn );
+
+/* Hooks of the register members and of the CSR accesses in SPI_FLASH.c */
+extern uint32_t Sim_SPI_Reg( uint32_t reg );
+extern uint32_t Sim_GPIO_Reg( uint32_t reg );
+extern uint64_t Sim_Mcycle( void );
+extern uint32_t Sim_Gintenr_Clear( uint32_t mask );
+extern void Sim_Gintenr_Set( uint32_t mask );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
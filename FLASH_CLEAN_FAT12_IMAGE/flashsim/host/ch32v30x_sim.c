@@ -0,0 +1,854 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : ch32v30x_sim.c
+* Description        : Host model of the CH32V30x parts SPI_FLASH.c uses:
+*                      GPIOA (CS# on PA2), SPI1 with its transmit buffer,
+*                      shift register, RXNE/TXE/OVR/BSY and DMA requests,
+*                      DMA1 channels 2 and 3 with their TC interrupts, the
+*                      CRC unit, RCC clocks, the PFIC enables and mcycle.
+*
+*                      Frames take their SCK time on Sim_Now_Ns and are
+*                      exchanged with the chip in SPI_FLASH_SIM.c when they
+*                      end. Register accesses reach Sim_SPI_Reg and
+*                      Sim_GPIO_Reg before they happen; a write is seen at
+*                      the next hook. A CPU that reads the same status
+*                      twice with nothing in between is waiting, time then
+*                      jumps to the end of the running frame.
+*******************************************************************************/
+
+/******************************************************************************/
+/* Header Files */
+#include <stdio.h>
+#include <stdlib.h>
+#include "ch32v30x_spi.h"
+#include "SPI_FLASH_SIM.h"
+
+/******************************************************************************/
+/* Constant Definition */
+#define SIM_SPI_CR1_SPE            0x0040
+#define SIM_SPI_CR1_BR             0x0038
+#define SIM_SPI_CR1_DFF            0x0800
+#define SIM_SPI_DR_TAG             0x10000                                      /* Survives a read of the preloaded DATAR */
+
+#define SIM_DMA_CFGR_EN            0x0001
+#define SIM_DMA_CFGR_TCIE          0x0002
+#define SIM_DMA_CFGR_KEEP          0xFFFF800F                                   /* Bits DMA_Init leaves, as the library */
+
+#define SIM_PEND_NONE              0
+#define SIM_PEND_SPI               0x10                                         /* | SIM_SPI_xx */
+#define SIM_PEND_GPIO              0x20                                         /* | SIM_GPIO_xx */
+
+#define SIM_SPIN_MAX               10000000                                     /* Status polls without a change: a hang */
+
+/******************************************************************************/
+/* Variable Definition */
+SPI_TypeDef         Sim_SPI1;
+GPIO_TypeDef        Sim_GPIOA;
+DMA_Channel_TypeDef Sim_DMA1_Channel2;
+DMA_Channel_TypeDef Sim_DMA1_Channel3;
+uint32_t            SystemCoreClock = DEF_SIM_PCLK2_HZ;
+
+static uint16_t Sim_SPI_Cr1 = 0;                                                /* CTLR1 as last written */
+static uint16_t Sim_SPI_Dma = 0;                                                /* SPI_I2S_DMAReq_xx enabled */
+static uint16_t Sim_SPI_Sr = SPI_I2S_FLAG_TXE;                                  /* RXNE, TXE, OVR */
+static uint16_t Sim_SPI_Rx = 0;                                                 /* Receive buffer */
+static uint16_t Sim_SPI_Tx = 0;                                                 /* Transmit buffer, full while TXE=0 */
+static uint8_t  Sim_SPI_Shift = 0;                                              /* A frame is in the shift register */
+static uint16_t Sim_SPI_Shift_Data = 0;
+static uint8_t  Sim_SPI_Shift_Bits = 8;
+static uint8_t  Sim_SPI_Shift_Cut = 0;                                          /* CS# moved during the frame */
+static uint64_t Sim_SPI_End_Ps = 0;                                             /* End of the frame in the shift register */
+static uint8_t  Sim_SPI_Dr_Read = 0;                                            /* DATAR read, the next STATR read clears OVR */
+static int32_t  Sim_SPI_Last_Sr = -1;                                           /* Last status read, -1: state changed since */
+static uint32_t Sim_SPI_Spins = 0;
+
+static uint16_t Sim_GPIOA_Odr = 0;
+static uint16_t Sim_GPIOA_Out = 0;                                              /* Pins configured as outputs */
+static uint8_t  Sim_Cs_High = 1;                                                /* CS# level, pulled up until driven */
+
+static uint32_t Sim_DMA_Intfr = 0;                                              /* DMA1 INTFR, channels 2 and 3 */
+static uint32_t Sim_CRC = 0xFFFFFFFF;
+
+static uint8_t  Sim_Pending = SIM_PEND_NONE;                                    /* Register access seen at the next hook */
+static uint32_t Sim_Gintenr = 0x88;                                             /* Global interrupt enable CSR */
+static uint32_t Sim_Nvic_En[ 4 ];
+static uint8_t  Sim_In_Isr = 0;
+
+extern void DMA1_Channel2_IRQHandler( void );
+extern void DMA1_Channel3_IRQHandler( void );
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Sck_Hz
+* Description    : SCK from PCLK2 and the CTLR1 prescaler
+* Input          : None
+* Output         : None
+* Return         : Hz
+*******************************************************************************/
+static uint32_t Sim_SPI_Sck_Hz( void )
+{
+    return Sim_Timing.Pclk2_Hz >> ( ( ( Sim_SPI_Cr1 & SIM_SPI_CR1_BR ) >> 3 ) + 1 );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Spi_Hz
+* Description    : Current SCK of SPI1
+* Input          : None
+* Output         : None
+* Return         : Hz
+*******************************************************************************/
+uint32_t Sim_Spi_Hz( void )
+{
+    return Sim_SPI_Sck_Hz( );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Start
+* Description    : Move the transmit buffer to the shift register
+* Input          : t_ps - start of the frame
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Start( uint64_t t_ps )
+{
+    Sim_SPI_Shift_Data = Sim_SPI_Tx;
+    Sim_SPI_Shift_Bits = ( Sim_SPI_Cr1 & SIM_SPI_CR1_DFF ) ? 16 : 8;
+    Sim_SPI_Shift_Cut = 0;
+    Sim_SPI_Shift = 1;
+    Sim_SPI_Sr |= SPI_I2S_FLAG_TXE;
+    Sim_SPI_End_Ps = t_ps + (uint64_t)Sim_SPI_Shift_Bits * 1000000000000ULL / Sim_SPI_Sck_Hz( );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_DMA_Service
+* Description    : Serve the SPI1 DMA requests: RXNE to channel 2, TXE
+*                  from channel 3, starting the shift register if idle
+* Input          : t_ps - time of the request
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_DMA_Service( uint64_t t_ps )
+{
+    DMA_Channel_TypeDef *ch;
+
+    ch = DMA1_Channel2;
+    if( ( Sim_SPI_Dma & SPI_I2S_DMAReq_Rx ) && ( Sim_SPI_Sr & SPI_I2S_FLAG_RXNE )
+     && ( ch->CFGR & SIM_DMA_CFGR_EN ) && ch->CNTR )
+    {
+        if( ( ch->CFGR & DMA_DIR_PeripheralDST ) || ( ch->PADDR != (uintptr_t)&Sim_SPI1.Reg[ SIM_SPI_DATAR ] ) )
+        {
+            Sim_Bus_Error( "DMA1 channel 2 is not set up to read SPI1 DATAR" );
+        }
+        *(uint8_t *)ch->MADDR = (uint8_t)Sim_SPI_Rx;
+        if( ch->CFGR & DMA_MemoryInc_Enable )
+        {
+            ch->MADDR++;
+        }
+        Sim_SPI_Sr &= ~SPI_I2S_FLAG_RXNE;
+        if( --ch->CNTR == 0 )
+        {
+            Sim_DMA_Intfr |= DMA1_FLAG_GL2 | DMA1_FLAG_TC2;
+        }
+    }
+
+    ch = DMA1_Channel3;
+    while( ( Sim_SPI_Dma & SPI_I2S_DMAReq_Tx ) && ( Sim_SPI_Sr & SPI_I2S_FLAG_TXE )
+        && ( ch->CFGR & SIM_DMA_CFGR_EN ) && ch->CNTR )
+    {
+        if( ( ( ch->CFGR & DMA_DIR_PeripheralDST ) == 0 ) || ( ch->PADDR != (uintptr_t)&Sim_SPI1.Reg[ SIM_SPI_DATAR ] ) )
+        {
+            Sim_Bus_Error( "DMA1 channel 3 is not set up to write SPI1 DATAR" );
+        }
+        if( Sim_SPI_Cr1 & SIM_SPI_CR1_DFF )
+        {
+            Sim_Bus_Error( "byte DMA into 16-bit SPI1 frames" );
+        }
+        Sim_SPI_Tx = *(const uint8_t *)ch->MADDR;
+        if( ch->CFGR & DMA_MemoryInc_Enable )
+        {
+            ch->MADDR++;
+        }
+        Sim_SPI_Sr &= ~SPI_I2S_FLAG_TXE;
+        if( --ch->CNTR == 0 )
+        {
+            Sim_DMA_Intfr |= DMA1_FLAG_GL3 | DMA1_FLAG_TC3;
+        }
+        if( ( Sim_SPI_Shift == 0 ) && ( Sim_SPI_Cr1 & SIM_SPI_CR1_SPE ) )
+        {
+            Sim_SPI_Start( t_ps );
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Frame_End
+* Description    : The frame in the shift register is complete: exchange it
+*                  with the chip, fill the receive buffer, start the next
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Frame_End( void )
+{
+    uint16_t rx;
+    uint8_t  n;
+
+    rx = 0;
+    for( n = Sim_SPI_Shift_Bits; n; n -= 8 )
+    {
+        rx <<= 8;
+        if( Sim_Cs_High || Sim_SPI_Shift_Cut )
+        {
+            rx |= 0xFF;                                                         /* MISO pulled up */
+        }
+        else
+        {
+            rx |= Sim_Flash_Byte( (uint8_t)( Sim_SPI_Shift_Data >> ( n - 8 ) ) );
+        }
+        Sim_Stats.Spi_Bytes++;
+    }
+    if( Sim_Timing.Spi_Max_Hz && ( Sim_SPI_Sck_Hz( ) > Sim_Timing.Spi_Max_Hz ) )
+    {
+        /* Too fast for the board, MISO is sampled one bit late */
+        rx = ( rx >> 1 ) | ( ( Sim_SPI_Shift_Bits == 16 ) ? 0x8000 : 0x80 );
+    }
+    Sim_SPI_Shift = 0;
+
+    if( Sim_SPI_Sr & SPI_I2S_FLAG_RXNE )
+    {
+        Sim_SPI_Sr |= SPI_I2S_FLAG_OVR;
+    }
+    else
+    {
+        Sim_SPI_Rx = rx;
+        Sim_SPI_Sr |= SPI_I2S_FLAG_RXNE;
+    }
+    if( ( ( Sim_SPI_Sr & SPI_I2S_FLAG_TXE ) == 0 ) && ( Sim_SPI_Cr1 & SIM_SPI_CR1_SPE ) )
+    {
+        Sim_SPI_Start( Sim_SPI_End_Ps );
+    }
+    Sim_DMA_Service( Sim_SPI_End_Ps );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Run
+* Description    : Complete the frames that end by Sim_Now_Ns
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Run( void )
+{
+    while( Sim_SPI_Shift && ( Sim_SPI_End_Ps <= Sim_Now_Ns * 1000 ) )
+    {
+        Sim_SPI_Frame_End( );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Wait
+* Description    : The CPU polls a state that has not changed: let time run
+*                  to the end of the current frame, or stop a target that
+*                  would hang
+* Input          : what - polled register for the report
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Wait( const char *what )
+{
+    if( Sim_SPI_Shift )
+    {
+        Sim_Now_Ns = ( Sim_SPI_End_Ps + 999 ) / 1000;
+        Sim_SPI_Spins = 0;
+        Sim_SPI_Run( );
+    }
+    else if( ++Sim_SPI_Spins > SIM_SPIN_MAX )
+    {
+        printf( "Sim: CPU waits on %s that no longer changes at %.3f ms\n", what, Sim_Now_Ns / 1e6 );
+        exit( 1 );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Write
+* Description    : Write to DATAR
+* Input          : data
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Write( uint16_t data )
+{
+    if( ( Sim_SPI_Sr & SPI_I2S_FLAG_TXE ) == 0 )
+    {
+        Sim_Bus_Error( "SPI1 DATAR written while TXE=0" );
+    }
+    Sim_SPI_Tx = data;
+    Sim_SPI_Sr &= ~SPI_I2S_FLAG_TXE;
+    if( ( Sim_SPI_Shift == 0 ) && ( Sim_SPI_Cr1 & SIM_SPI_CR1_SPE ) )
+    {
+        Sim_SPI_Start( Sim_Now_Ns * 1000 );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Read
+* Description    : Read of DATAR
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Read( void )
+{
+    Sim_SPI_Sr &= ~SPI_I2S_FLAG_RXNE;
+    Sim_SPI_Dr_Read = 1;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Config
+* Description    : Write to CTLR1, the frame format and prescaler may only
+*                  change while SPE=0
+* Input          : cr1
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_SPI_Config( uint16_t cr1 )
+{
+    if( ( Sim_SPI_Cr1 & cr1 & SIM_SPI_CR1_SPE ) && ( ( Sim_SPI_Cr1 ^ cr1 ) & ( SIM_SPI_CR1_DFF | SIM_SPI_CR1_BR ) ) )
+    {
+        Sim_Bus_Error( "SPI1 frame format or prescaler changed while enabled" );
+    }
+    if( ( Sim_SPI_Cr1 & SIM_SPI_CR1_SPE ) && ( ( cr1 & SIM_SPI_CR1_SPE ) == 0 ) && Sim_SPI_Shift )
+    {
+        Sim_Bus_Error( "SPI1 disabled while busy" );
+    }
+    Sim_SPI_Cr1 = cr1;
+    Sim_SPI1.Reg[ SIM_SPI_CTLR1 ] = cr1;
+    Sim_SPI_Last_Sr = -1;
+    if( ( cr1 & SIM_SPI_CR1_SPE ) && ( Sim_SPI_Shift == 0 ) && ( ( Sim_SPI_Sr & SPI_I2S_FLAG_TXE ) == 0 ) )
+    {
+        Sim_SPI_Start( Sim_Now_Ns * 1000 );
+    }
+    Sim_DMA_Service( Sim_Now_Ns * 1000 );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Cs_Update
+* Description    : Follow PA2, select or deselect the chip on an edge
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Cs_Update( void )
+{
+    uint8_t high;
+
+    high = ( ( Sim_GPIOA_Out & GPIO_Pin_2 ) == 0 ) || ( Sim_GPIOA_Odr & GPIO_Pin_2 );
+    if( high == Sim_Cs_High )
+    {
+        return;
+    }
+    Sim_Cs_High = high;
+    Sim_SPI_Last_Sr = -1;
+    if( Sim_SPI_Shift )
+    {
+        Sim_SPI_Shift_Cut = 1;
+    }
+    if( high )
+    {
+        Sim_Flash_Deselect( Sim_SPI_Shift );
+    }
+    else
+    {
+        Sim_Flash_Select( );
+        Sim_Now_Ns += Sim_Timing.Cs_Gap_Ns;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Resolve
+* Description    : Act on the register access of the last hook, its value
+*                  is in memory now
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Resolve( void )
+{
+    uint32_t v;
+    uint8_t  pending;
+
+    pending = Sim_Pending;
+    Sim_Pending = SIM_PEND_NONE;
+    switch( pending )
+    {
+        case SIM_PEND_SPI | SIM_SPI_DATAR:
+            v = Sim_SPI1.Reg[ SIM_SPI_DATAR ];
+            if( v & SIM_SPI_DR_TAG )
+            {
+                Sim_SPI_Read( );
+            }
+            else
+            {
+                Sim_SPI_Write( (uint16_t)v );
+            }
+            break;
+
+        case SIM_PEND_SPI | SIM_SPI_CTLR1:
+            v = Sim_SPI1.Reg[ SIM_SPI_CTLR1 ];
+            if( v != Sim_SPI_Cr1 )
+            {
+                Sim_SPI_Config( (uint16_t)v );
+            }
+            break;
+
+        case SIM_PEND_GPIO | SIM_GPIO_BSHR:
+            v = Sim_GPIOA.Reg[ SIM_GPIO_BSHR ];
+            Sim_GPIOA_Odr = ( Sim_GPIOA_Odr & ~( v >> 16 ) ) | (uint16_t)v;
+            Sim_Cs_Update( );
+            break;
+
+        case SIM_PEND_GPIO | SIM_GPIO_BCR:
+            Sim_GPIOA_Odr &= ~(uint16_t)Sim_GPIOA.Reg[ SIM_GPIO_BCR ];
+            Sim_Cs_Update( );
+            break;
+
+        default:
+            break;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_IRQ_Dispatch
+* Description    : Call the DMA1 channel 2/3 handlers while their interrupt
+*                  is pending, enabled in the PFIC and globally
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_IRQ_Dispatch( void )
+{
+    void     ( *handler )( void );
+    uint32_t flags;
+
+    while( ( Sim_In_Isr == 0 ) && ( Sim_Gintenr & 0x08 ) )
+    {
+        if( ( Sim_Nvic_En[ DMA1_Channel2_IRQn / 32 ] & ( 1u << ( DMA1_Channel2_IRQn % 32 ) ) )
+         && ( Sim_DMA1_Channel2.CFGR & SIM_DMA_CFGR_TCIE ) && ( Sim_DMA_Intfr & DMA1_FLAG_TC2 ) )
+        {
+            handler = DMA1_Channel2_IRQHandler;
+        }
+        else if( ( Sim_Nvic_En[ DMA1_Channel3_IRQn / 32 ] & ( 1u << ( DMA1_Channel3_IRQn % 32 ) ) )
+              && ( Sim_DMA1_Channel3.CFGR & SIM_DMA_CFGR_TCIE ) && ( Sim_DMA_Intfr & DMA1_FLAG_TC3 ) )
+        {
+            handler = DMA1_Channel3_IRQHandler;
+        }
+        else
+        {
+            break;
+        }
+        flags = Sim_DMA_Intfr;
+        Sim_In_Isr = 1;
+        handler( );
+        Sim_Resolve( );
+        Sim_SPI_Run( );
+        Sim_In_Isr = 0;
+        if( ( Sim_DMA_Intfr == flags ) && ( ( Sim_DMA1_Channel2.CFGR | Sim_DMA1_Channel3.CFGR ) & SIM_DMA_CFGR_TCIE ) )
+        {
+            printf( "Sim: DMA1 interrupt returned without clearing its flag at %.3f ms\n", Sim_Now_Ns / 1e6 );
+            exit( 1 );
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Sync
+* Description    : Bring the peripherals up to Sim_Now_Ns before the CPU
+*                  touches them
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void Sim_Sync( void )
+{
+    Sim_Resolve( );
+    Sim_SPI_Run( );
+    Sim_IRQ_Dispatch( );
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Status
+* Description    : STATR as the CPU reads it. A DATAR read before clears OVR
+*                  after this read.
+* Input          : None
+* Output         : None
+* Return         : STATR
+*******************************************************************************/
+static uint16_t Sim_SPI_Status( void )
+{
+    uint16_t sr;
+
+    sr = Sim_SPI_Sr | ( Sim_SPI_Shift ? SPI_I2S_FLAG_BSY : 0 );
+    if( (int32_t)sr == Sim_SPI_Last_Sr )
+    {
+        Sim_SPI_Wait( "SPI1 STATR" );
+        Sim_IRQ_Dispatch( );
+        sr = Sim_SPI_Sr | ( Sim_SPI_Shift ? SPI_I2S_FLAG_BSY : 0 );
+    }
+    else
+    {
+        Sim_SPI_Spins = 0;
+    }
+    Sim_SPI_Last_Sr = sr;
+    if( Sim_SPI_Dr_Read )
+    {
+        Sim_SPI_Dr_Read = 0;
+        Sim_SPI_Sr &= ~SPI_I2S_FLAG_OVR;
+    }
+    return sr;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_SPI_Reg
+* Description    : Hook of the SPI1 register members, preloads the register
+*                  the CPU is about to access
+* Input          : reg - SIM_SPI_xx
+* Output         : None
+* Return         : reg
+*******************************************************************************/
+uint32_t Sim_SPI_Reg( uint32_t reg )
+{
+    Sim_Sync( );
+    switch( reg )
+    {
+        case SIM_SPI_STATR:
+            Sim_SPI1.Reg[ reg ] = Sim_SPI_Status( );
+            break;
+
+        case SIM_SPI_DATAR:
+            Sim_SPI1.Reg[ reg ] = Sim_SPI_Rx | SIM_SPI_DR_TAG;
+            Sim_Pending = SIM_PEND_SPI | SIM_SPI_DATAR;
+            Sim_SPI_Last_Sr = -1;
+            break;
+
+        case SIM_SPI_CTLR1:
+            Sim_SPI1.Reg[ reg ] = Sim_SPI_Cr1;
+            Sim_Pending = SIM_PEND_SPI | SIM_SPI_CTLR1;
+            break;
+
+        default:
+            break;
+    }
+    return reg;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_GPIO_Reg
+* Description    : Hook of the GPIOA BSHR/BCR members, both write only
+* Input          : reg - SIM_GPIO_xx
+* Output         : None
+* Return         : reg
+*******************************************************************************/
+uint32_t Sim_GPIO_Reg( uint32_t reg )
+{
+    Sim_Sync( );
+    Sim_GPIOA.Reg[ reg ] = 0;
+    Sim_Pending = SIM_PEND_GPIO | reg;
+    return reg;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Mcycle
+* Description    : mcycle of the core, each read takes one cycle so loops
+*                  that wait on it end
+* Input          : None
+* Output         : None
+* Return         : cycles since Sim_Open
+*******************************************************************************/
+uint64_t Sim_Mcycle( void )
+{
+    Sim_Sync( );
+    Sim_Now_Ns += ( 1000000000 + SystemCoreClock - 1 ) / SystemCoreClock;
+    return Sim_Now_Ns * ( SystemCoreClock / 1000000 ) / 1000;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Gintenr_Clear
+* Description    : csrrc on gintenr
+* Input          : mask
+* Output         : None
+* Return         : previous gintenr
+*******************************************************************************/
+uint32_t Sim_Gintenr_Clear( uint32_t mask )
+{
+    uint32_t state;
+
+    Sim_Sync( );
+    state = Sim_Gintenr;
+    Sim_Gintenr &= ~mask;
+    return state;
+}
+
+/*******************************************************************************
+* Function Name  : Sim_Gintenr_Set
+* Description    : csrs on gintenr, a pending interrupt is taken at once
+* Input          : mask
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void Sim_Gintenr_Set( uint32_t mask )
+{
+    Sim_Gintenr |= mask;
+    Sim_Sync( );
+}
+
+/*******************************************************************************
+* Function Name  : NVIC_EnableIRQ / NVIC_DisableIRQ / NVIC_GetStatusIRQ
+* Description    : PFIC interrupt enables
+*******************************************************************************/
+void NVIC_EnableIRQ( IRQn_Type IRQn )
+{
+    Sim_Nvic_En[ IRQn / 32 ] |= 1u << ( IRQn % 32 );
+    Sim_Sync( );
+}
+
+void NVIC_DisableIRQ( IRQn_Type IRQn )
+{
+    Sim_Sync( );
+    Sim_Nvic_En[ IRQn / 32 ] &= ~( 1u << ( IRQn % 32 ) );
+}
+
+uint32_t NVIC_GetStatusIRQ( IRQn_Type IRQn )
+{
+    return ( Sim_Nvic_En[ IRQn / 32 ] >> ( IRQn % 32 ) ) & 1;
+}
+
+/*******************************************************************************
+* Function Name  : GPIO_Init / GPIO_SetBits
+* Description    : GPIOA pin setup, only the output pins matter
+*******************************************************************************/
+void GPIO_Init( GPIO_TypeDef *GPIOx, GPIO_InitTypeDef *GPIO_InitStruct )
+{
+    (void)GPIOx;
+    Sim_Sync( );
+    if( GPIO_InitStruct->GPIO_Mode & 0x10 )
+    {
+        Sim_GPIOA_Out |= GPIO_InitStruct->GPIO_Pin;
+    }
+    else
+    {
+        Sim_GPIOA_Out &= ~GPIO_InitStruct->GPIO_Pin;
+    }
+    Sim_Cs_Update( );
+}
+
+void GPIO_SetBits( GPIO_TypeDef *GPIOx, uint16_t GPIO_Pin )
+{
+    (void)GPIOx;
+    Sim_Sync( );
+    Sim_GPIOA_Odr |= GPIO_Pin;
+    Sim_Cs_Update( );
+}
+
+/*******************************************************************************
+* Function Name  : SPI_Init / SPI_Cmd / SPI_I2S_xx
+* Description    : SPI1 library functions
+*******************************************************************************/
+void SPI_Init( SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    Sim_SPI_Config( ( Sim_SPI_Cr1 & SIM_SPI_CR1_SPE ) | SPI_InitStruct->SPI_Direction | SPI_InitStruct->SPI_Mode
+                    | SPI_InitStruct->SPI_DataSize | SPI_InitStruct->SPI_CPOL | SPI_InitStruct->SPI_CPHA
+                    | SPI_InitStruct->SPI_NSS | SPI_InitStruct->SPI_BaudRatePrescaler | SPI_InitStruct->SPI_FirstBit );
+}
+
+void SPI_Cmd( SPI_TypeDef *SPIx, FunctionalState NewState )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    Sim_SPI_Config( NewState ? ( Sim_SPI_Cr1 | SIM_SPI_CR1_SPE ) : ( Sim_SPI_Cr1 & ~SIM_SPI_CR1_SPE ) );
+}
+
+void SPI_I2S_DMACmd( SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq, FunctionalState NewState )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    if( NewState )
+    {
+        Sim_SPI_Dma |= SPI_I2S_DMAReq;
+    }
+    else
+    {
+        Sim_SPI_Dma &= ~SPI_I2S_DMAReq;
+    }
+    Sim_SPI_Last_Sr = -1;
+    Sim_DMA_Service( Sim_Now_Ns * 1000 );
+}
+
+void SPI_I2S_SendData( SPI_TypeDef *SPIx, uint16_t Data )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    Sim_SPI_Last_Sr = -1;
+    Sim_SPI_Write( Data );
+}
+
+uint16_t SPI_I2S_ReceiveData( SPI_TypeDef *SPIx )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    Sim_SPI_Last_Sr = -1;
+    Sim_SPI_Read( );
+    return Sim_SPI_Rx;
+}
+
+FlagStatus SPI_I2S_GetFlagStatus( SPI_TypeDef *SPIx, uint16_t SPI_I2S_FLAG )
+{
+    (void)SPIx;
+    Sim_Sync( );
+    return ( Sim_SPI_Status( ) & SPI_I2S_FLAG ) ? SET : RESET;
+}
+
+/*******************************************************************************
+* Function Name  : DMA_xx
+* Description    : DMA1 channel 2/3 library functions
+*******************************************************************************/
+void DMA_DeInit( DMA_Channel_TypeDef *DMAy_Channelx )
+{
+    Sim_Sync( );
+    DMAy_Channelx->CFGR = 0;
+    DMAy_Channelx->CNTR = 0;
+    DMAy_Channelx->PADDR = 0;
+    DMAy_Channelx->MADDR = 0;
+    Sim_DMA_Intfr &= ( DMAy_Channelx == DMA1_Channel2 ) ? ~0x000000F0u : ~0x00000F00u;
+}
+
+void DMA_Init( DMA_Channel_TypeDef *DMAy_Channelx, DMA_InitTypeDef *DMA_InitStruct )
+{
+    Sim_Sync( );
+    DMAy_Channelx->CFGR = ( DMAy_Channelx->CFGR & SIM_DMA_CFGR_KEEP ) | DMA_InitStruct->DMA_DIR
+                          | DMA_InitStruct->DMA_PeripheralInc | DMA_InitStruct->DMA_MemoryInc
+                          | DMA_InitStruct->DMA_PeripheralDataSize | DMA_InitStruct->DMA_MemoryDataSize
+                          | DMA_InitStruct->DMA_Mode | DMA_InitStruct->DMA_Priority | DMA_InitStruct->DMA_M2M;
+    DMAy_Channelx->CNTR = (uint16_t)DMA_InitStruct->DMA_BufferSize;                 /* CNTR is 16 bits */
+    DMAy_Channelx->PADDR = DMA_InitStruct->DMA_PeripheralBaseAddr;
+    DMAy_Channelx->MADDR = DMA_InitStruct->DMA_MemoryBaseAddr;
+}
+
+void DMA_Cmd( DMA_Channel_TypeDef *DMAy_Channelx, FunctionalState NewState )
+{
+    Sim_Sync( );
+    if( NewState )
+    {
+        DMAy_Channelx->CFGR |= SIM_DMA_CFGR_EN;
+    }
+    else
+    {
+        DMAy_Channelx->CFGR &= ~SIM_DMA_CFGR_EN;
+    }
+    Sim_SPI_Last_Sr = -1;
+    Sim_DMA_Service( Sim_Now_Ns * 1000 );
+}
+
+void DMA_ITConfig( DMA_Channel_TypeDef *DMAy_Channelx, uint32_t DMA_IT, FunctionalState NewState )
+{
+    Sim_Sync( );
+    if( NewState )
+    {
+        DMAy_Channelx->CFGR |= DMA_IT;
+    }
+    else
+    {
+        DMAy_Channelx->CFGR &= ~DMA_IT;
+    }
+    Sim_IRQ_Dispatch( );
+}
+
+FlagStatus DMA_GetFlagStatus( uint32_t DMAy_FLAG )
+{
+    Sim_Sync( );
+    if( Sim_DMA_Intfr & DMAy_FLAG )
+    {
+        Sim_SPI_Spins = 0;
+        return SET;
+    }
+
+    /* Polling a transfer that is still running */
+    Sim_SPI_Wait( "a DMA1 flag" );
+    return RESET;
+}
+
+void DMA_ClearFlag( uint32_t DMAy_FLAG )
+{
+    Sim_Sync( );
+    if( DMAy_FLAG & DMA1_FLAG_GL2 )
+    {
+        DMAy_FLAG |= 0x000000F0;
+    }
+    if( DMAy_FLAG & DMA1_FLAG_GL3 )
+    {
+        DMAy_FLAG |= 0x00000F00;
+    }
+    Sim_DMA_Intfr &= ~DMAy_FLAG;
+}
+
+ITStatus DMA_GetITStatus( uint32_t DMAy_IT )
+{
+    Sim_Sync( );
+    return ( Sim_DMA_Intfr & DMAy_IT ) ? SET : RESET;
+}
+
+void DMA_ClearITPendingBit( uint32_t DMAy_IT )
+{
+    DMA_ClearFlag( DMAy_IT );
+}
+
+/*******************************************************************************
+* Function Name  : CRC_xx
+* Description    : CRC unit, CRC-32 poly 0x04C11DB7 over 32-bit words, MSB
+*                  first, no final XOR
+*******************************************************************************/
+void CRC_ResetDR( void )
+{
+    Sim_CRC = 0xFFFFFFFF;
+}
+
+uint32_t CRC_CalcCRC( uint32_t Data )
+{
+    uint8_t n;
+
+    Sim_CRC ^= Data;
+    for( n = 0; n < 32; n++ )
+    {
+        Sim_CRC = ( Sim_CRC & 0x80000000 ) ? ( ( Sim_CRC << 1 ) ^ 0x04C11DB7 ) : ( Sim_CRC << 1 );
+    }
+    return Sim_CRC;
+}
+
+uint32_t CRC_GetCRC( void )
+{
+    return Sim_CRC;
+}
+
+/*******************************************************************************
+* Function Name  : RCC_xx
+* Description    : Clocks, SYSCLK = HCLK = PCLK2 = Sim_Timing.Pclk2_Hz
+*******************************************************************************/
+void RCC_GetClocksFreq( RCC_ClocksTypeDef *RCC_Clocks )
+{
+    RCC_Clocks->SYSCLK_Frequency = Sim_Timing.Pclk2_Hz;
+    RCC_Clocks->HCLK_Frequency = Sim_Timing.Pclk2_Hz;
+    RCC_Clocks->PCLK1_Frequency = Sim_Timing.Pclk2_Hz / 2;
+    RCC_Clocks->PCLK2_Frequency = Sim_Timing.Pclk2_Hz;
+    RCC_Clocks->ADCCLK_Frequency = Sim_Timing.Pclk2_Hz / 8;
+}
+
+void RCC_AHBPeriphClockCmd( uint32_t RCC_AHBPeriph, FunctionalState NewState )
+{
+    (void)RCC_AHBPeriph;
+    (void)NewState;
+}
+
+void RCC_APB2PeriphClockCmd( uint32_t RCC_APB2Periph, FunctionalState NewState )
+{
+    (void)RCC_APB2Periph;
+    (void)NewState;
+}
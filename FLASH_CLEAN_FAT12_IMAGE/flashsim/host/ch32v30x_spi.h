@@ -0,0 +1,67 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : ch32v30x_spi.h
+* Description        : Host stand-in, SPI1 is modelled by ch32v30x_sim.c
+*******************************************************************************/
+
+#ifndef __CH32V30x_SPI_H
+#define __CH32V30x_SPI_H
+
+#ifdef __cplusplus
+ extern "C" {
+#endif
+
+#include "ch32v30x.h"
+
+/* SPI Init structure definition, same layout as the peripheral library */
+typedef struct
+{
+  uint16_t SPI_Direction;
+  uint16_t SPI_Mode;
+  uint16_t SPI_DataSize;
+  uint16_t SPI_CPOL;
+  uint16_t SPI_CPHA;
+  uint16_t SPI_NSS;
+  uint16_t SPI_BaudRatePrescaler;
+  uint16_t SPI_FirstBit;
+  uint16_t SPI_CRCPolynomial;
+}SPI_InitTypeDef;
+
+#define SPI_Direction_2Lines_FullDuplex ((uint16_t)0x0000)
+#define SPI_Mode_Master                 ((uint16_t)0x0104)
+#define SPI_DataSize_16b                ((uint16_t)0x0800)
+#define SPI_DataSize_8b                 ((uint16_t)0x0000)
+#define SPI_CPOL_High                   ((uint16_t)0x0002)
+#define SPI_CPHA_2Edge                  ((uint16_t)0x0001)
+#define SPI_NSS_Soft                    ((uint16_t)0x0200)
+#define SPI_FirstBit_MSB                ((uint16_t)0x0000)
+
+/* SPI_BaudRate_Prescaler */
+#define SPI_BaudRatePrescaler_2    ((uint16_t)0x0000)
+#define SPI_BaudRatePrescaler_4    ((uint16_t)0x0008)
+#define SPI_BaudRatePrescaler_8    ((uint16_t)0x0010)
+#define SPI_BaudRatePrescaler_16   ((uint16_t)0x0018)
+#define SPI_BaudRatePrescaler_32   ((uint16_t)0x0020)
+#define SPI_BaudRatePrescaler_64   ((uint16_t)0x0028)
+#define SPI_BaudRatePrescaler_128  ((uint16_t)0x0030)
+#define SPI_BaudRatePrescaler_256  ((uint16_t)0x0038)
+
+#define SPI_I2S_DMAReq_Tx               ((uint16_t)0x0002)
+#define SPI_I2S_DMAReq_Rx               ((uint16_t)0x0001)
+
+#define SPI_I2S_FLAG_RXNE               ((uint16_t)0x0001)
+#define SPI_I2S_FLAG_TXE                ((uint16_t)0x0002)
+#define SPI_I2S_FLAG_OVR                ((uint16_t)0x0040)
+#define SPI_I2S_FLAG_BSY                ((uint16_t)0x0080)
+
+extern void SPI_Init( SPI_TypeDef *SPIx, SPI_InitTypeDef *SPI_InitStruct );
+extern void SPI_Cmd( SPI_TypeDef *SPIx, FunctionalState NewState );
+extern void SPI_I2S_DMACmd( SPI_TypeDef *SPIx, uint16_t SPI_I2S_DMAReq, FunctionalState NewState );
+extern void SPI_I2S_SendData( SPI_TypeDef *SPIx, uint16_t Data );
+extern uint16_t SPI_I2S_ReceiveData( SPI_TypeDef *SPIx );
+extern FlagStatus SPI_I2S_GetFlagStatus( SPI_TypeDef *SPIx, uint16_t SPI_I2S_FLAG );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,39 @@
+/********************************** (C) COPYRIGHT *******************************
+* File Name          : ch32v30x_usbfs_device.h
+* Description        : Host stand-in for the USBFS device header, only the
+*                      parts SW_UDISK.c uses. flashsim.c plays the USB host.
+*******************************************************************************/
+
+#ifndef __CH32V30X_USBFS_DEVICE_H_
+#define __CH32V30X_USBFS_DEVICE_H_
+
+#include <stdint.h>
+#include <string.h>
+
+/******************************************************************************/
+/* Endpoint Number */
+#define DEF_UEP2                      0x02
+#define DEF_UEP3                      0x03
+#define DEF_UEP_CPY_LOAD              1 /* Use memcpy to move data to a buffer */
+
+/* Endpoint handshake, as ch32v30x_usb.h */
+#define USBFS_UEP_T_RES_MASK          0x03
+#define USBFS_UEP_T_RES_STALL         0x03
+#define USBFS_UEP_R_RES_MASK          0x03
+#define USBFS_UEP_R_RES_ACK           0x00
+#define USBFS_UEP_R_RES_STALL         0x03
+
+typedef struct
+{
+    volatile uint8_t UEP2_TX_CTRL;
+    volatile uint8_t UEP3_RX_CTRL;
+}SIM_USBFSD_TypeDef;
+
+extern SIM_USBFSD_TypeDef Sim_USBFSD;
+#define USBFSD                        ( &Sim_USBFSD )
+
+/******************************************************************************/
+/* external functions */
+extern uint8_t USBFS_Endp_DataUp(uint8_t endp, uint8_t *pbuf, uint16_t len, uint8_t mod);
+
+#endif
@@ -23,6 +23,295 @@ volatile uint8_t   Flash_Type = 0x00;
 volatile uint32_t  Flash_ID = 0x00;                                             /* FLASH ID */
 volatile uint32_t  Flash_Sector_Count = 0x00;                                   /* FLASH sector number */
 volatile uint16_t  Flash_Sector_Size = 0x00;                                    /* FLASH sector size */
+volatile uint8_t   Flash_DMA_Status = DEF_FLASH_DMA_IDLE;                       /* Current DMA transfer status */
+volatile uint8_t   Flash_Read_Mode = DEF_FLASH_READ_NORMAL;                     /* Current read mode */
+volatile uint16_t  Flash_SPI_Cal_Prescaler = SPI_BaudRatePrescaler_2;           /* Fastest prescaler passed by FLASH_SPI_Calibrate */
+volatile uint32_t  Flash_Verify_Errors = 0;                                     /* Writes that read back wrong */
+#if DEF_FLASH_STATS_EN
+FLASH_STATS        Flash_Stats;                                                 /* Operation statistics */
+#endif
+
+/* Flash geometry, defaults match a W25XXX part without SFDP */
+FLASH_GEOMETRY Flash_Geometry =
+{
+    0,                                                                          /* SFDP_Valid */
+    DEF_FLASH_ADDR_3B,                                                          /* Addr_Mode */
+    SPI_FLASH_PageSize,                                                         /* Page_Size */
+    0,                                                                          /* Capacity */
+    { CMD_FLASH_SECTOR_ERASE, CMD_FLASH_BLOCK_ERASE_64K, 0x00, 0x00 },          /* Erase_Cmd */
+    { 4096, 65536, 0, 0 },                                                      /* Erase_Size */
+    CMD_FLASH_SECTOR_ERASE,                                                     /* Erase_4K_Cmd */
+    CMD_FLASH_READ,                                                             /* Read_Cmd */
+    0,                                                                          /* Read_Dummy */
+    0x00,                                                                       /* Read_112_Cmd */
+    0,                                                                          /* Read_112_Dummy */
+    0x00,                                                                       /* Read_114_Cmd */
+    0,                                                                          /* Read_114_Dummy */
+    0x00,                                                                       /* Suspend_Cmd */
+    0x00,                                                                       /* Resume_Cmd */
+    3,                                                                          /* Addr_Bytes */
+    0,                                                                          /* Addr_4B_Cmd */
+};
+
+static void ( *Flash_DMA_Callback )( uint8_t status ) = NULL;                   /* DMA completion callback */
+static volatile uint8_t Flash_Bus_Lock = 0;                                     /* A block read holds CS# low */
+static volatile uint8_t Flash_Stream_Open = 0;                                  /* FLASH_Stream_Read left its command open */
+static volatile uint8_t Flash_Power_State = DEF_FLASH_PWR_ACTIVE;               /* Deep power-down state */
+static volatile uint64_t Flash_Wake_Start = 0;                                  /* Cycle the release command was sent */
+static volatile uint64_t Flash_Last_Access = 0;                                 /* Cycle of the last chip access */
+static uint32_t Flash_Stream_Addr = 0;                                          /* Next address of the open stream */
+#if DEF_FLASH_LINE_EN
+static uint32_t Flash_Line_Tag[ DEF_FLASH_LINE_NUM ];                           /* Line address | 1, 0: empty */
+static uint8_t Flash_Line_Data[ DEF_FLASH_LINE_NUM ][ DEF_FLASH_LINE_SIZE ];    /* Cached lines */
+#endif
+#if DEF_FLASH_CACHE_EN
+#if ( DEF_FLASH_CACHE_SETS * DEF_FLASH_CACHE_WAYS * ( SPI_FLASH_SectorSize / 1024 ) ) > DEF_FLASH_CACHE_MAX_KB
+#error "Flash sector cache does not fit the RAM in Ld/Link.ld"
+#endif
+static uint32_t Flash_Cache_Tag[ DEF_FLASH_CACHE_SETS ][ DEF_FLASH_CACHE_WAYS ];  /* Sector address | 1, 0: empty */
+static uint32_t Flash_Cache_Used[ DEF_FLASH_CACHE_SETS ][ DEF_FLASH_CACHE_WAYS ]; /* Flash_Cache_Clock at last use */
+static uint32_t Flash_Cache_Clock = 0;
+__attribute__ ((aligned(4))) static uint8_t Flash_Cache_Data[ DEF_FLASH_CACHE_SETS ][ DEF_FLASH_CACHE_WAYS ][ SPI_FLASH_SectorSize ];
+#endif
+static volatile uint8_t Flash_Job_Running = 0;                                  /* A job step is in the chip */
+static volatile uint8_t Flash_Job_Step_Cmd = 0;                                 /* Opcode of the running step */
+static volatile uint8_t Flash_Job_Suspended = 0;                                /* Running erase is suspended */
+static uint64_t Flash_Job_Resume_At = 0;                                        /* Cycle of the last resume */
+static uint32_t Flash_Erase_Addr = 0;                                           /* Range of the last sector/block erase */
+static uint32_t Flash_Erase_Len = 0;
+static uint32_t Flash_Read_Addr = 0;                                            /* Next address of the open read command */
+static FLASH_JOB Flash_Job_Queue[ DEF_FLASH_JOB_QUEUE_SIZE ];
+static volatile uint8_t Flash_Job_Head = 0;
+static volatile uint8_t Flash_Job_Tail = 0;
+static uint8_t Flash_Job_Cmp_Buf[ DEF_FLASH_UPD_CMP_LEN ];                      /* Read back buffer for update jobs */
+static const uint8_t Flash_DMA_Dummy = DEF_DUMMY_BYTE;                          /* TX source while reading */
+#if DEF_FLASH_STATS_EN
+static volatile uint8_t Flash_Stats_Op = 0xFF;                                  /* Program/erase in the chip, 0xFF: none */
+static uint64_t Flash_Stats_Op_Start = 0;                                       /* Cycle it was issued */
+static uint64_t Flash_Stats_Op_Paused = 0;                                      /* Cycles it spent suspended */
+static uint64_t Flash_Stats_Susp_Start = 0;                                     /* Cycle it was suspended */
+static volatile uint8_t Flash_Stats_Rd_Open = 0;                                /* A read is being timed */
+static uint64_t Flash_Stats_Rd_Start = 0;                                       /* Cycle the read was requested */
+#endif
+
+void DMA1_Channel2_IRQHandler( void ) __attribute__((interrupt("WCH-Interrupt-fast")));
+void DMA1_Channel3_IRQHandler( void ) __attribute__((interrupt("WCH-Interrupt-fast")));
+static uint32_t FLASH_Bus_Enter( void );
+static void FLASH_Bus_Exit( uint32_t irq );
+static void FLASH_Wait_Ready( void );
+
+/*******************************************************************************
+* Function Name  : FLASH_Cycles
+* Description    : Core cycle counter used to time flash operations. All
+*                  64 bits, the low word alone wraps after 44.7 s at 96 MHz.
+* Input          : None
+* Output         : None
+* Return         : mcycleh:mcycle
+*******************************************************************************/
+static inline uint64_t FLASH_Cycles( void )
+{
+#if defined( __riscv )
+    uint32_t hi, lo, hi2;
+
+    /* Read again if the low word carried into the high word in between */
+    do
+    {
+        __asm volatile( "csrr %0, mcycleh" : "=r"( hi ) );
+        __asm volatile( "csrr %0, mcycle" : "=r"( lo ) );
+        __asm volatile( "csrr %0, mcycleh" : "=r"( hi2 ) );
+    } while( hi != hi2 );
+    return ( (uint64_t)hi << 32 ) | lo;
+#else
+    return Sim_Mcycle( );                                                       /* flashsim host build */
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Stats_Latency
+* Description    : Add one operation time to the histogram of its type
+* Input          : op - DEF_FLASH_OP_xx
+*                  cycles - issue to ready
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Stats_Latency( uint8_t op, uint64_t cycles )
+{
+#if DEF_FLASH_STATS_EN
+    uint64_t us;
+    uint8_t  n;
+
+    us = cycles / ( SystemCoreClock / 1000000 );
+    for( n = 0; us && ( n < DEF_FLASH_STATS_BUCKETS - 1 ); n++ )
+    {
+        us >>= 1;
+    }
+    Flash_Stats.Latency_Hist[ op ][ n ]++;
+#else
+    (void)op;
+    (void)cycles;
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Size
+* Description    : Bytes cleared by an erase opcode
+* Input          : cmd - erase opcode
+* Output         : None
+* Return         : erase size, the capacity for chip erase
+*******************************************************************************/
+static uint32_t FLASH_Erase_Size( uint8_t cmd )
+{
+    uint32_t size;
+    uint8_t  i;
+
+    if( cmd == CMD_FLASH_CHIP_ERASE )
+    {
+        return Flash_Geometry.Capacity;
+    }
+    if( cmd == CMD_FLASH_BLOCK_ERASE_32K )
+    {
+        return 32768;
+    }
+    if( cmd == CMD_FLASH_BLOCK_ERASE_64K )
+    {
+        return 65536;
+    }
+    size = SPI_FLASH_SectorSize;
+    for( i = 0; i < 4; i++ )
+    {
+        if( ( cmd != Flash_Geometry.Erase_4K_Cmd ) && ( Flash_Geometry.Erase_Cmd[ i ] == cmd ) )
+        {
+            size = Flash_Geometry.Erase_Size[ i ];
+        }
+    }
+    return size;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Cache_Invalidate
+* Description    : Drop the cached lines and sectors a program or erase
+*                  changes. The caches are write-through: data goes to the
+*                  chip and the next read fetches it again.
+* Input          : address
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Cache_Invalidate( uint32_t address, uint32_t len )
+{
+#if DEF_FLASH_LINE_EN || DEF_FLASH_CACHE_EN
+    uint32_t base;
+    uint8_t  n;
+#endif
+#if DEF_FLASH_CACHE_EN
+    uint8_t  w;
+#endif
+
+#if DEF_FLASH_LINE_EN
+    for( n = 0; n < DEF_FLASH_LINE_NUM; n++ )
+    {
+        base = Flash_Line_Tag[ n ] & ~1;
+        if( Flash_Line_Tag[ n ] && ( address < base + DEF_FLASH_LINE_SIZE ) && ( base < address + len ) )
+        {
+            Flash_Line_Tag[ n ] = 0;
+        }
+    }
+#endif
+#if DEF_FLASH_CACHE_EN
+    for( n = 0; n < DEF_FLASH_CACHE_SETS; n++ )
+    {
+        for( w = 0; w < DEF_FLASH_CACHE_WAYS; w++ )
+        {
+            base = Flash_Cache_Tag[ n ][ w ] & ~1;
+            if( Flash_Cache_Tag[ n ][ w ] && ( address < base + SPI_FLASH_SectorSize ) && ( base < address + len ) )
+            {
+                Flash_Cache_Tag[ n ][ w ] = 0;
+            }
+        }
+    }
+#endif
+#if ( DEF_FLASH_LINE_EN == 0 ) && ( DEF_FLASH_CACHE_EN == 0 )
+    (void)address;
+    (void)len;
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Stats_Issue
+* Description    : Note a program or erase command sent to the chip. Erases
+*                  also count against every 4 KByte sector they cover.
+* Input          : cmd - opcode, CMD_FLASH_BYTE_PROG or an erase
+*                  address
+*                  len - bytes programmed, ignored for erases
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Stats_Issue( uint8_t cmd, uint32_t address, uint32_t len )
+{
+#if DEF_FLASH_STATS_EN
+    uint32_t size, sector;
+    uint8_t  op;
+
+    if( cmd == CMD_FLASH_BYTE_PROG )
+    {
+        op = DEF_FLASH_OP_PROG;
+        Flash_Stats.Prog_Bytes += len;
+    }
+    else
+    {
+        if( cmd == CMD_FLASH_CHIP_ERASE )
+        {
+            address = 0;
+        }
+        size = FLASH_Erase_Size( cmd );
+        op = ( cmd == CMD_FLASH_CHIP_ERASE ) ? DEF_FLASH_OP_ERASE_CHIP :
+             ( size <= SPI_FLASH_SectorSize ) ? DEF_FLASH_OP_ERASE_4K :
+             ( size <= 32768 ) ? DEF_FLASH_OP_ERASE_32K : DEF_FLASH_OP_ERASE_64K;
+
+        address &= ~( SPI_FLASH_SectorSize - 1 );
+        for( sector = address / SPI_FLASH_SectorSize;
+             ( sector < ( address + size ) / SPI_FLASH_SectorSize ) && ( sector < DEF_FLASH_STATS_SECTORS ); sector++ )
+        {
+            if( Flash_Stats.Erase_Count[ sector ] != 0xFFFF )
+            {
+                Flash_Stats.Erase_Count[ sector ]++;
+            }
+        }
+    }
+    Flash_Stats.Op_Count[ op ]++;
+    Flash_Stats_Op = op;
+    Flash_Stats_Op_Start = FLASH_Cycles( );
+    Flash_Stats_Op_Paused = 0;
+#else
+    (void)cmd;
+    (void)address;
+    (void)len;
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Access
+* Description    : Make the chip ready for a command: end an open read
+*                  stream and bring the chip out of deep power-down,
+*                  waiting only for what is left of tRES1 after an early
+*                  FLASH_Wake
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Access( void )
+{
+    FLASH_Stream_Close( );
+#if DEF_FLASH_PD_EN
+    if( Flash_Power_State != DEF_FLASH_PWR_ACTIVE )
+    {
+        FLASH_Wake( );
+        while( FLASH_Cycles( ) - Flash_Wake_Start < DEF_FLASH_PD_WAKE_US * ( SystemCoreClock / 1000000 ) );
+        Flash_Power_State = DEF_FLASH_PWR_ACTIVE;
+    }
+    Flash_Last_Access = FLASH_Cycles( );
+#endif
+}
 
 /*******************************************************************************
 * Function Name  : FLASH_Port_Init
@@ -73,8 +362,20 @@ void FLASH_Port_Init( void )
     SPI_InitStructure.SPI_CRCPolynomial = 7;
 
     SPI_Init(SPI1, &SPI_InitStructure);
-    //SPI1->HSCR |= 0x01;                                                         // Enable High Speed Read
     SPI_Cmd(SPI1, ENABLE);
+
+#if DEF_FLASH_WRITE_VERIFY
+    RCC_AHBPeriphClockCmd( RCC_AHBPeriph_CRC, ENABLE );
+#endif
+
+#if DEF_FLASH_DMA_EN
+    /* SPI1 RX/TX DMA, reads complete on the RX channel, programs on the TX channel */
+    RCC_AHBPeriphClockCmd( RCC_AHBPeriph_DMA1, ENABLE );
+    DMA_DeInit( DEF_FLASH_DMA_RX_CH );
+    DMA_DeInit( DEF_FLASH_DMA_TX_CH );
+    NVIC_EnableIRQ( DMA1_Channel2_IRQn );
+    NVIC_EnableIRQ( DMA1_Channel3_IRQn );
+#endif
 }
 
 /*********************************************************************
@@ -110,6 +411,150 @@ uint8_t SPI1_ReadWriteByte(uint8_t TxData)
     return SPI_I2S_ReceiveData(SPI1);
 }
 
+/*******************************************************************************
+* Function Name  : SPI_Irq_Save
+* Description    : Mask global interrupts, return the previous state
+* Input          : None
+* Output         : None
+* Return         : previous gintenr
+*******************************************************************************/
+__attribute__( ( always_inline ) ) static inline uint32_t SPI_Irq_Save( void )
+{
+#if defined( __riscv )
+    uint32_t state;
+
+    __asm volatile ( "csrrc %0, 0x800, %1" : "=r" ( state ) : "r" ( 0x88 ) );
+    return state;
+#else
+    return Sim_Gintenr_Clear( 0x88 );
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : SPI_Irq_Restore
+* Description    : Restore the state saved by SPI_Irq_Save
+* Input          : state
+* Output         : None
+* Return         : None
+*******************************************************************************/
+__attribute__( ( always_inline ) ) static inline void SPI_Irq_Restore( uint32_t state )
+{
+#if defined( __riscv )
+    __asm volatile ( "csrs 0x800, %0" : : "r" ( state & 0x88 ) );
+#else
+    Sim_Gintenr_Set( state & 0x88 );
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : SPI_Set_Frame
+* Description    : Switch SPI1 between 8-bit and 16-bit frames, the frame
+*                  format may only change while the SPI is disabled
+* Input          : size - SPI_DataSize_8b / SPI_DataSize_16b
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void SPI_Set_Frame( uint16_t size )
+{
+    while( SPI1->STATR & SPI_I2S_FLAG_BSY );
+    SPI1->CTLR1 &= ~( (uint16_t)0x0040 );                                      /* SPE */
+    SPI1->CTLR1 = ( SPI1->CTLR1 & ~SPI_DataSize_16b ) | size;
+    SPI1->CTLR1 |= (uint16_t)0x0040;
+}
+
+/*******************************************************************************
+* Function Name  : spi_xfer
+* Description    : Full duplex burst on SPI1 without per-byte calls. The
+*                  next frame is written as soon as TXE is set so the shift
+*                  register runs back to back. Even lengths from
+*                  DEF_SPI_XFER_16B_MIN on are sent as 16-bit frames.
+*                  Receive transfers mask interrupts for one frame at a time
+*                  so a late read cannot overrun; transmit-only transfers
+*                  ignore the receive side and clear it at the end.
+* Input          : *tx - data to send, NULL sends DEF_DUMMY_BYTE
+*                  *rx - received data, NULL discards it
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void spi_xfer( const uint8_t *tx, uint8_t *rx, uint32_t len )
+{
+    uint32_t i, n, irq;
+    uint16_t word, step;
+
+    if( len == 0 )
+    {
+        return;
+    }
+
+    step = 1;
+    if( ( ( len & 1 ) == 0 ) && ( len >= DEF_SPI_XFER_16B_MIN ) )
+    {
+        step = 2;
+        SPI_Set_Frame( SPI_DataSize_16b );
+    }
+    n = len / step;
+
+    /* Drop data left by an earlier transmit-only transfer */
+    (void)SPI1->DATAR;
+
+    if( rx == NULL )
+    {
+        for( i = 0; i < n; i++ )
+        {
+            word = tx ? tx[ i * step ] : DEF_DUMMY_BYTE;
+            if( step == 2 )
+            {
+                word = ( word << 8 ) | ( tx ? tx[ i * 2 + 1 ] : DEF_DUMMY_BYTE );
+            }
+            while( ( SPI1->STATR & SPI_I2S_FLAG_TXE ) == 0 );
+            SPI1->DATAR = word;
+        }
+        while( ( SPI1->STATR & SPI_I2S_FLAG_TXE ) == 0 );
+        while( SPI1->STATR & SPI_I2S_FLAG_BSY );
+        (void)SPI1->DATAR;                                                     /* Clear RXNE and OVR */
+        (void)SPI1->STATR;
+    }
+    else
+    {
+        /* One frame in the shift register, the next one in the buffer */
+        for( i = 0; i <= n; i++ )
+        {
+            irq = SPI_Irq_Save( );
+            if( i < n )
+            {
+                word = tx ? tx[ i * step ] : DEF_DUMMY_BYTE;
+                if( step == 2 )
+                {
+                    word = ( word << 8 ) | ( tx ? tx[ i * 2 + 1 ] : DEF_DUMMY_BYTE );
+                }
+                while( ( SPI1->STATR & SPI_I2S_FLAG_TXE ) == 0 );
+                SPI1->DATAR = word;
+            }
+            if( i > 0 )
+            {
+                while( ( SPI1->STATR & SPI_I2S_FLAG_RXNE ) == 0 );
+                word = SPI1->DATAR;
+                if( step == 2 )
+                {
+                    rx[ ( i - 1 ) * 2 ] = (uint8_t)( word >> 8 );
+                    rx[ ( i - 1 ) * 2 + 1 ] = (uint8_t)word;
+                }
+                else
+                {
+                    rx[ i - 1 ] = (uint8_t)word;
+                }
+            }
+            SPI_Irq_Restore( irq );
+        }
+    }
+
+    if( step == 2 )
+    {
+        SPI_Set_Frame( SPI_DataSize_8b );
+    }
+}
+
 /*******************************************************************************
 * Function Name  : SPI_FLASH_SendByte
 * Description    : SPI send a byte
@@ -119,7 +564,8 @@ uint8_t SPI1_ReadWriteByte(uint8_t TxData)
 *******************************************************************************/
 uint8_t SPI_FLASH_SendByte( uint8_t byte )
 {
-    return SPI1_ReadWriteByte( byte );
+    spi_xfer( &byte, &byte, 1 );
+    return byte;
 }
 
 /*******************************************************************************
@@ -131,7 +577,10 @@ uint8_t SPI_FLASH_SendByte( uint8_t byte )
 *******************************************************************************/
 uint8_t SPI_FLASH_ReadByte( void )
 {
-    return SPI1_ReadWriteByte( 0xFF );
+    uint8_t byte;
+
+    spi_xfer( NULL, &byte, 1 );
+    return byte;
 }
 
 /*******************************************************************************
@@ -143,34 +592,39 @@ uint8_t SPI_FLASH_ReadByte( void )
 *******************************************************************************/
 uint32_t FLASH_ReadJEDECID( void )
 {
-    uint32_t dat;
+    uint8_t  buf[ 4 ] = { CMD_FLASH_JEDEC_ID, DEF_DUMMY_BYTE, DEF_DUMMY_BYTE, DEF_DUMMY_BYTE };
+
     PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_JEDEC_ID );
-    dat = ( uint32_t )SPI_FLASH_SendByte( DEF_DUMMY_BYTE ) << 16;
-    dat |= ( uint32_t )SPI_FLASH_SendByte( DEF_DUMMY_BYTE ) << 8;
-    dat |= SPI_FLASH_SendByte( DEF_DUMMY_BYTE );
+    spi_xfer( buf, buf, 4 );
     PIN_FLASH_CS_HIGH( );
-    return( dat );
+    return( ( (uint32_t)buf[ 1 ] << 16 ) | ( (uint32_t)buf[ 2 ] << 8 ) | buf[ 3 ] );
 }
 
 
 /*******************************************************************************
 * Function Name  : FLASH_ReadUNIQUEID
-* Description    : Read FLASH UNIQUE ID
+* Description    : Read FLASH UNIQUE ID (0x4B, 4 dummy bytes, 64-bit ID)
 * Input          : None
 * Output         : None
-* Return         : unique chip id
+* Return         : unique chip id, first byte sent in the top byte
 *******************************************************************************/
-uint32_t FLASH_ReadUNIQUEID( void )
+uint64_t FLASH_ReadUNIQUEID( void )
 {
-    uint32_t dat;
+    uint8_t  buf[ 13 ];
+    uint64_t id;
+    uint8_t  i;
+
+    memset( buf, DEF_DUMMY_BYTE, sizeof( buf ) );
+    buf[ 0 ] = CMD_FLASH_UNIQUE_ID;
     PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_JEDEC_ID );
-    dat = ( uint32_t )SPI_FLASH_SendByte( DEF_DUMMY_BYTE ) << 16;
-    dat |= ( uint32_t )SPI_FLASH_SendByte( DEF_DUMMY_BYTE ) << 8;
-    dat |= SPI_FLASH_SendByte( DEF_DUMMY_BYTE );
+    spi_xfer( buf, buf, sizeof( buf ) );
     PIN_FLASH_CS_HIGH( );
-    return( dat );
+    id = 0;
+    for( i = 5; i < sizeof( buf ); i++ )
+    {
+        id = ( id << 8 ) | buf[ i ];
+    }
+    return id;
 }
 /*******************************************************************************
 * Function Name  : FLASH_WriteEnable
@@ -181,11 +635,107 @@ uint32_t FLASH_ReadUNIQUEID( void )
 *******************************************************************************/
 void FLASH_WriteEnable( void )
 {
+    FLASH_Access( );
     PIN_FLASH_CS_LOW( );
     SPI_FLASH_SendByte( CMD_FLASH_WREN );
     PIN_FLASH_CS_HIGH( );
 }
 
+/*******************************************************************************
+* Function Name  : FLASH_Cmd_4B
+* Description    : 4-byte address variant of a read/program/erase opcode
+* Input          : cmd - 3-byte address opcode
+* Output         : None
+* Return         : opcode to send
+*******************************************************************************/
+static uint8_t FLASH_Cmd_4B( uint8_t cmd )
+{
+    switch( cmd )
+    {
+        case CMD_FLASH_READ:            return CMD_FLASH_READ_4B;
+        case CMD_FLASH_FAST_READ:       return CMD_FLASH_FAST_READ_4B;
+        case CMD_FLASH_DUAL_READ:       return CMD_FLASH_DUAL_READ_4B;
+        case CMD_FLASH_QUAD_READ:       return CMD_FLASH_QUAD_READ_4B;
+        case CMD_FLASH_BYTE_PROG:       return CMD_FLASH_BYTE_PROG_4B;
+        case CMD_FLASH_SECTOR_ERASE:    return CMD_FLASH_SECTOR_ERASE_4B;
+        case CMD_FLASH_BLOCK_ERASE_32K: return CMD_FLASH_BLOCK_ERASE_32K_4B;
+        case CMD_FLASH_BLOCK_ERASE_64K: return CMD_FLASH_BLOCK_ERASE_64K_4B;
+        default:                        return cmd;
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Send_Cmd_Addr
+* Description    : Send an array access opcode, its address with the
+*                  address width chosen by FLASH_Addr_Mode_Select and the
+*                  dummy bytes in one burst. CS# must already be low.
+* Input          : cmd - 3-byte address opcode
+*                  address
+*                  dummy - dummy bytes after the address
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Send_Cmd_Addr( uint8_t cmd, uint32_t address, uint8_t dummy )
+{
+    uint8_t  buf[ 5 + 4 ];
+    uint8_t  n;
+
+    if( Flash_Geometry.Addr_4B_Cmd )
+    {
+        cmd = FLASH_Cmd_4B( cmd );
+    }
+    n = 0;
+    buf[ n++ ] = cmd;
+    if( Flash_Geometry.Addr_Bytes == 4 )
+    {
+        buf[ n++ ] = (uint8_t)( address >> 24 );
+    }
+    buf[ n++ ] = (uint8_t)( address >> 16 );
+    buf[ n++ ] = (uint8_t)( address >> 8 );
+    buf[ n++ ] = (uint8_t)address;
+    while( dummy-- && ( n < sizeof( buf ) ) )
+    {
+        buf[ n++ ] = DEF_DUMMY_BYTE;
+    }
+    spi_xfer( buf, NULL, n );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Addr_Mode_Select
+* Description    : Choose how addresses are sent once the capacity is known.
+*                  Parts up to 16 MByte use 3 bytes. Larger parts use the
+*                  dedicated 4-byte opcodes, which do not depend on the mode
+*                  the chip was left in, or enter 4-byte mode with 0xB7
+*                  when DEF_FLASH_4B_OPCODES is 0.
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Addr_Mode_Select( void )
+{
+    Flash_Geometry.Addr_Bytes = 3;
+    Flash_Geometry.Addr_4B_Cmd = 0;
+    if( ( Flash_Geometry.Capacity <= DEF_FLASH_3B_LIMIT ) && ( Flash_Geometry.Addr_Mode != DEF_FLASH_ADDR_4B ) )
+    {
+        return;
+    }
+
+    Flash_Geometry.Addr_Bytes = 4;
+    if( Flash_Geometry.Addr_Mode == DEF_FLASH_ADDR_4B )
+    {
+        /* Chip only knows 4-byte addresses, the plain opcodes take them */
+        return;
+    }
+#if DEF_FLASH_4B_OPCODES
+    Flash_Geometry.Addr_4B_Cmd = 1;
+#else
+    PIN_FLASH_CS_LOW( );
+    SPI_FLASH_SendByte( CMD_FLASH_ENTER_4B );
+    PIN_FLASH_CS_HIGH( );
+#endif
+    printf("Flash_4Byte_Address\n");
+}
+
 /*******************************************************************************
 * Function Name  : FLASH_WriteDisable
 * Description    : FLASH Write Disable
@@ -209,189 +759,1884 @@ void FLASH_WriteDisable( void )
 *******************************************************************************/
 uint8_t FLASH_ReadStatusReg( void )
 {
-    uint8_t  status;
+    uint8_t  buf[ 2 ] = { CMD_FLASH_RDSR, DEF_DUMMY_BYTE };
 
+    FLASH_Access( );
     PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_RDSR );
-    status = SPI_FLASH_ReadByte( );
+    spi_xfer( buf, buf, 2 );
     PIN_FLASH_CS_HIGH( );
-    return( status );
+    return( buf[ 1 ] );
 }
 
 /*******************************************************************************
-* Function Name  : FLASH_Erase_Sector
-* Description    : FLASH Erase Sector
-* Input          : None 
+* Function Name  : FLASH_ReadStatusReg2
+* Description    : FLASH Read Status Register-2
+* Input          : None
 * Output         : None
-* Return         : None
-*******************************************************************************/ 
-void FLASH_Erase_Sector( uint32_t address )
+* Return         : status
+*******************************************************************************/
+uint8_t FLASH_ReadStatusReg2( void )
 {
-    uint8_t  temp;
-    FLASH_WriteEnable( );
+    uint8_t  buf[ 2 ] = { CMD_FLASH_RDSR2, DEF_DUMMY_BYTE };
+
+    FLASH_Access( );
     PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_SECTOR_ERASE );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 16 ) );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 8 ) );
-    SPI_FLASH_SendByte( (uint8_t)address );
+    spi_xfer( buf, buf, 2 );
     PIN_FLASH_CS_HIGH( );
-    do
-    {
-        temp = FLASH_ReadStatusReg( );    
-    }while( temp & 0x01 );
+    return( buf[ 1 ] );
 }
 
 /*******************************************************************************
-* Function Name  : FLASH_RD_Block_Start
-* Description    : FLASH start block read
-* Input          : None 
+* Function Name  : FLASH_Suspend
+* Description    : Suspend a running sector/block erase so the array can be
+*                  read. Chip erase cannot be suspended.
+* Input          : None
 * Output         : None
-* Return         : None
-*******************************************************************************/  
-void FLASH_RD_Block_Start( uint32_t address )
+* Return         : 0 = erase suspended, 1 = nothing was suspended
+*******************************************************************************/
+uint8_t FLASH_Suspend( void )
 {
+    if( Flash_Geometry.Suspend_Cmd == 0x00 )
+    {
+        return 1;
+    }
     PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_READ );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 16 ) );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 8 ) );
-    SPI_FLASH_SendByte( (uint8_t)address );
+    SPI_FLASH_SendByte( Flash_Geometry.Suspend_Cmd );
+    PIN_FLASH_CS_HIGH( );
+
+    /* BUSY clears within tSUS (20us) */
+    while( FLASH_ReadStatusReg( ) & 0x01 );
+
+    /* The erase may have finished before the suspend arrived */
+    if( ( FLASH_ReadStatusReg2( ) & DEF_FLASH_SR2_SUS ) == 0 )
+    {
+        return 1;
+    }
+#if DEF_FLASH_STATS_EN
+    Flash_Stats_Susp_Start = FLASH_Cycles( );
+#endif
+    return 0;
 }
 
 /*******************************************************************************
-* Function Name  : FLASH_RD_Block
-* Description    : FLASH read block
-* Input          : None 
+* Function Name  : FLASH_Resume
+* Description    : Resume a suspended erase
+* Input          : None
 * Output         : None
 * Return         : None
-*******************************************************************************/  
-void FLASH_RD_Block( uint8_t *pbuf, uint32_t len )
+*******************************************************************************/
+void FLASH_Resume( void )
 {
-    while( len-- )                                                             
-    {
-        *pbuf++ = SPI_FLASH_ReadByte( );
-    }
+    PIN_FLASH_CS_LOW( );
+    SPI_FLASH_SendByte( Flash_Geometry.Resume_Cmd );
+    PIN_FLASH_CS_HIGH( );
+    Flash_Job_Resume_At = FLASH_Cycles( );
+#if DEF_FLASH_STATS_EN
+    Flash_Stats_Op_Paused += FLASH_Cycles( ) - Flash_Stats_Susp_Start;
+#endif
 }
 
 /*******************************************************************************
-* Function Name  : FLASH_RD_Block_End
-* Description    : FLASH end block read
+* Function Name  : FLASH_Power_Down
+* Description    : Put the chip into deep power-down (0xB9). The next access
+*                  through this file releases it again. No program, erase
+*                  or DMA transfer may be running.
 * Input          : None
 * Output         : None
 * Return         : None
 *******************************************************************************/
-void FLASH_RD_Block_End( void )
+void FLASH_Power_Down( void )
 {
+    FLASH_Access( );
+    PIN_FLASH_CS_LOW( );
+    SPI_FLASH_SendByte( CMD_FLASH_POWER_DOWN );
     PIN_FLASH_CS_HIGH( );
+    Flash_Power_State = DEF_FLASH_PWR_DOWN;
 }
 
 /*******************************************************************************
-* Function Name  : W25XXX_WR_Page
-* Description    : Flash page program
-* Input          : address
-*                  len
-*                  *pbuf
+* Function Name  : FLASH_Wake
+* Description    : Send release from deep power-down (0xAB) and return at
+*                  once. Called as soon as an access is known to be coming,
+*                  e.g. through BLK_Prepare when a USB CBW arrives, so tRES1
+*                  has passed when the access starts.
+*                  Safe to call from an interrupt.
+* Input          : None
 * Output         : None
 * Return         : None
 *******************************************************************************/
-void W25XXX_WR_Page( uint8_t *pbuf, uint32_t address, uint32_t len )
+void FLASH_Wake( void )
 {
-    uint8_t  temp;
-    FLASH_WriteEnable( );
-    PIN_FLASH_CS_LOW( );
-    SPI_FLASH_SendByte( CMD_FLASH_BYTE_PROG );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 16 ) );
-    SPI_FLASH_SendByte( (uint8_t)( address >> 8 ) );
-    SPI_FLASH_SendByte( (uint8_t)address );
-    if( len > SPI_FLASH_PerWritePageSize )
-    {
-        len = SPI_FLASH_PerWritePageSize;
-    }
-    while( len-- )
+    uint32_t irq;
+
+    irq = SPI_Irq_Save( );
+    if( Flash_Power_State == DEF_FLASH_PWR_DOWN )
     {
-        SPI_FLASH_SendByte( *pbuf++ );
+        PIN_FLASH_CS_LOW( );
+        SPI_FLASH_SendByte( CMD_FLASH_RELEASE_PD );
+        PIN_FLASH_CS_HIGH( );
+        Flash_Wake_Start = FLASH_Cycles( );
+        Flash_Power_State = DEF_FLASH_PWR_WAKING;
     }
-    PIN_FLASH_CS_HIGH( );
-    do
-    {
-        temp = FLASH_ReadStatusReg( );    
-    }while( temp & 0x01 );
+    SPI_Irq_Restore( irq );
 }
 
 /*******************************************************************************
-* Function Name  : W25XXX_WR_Block
-* Description    : W25XXX block write 
-* Input          : address
-*                  len
-*                  *pbuf
+* Function Name  : FLASH_Job_Wait_Step
+* Description    : Make the chip available to a direct access while a job
+*                  step started by FLASH_Job_Poll may still be running.
+*                  Reads suspend a running erase instead of waiting for it;
+*                  FLASH_Job_Poll resumes it once the read has ended. A
+*                  suspend waits until DEF_FLASH_RESUME_MIN_US have passed
+*                  since the last resume, so a steady read stream cannot
+*                  starve the erase. Reads inside the erased range are
+*                  held back by FLASH_RD_Block.
+*                  Erases and programs resume it and wait.
+* Input          : read - 1: the access only reads the array
 * Output         : None
 * Return         : None
 *******************************************************************************/
-void W25XXX_WR_Block( uint8_t *pbuf, uint32_t address, uint32_t len )
+static void FLASH_Job_Wait_Step( uint8_t read )
 {
-    uint8_t NumOfPage = 0, NumOfSingle = 0, Addr = 0, count = 0, temp = 0;
-
-    Addr = address % SPI_FLASH_PageSize;
-    count = SPI_FLASH_PageSize - Addr;
-    NumOfPage =  len / SPI_FLASH_PageSize;
-    NumOfSingle = len % SPI_FLASH_PageSize;
-
-    if( Addr == 0 )
+    FLASH_Access( );
+    if( Flash_Job_Suspended )
     {
-        if( NumOfPage == 0 )
+        if( read )
         {
-            W25XXX_WR_Page( pbuf, address, len );
+            return;
+        }
+        FLASH_Resume( );
+        Flash_Job_Suspended = 0;
+    }
+    if( Flash_Job_Running )
+    {
+        if( read && ( Flash_Job_Step_Cmd != CMD_FLASH_BYTE_PROG ) && ( Flash_Job_Step_Cmd != CMD_FLASH_CHIP_ERASE )
+         && ( Flash_DMA_Status == DEF_FLASH_DMA_IDLE ) )
+        {
+            /* Let the erase run a while after a resume, never less than tSUS,
+               or back-to-back reads would keep it from finishing */
+            while( ( FLASH_Cycles( ) - Flash_Job_Resume_At < (uint64_t)DEF_FLASH_RESUME_MIN_US * ( SystemCoreClock / 1000000 ) )
+                && ( FLASH_ReadStatusReg( ) & 0x01 ) );
+            if( ( FLASH_ReadStatusReg( ) & 0x01 ) && ( FLASH_Suspend( ) == 0 ) )
+            {
+                Flash_Job_Suspended = 1;
+                return;
+            }
+        }
+        FLASH_Wait_Ready( );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Start
+* Description    : Send an erase command, does not wait for the erase
+* Input          : cmd - erase opcode
+*                  address - ignored for chip erase
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Erase_Start( uint8_t cmd, uint32_t address )
+{
+    FLASH_WriteEnable( );
+    PIN_FLASH_CS_LOW( );
+    if( cmd == CMD_FLASH_CHIP_ERASE )
+    {
+        SPI_FLASH_SendByte( cmd );
+        FLASH_Cache_Invalidate( 0, Flash_Geometry.Capacity );
+    }
+    else
+    {
+        FLASH_Send_Cmd_Addr( cmd, address, 0 );
+        Flash_Erase_Len = FLASH_Erase_Size( cmd );
+        Flash_Erase_Addr = address & ~( Flash_Erase_Len - 1 );
+        FLASH_Cache_Invalidate( Flash_Erase_Addr, Flash_Erase_Len );
+    }
+    PIN_FLASH_CS_HIGH( );
+    FLASH_Stats_Issue( cmd, address, 0 );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Sector
+* Description    : FLASH Erase Sector
+* Input          : None 
+* Output         : None
+* Return         : None
+*******************************************************************************/ 
+void FLASH_Erase_Sector( uint32_t address )
+{
+    FLASH_Job_Wait_Step( 0 );
+    FLASH_Erase_Start( Flash_Geometry.Erase_4K_Cmd, address );
+    FLASH_Wait_Ready( );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Wait
+* Description    : Send an erase command and wait for it to finish
+* Input          : cmd - erase opcode
+*                  address
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Erase_Wait( uint8_t cmd, uint32_t address )
+{
+    FLASH_Job_Wait_Step( 0 );
+    FLASH_Erase_Start( cmd, address );
+    FLASH_Wait_Ready( );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Block_32K
+* Description    : FLASH Erase 32 KByte Block
+* Input          : address
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Erase_Block_32K( uint32_t address )
+{
+    FLASH_Erase_Wait( CMD_FLASH_BLOCK_ERASE_32K, address );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Block_64K
+* Description    : FLASH Erase 64 KByte Block
+* Input          : address
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Erase_Block_64K( uint32_t address )
+{
+    FLASH_Erase_Wait( CMD_FLASH_BLOCK_ERASE_64K, address );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Chip
+* Description    : FLASH Erase Full Memory Array
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Erase_Chip( void )
+{
+    FLASH_Erase_Wait( CMD_FLASH_CHIP_ERASE, 0 );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Pick
+* Description    : Largest erase the chip supports that starts at address
+*                  and stays inside the range
+* Input          : address - 4 KByte aligned
+*                  len - at least 4 KByte
+*                  *size - erase size
+* Output         : *size
+* Return         : erase opcode
+*******************************************************************************/
+static uint8_t FLASH_Erase_Pick( uint32_t address, uint32_t len, uint32_t *size )
+{
+    uint8_t  i, cmd;
+
+    if( ( address == 0 ) && Flash_Geometry.Capacity && ( len >= Flash_Geometry.Capacity ) )
+    {
+        *size = Flash_Geometry.Capacity;
+        return CMD_FLASH_CHIP_ERASE;
+    }
+
+    cmd = Flash_Geometry.Erase_4K_Cmd;
+    *size = SPI_FLASH_SectorSize;
+    for( i = 0; i < 4; i++ )
+    {
+        if( ( Flash_Geometry.Erase_Size[ i ] > *size ) && ( Flash_Geometry.Erase_Size[ i ] <= len )
+         && ( ( address % Flash_Geometry.Erase_Size[ i ] ) == 0 ) )
+        {
+            *size = Flash_Geometry.Erase_Size[ i ];
+            cmd = Flash_Geometry.Erase_Cmd[ i ];
+        }
+    }
+    return cmd;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Range
+* Description    : Erase a 4 KByte aligned range with the fewest, largest
+*                  erase commands (4K/32K/64K blocks or the whole chip)
+* Input          : address - 4 KByte aligned
+*                  len - multiple of 4 KByte
+* Output         : None
+* Return         : 0 = success, 1 = range not aligned
+*******************************************************************************/
+uint8_t FLASH_Erase_Range( uint32_t address, uint32_t len )
+{
+    uint32_t size;
+    uint8_t  cmd;
+
+    if( ( address % SPI_FLASH_SectorSize ) || ( len % SPI_FLASH_SectorSize ) )
+    {
+        return 1;
+    }
+    while( len )
+    {
+        cmd = FLASH_Erase_Pick( address, len, &size );
+        FLASH_Erase_Wait( cmd, address );
+        address += size;
+        len -= size;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_RD_Block_Start
+* Description    : FLASH start block read
+* Input          : None 
+* Output         : None
+* Return         : None
+*******************************************************************************/  
+void FLASH_RD_Block_Start( uint32_t address )
+{
+    /* Ending an open stream runs FLASH_RD_Block_End, which must not take
+       this read's sample */
+    FLASH_Stream_Close( );
+#if DEF_FLASH_STATS_EN
+    Flash_Stats_Rd_Start = FLASH_Cycles( );
+    Flash_Stats_Rd_Open = 1;
+    Flash_Stats.Op_Count[ DEF_FLASH_OP_READ ]++;
+#endif
+    FLASH_Job_Wait_Step( 1 );
+    Flash_Bus_Lock = 1;
+    PIN_FLASH_CS_LOW( );
+    FLASH_Send_Cmd_Addr( Flash_Geometry.Read_Cmd, address, Flash_Geometry.Read_Dummy );
+    Flash_Read_Addr = address;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Erase_Overlap
+* Description    : Check a read range against the suspended erase
+* Input          : address
+*                  len
+* Output         : None
+* Return         : 1 = an erase is suspended and the range overlaps it
+*******************************************************************************/
+static uint8_t FLASH_Erase_Overlap( uint32_t address, uint32_t len )
+{
+    return Flash_Job_Suspended && ( address < Flash_Erase_Addr + Flash_Erase_Len ) && ( address + len > Flash_Erase_Addr );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_RD_Block
+* Description    : FLASH read block
+* Input          : None 
+* Output         : None
+* Return         : None
+*******************************************************************************/  
+void FLASH_RD_Block( uint8_t *pbuf, uint32_t len )
+{
+#if DEF_FLASH_DMA_EN
+    uint32_t count;
+#endif
+    uint8_t  open;
+
+#if DEF_FLASH_STATS_EN
+    Flash_Stats.Read_Bytes += len;
+#endif
+    if( FLASH_Erase_Overlap( Flash_Read_Addr, len ) )
+    {
+        /* The suspended erase leaves its range undefined: let it finish,
+           then read on from the same address. The read stays open, the
+           status polls must not close it */
+        open = Flash_Stream_Open;
+        Flash_Stream_Open = 0;
+        PIN_FLASH_CS_HIGH( );
+        FLASH_Resume( );
+        Flash_Job_Suspended = 0;
+        FLASH_Wait_Ready( );
+        Flash_Stream_Open = open;
+        PIN_FLASH_CS_LOW( );
+        FLASH_Send_Cmd_Addr( Flash_Geometry.Read_Cmd, Flash_Read_Addr, Flash_Geometry.Read_Dummy );
+    }
+    Flash_Read_Addr += len;
+#if DEF_FLASH_DMA_EN
+    /* DMA CNTR is 16 bits, longer reads go in several transfers */
+    while( len >= DEF_FLASH_DMA_MIN_LEN )
+    {
+        count = ( len > DEF_FLASH_DMA_MAX_LEN ) ? DEF_FLASH_DMA_MAX_LEN : len;
+        FLASH_RD_Block_DMA( pbuf, count );
+        FLASH_DMA_Wait( );
+        pbuf += count;
+        len -= count;
+    }
+    if( len == 0 )
+    {
+        return;
+    }
+#endif
+    spi_xfer( NULL, pbuf, len );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_RD_Block_End
+* Description    : FLASH end block read
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_RD_Block_End( void )
+{
+    PIN_FLASH_CS_HIGH( );
+    Flash_Bus_Lock = 0;
+#if DEF_FLASH_STATS_EN
+    if( Flash_Stats_Rd_Open )
+    {
+        Flash_Stats_Rd_Open = 0;
+        FLASH_Stats_Latency( DEF_FLASH_OP_READ, FLASH_Cycles( ) - Flash_Stats_Rd_Start );
+    }
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Stream_Read
+* Description    : Read a block and leave the read command open. A read that
+*                  starts where the last one ended, or at most
+*                  DEF_FLASH_STREAM_SKIP_MAX bytes after it, continues the
+*                  open command without CS# toggle, opcode or address.
+*                  Any other flash access closes the stream first, so
+*                  callers may mix it freely with the rest of this file.
+* Input          : address
+*                  *pbuf
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Stream_Read( uint32_t address, uint8_t *pbuf, uint32_t len )
+{
+    uint8_t  skip[ DEF_FLASH_STREAM_SKIP_MAX ];
+    uint64_t start;
+    uint32_t irq;
+
+    start = FLASH_Cycles( );
+    irq = FLASH_Bus_Enter( );
+    if( Flash_Stream_Open && ( address >= Flash_Stream_Addr )
+     && ( address - Flash_Stream_Addr <= DEF_FLASH_STREAM_SKIP_MAX )
+     && ( FLASH_Erase_Overlap( Flash_Stream_Addr, address - Flash_Stream_Addr ) == 0 ) )
+    {
+        if( address != Flash_Stream_Addr )
+        {
+            spi_xfer( NULL, skip, address - Flash_Stream_Addr );
+            Flash_Read_Addr = address;
+        }
+        Flash_Last_Access = start;
+#if DEF_FLASH_STATS_EN
+        Flash_Stats.Op_Count[ DEF_FLASH_OP_READ ]++;
+#endif
+    }
+    else
+    {
+        FLASH_RD_Block_Start( address );
+        Flash_Stream_Open = 1;
+    }
+    FLASH_RD_Block( pbuf, len );
+    Flash_Stream_Addr = address + len;
+#if DEF_FLASH_STATS_EN
+    /* Each call is one read, however long the stream stays open */
+    Flash_Stats_Rd_Open = 0;
+    FLASH_Stats_Latency( DEF_FLASH_OP_READ, FLASH_Cycles( ) - start );
+#endif
+    FLASH_Bus_Exit( irq );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Stream_Close
+* Description    : End the read left open by FLASH_Stream_Read, if any.
+*                  Call it when a run of reads is done so CS# goes high.
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Stream_Close( void )
+{
+    if( Flash_Stream_Open )
+    {
+        Flash_Stream_Open = 0;
+        FLASH_RD_Block_End( );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_RD_Line
+* Description    : Read the DEF_FLASH_LINE_SIZE aligned line holding an
+*                  address in one read command.
+*                  Set Burst with Wrap (0x77) would let the chip start at
+*                  the wanted byte and wrap inside the line, but it only
+*                  applies to Quad I/O reads (0xEB), which SPI1 with one
+*                  data line cannot issue. Starting at the line base costs
+*                  at most DEF_FLASH_LINE_SIZE - 1 byte times, and the
+*                  caller waits for the whole line either way.
+*                  Goes through the read stream, so misses on following
+*                  lines continue the same command.
+* Input          : address - any address inside the line
+*                  *pbuf - DEF_FLASH_LINE_SIZE bytes
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_RD_Line( uint32_t address, uint8_t *pbuf )
+{
+    FLASH_Stream_Read( address & ~( DEF_FLASH_LINE_SIZE - 1 ), pbuf, DEF_FLASH_LINE_SIZE );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Line_Read
+* Description    : Read a few bytes through the line cache. Each miss costs
+*                  one FLASH_RD_Line, later reads in the same line are
+*                  served from RAM until a program or erase touches it.
+*                  Meant for scattered metadata: FAT entries, BPB fields,
+*                  directory entries. Lines are not kept while an erase
+*                  is suspended, since its range reads back undefined.
+*                  Misses leave the read stream open, as FLASH_Stream_Read.
+* Input          : address
+*                  *pbuf
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Line_Read( uint32_t address, uint8_t *pbuf, uint32_t len )
+{
+#if DEF_FLASH_LINE_EN
+    uint32_t irq, base, count;
+    uint8_t  n;
+
+    irq = FLASH_Bus_Enter( );
+    while( len )
+    {
+        base = address & ~( DEF_FLASH_LINE_SIZE - 1 );
+        count = base + DEF_FLASH_LINE_SIZE - address;
+        if( count > len )
+        {
+            count = len;
+        }
+        n = ( base / DEF_FLASH_LINE_SIZE ) & ( DEF_FLASH_LINE_NUM - 1 );
+        if( Flash_Line_Tag[ n ] != ( base | 1 ) )
+        {
+            FLASH_RD_Line( base, Flash_Line_Data[ n ] );
+            Flash_Line_Tag[ n ] = Flash_Job_Suspended ? 0 : ( base | 1 );
+#if DEF_FLASH_STATS_EN
+            Flash_Stats.Line_Misses++;
+        }
+        else
+        {
+            Flash_Stats.Line_Hits++;
+#endif
+        }
+        memcpy( pbuf, &Flash_Line_Data[ n ][ address - base ], count );
+        address += count;
+        pbuf += count;
+        len -= count;
+    }
+    FLASH_Bus_Exit( irq );
+#else
+    FLASH_Stream_Read( address, pbuf, len );
+#endif
+}
+
+#if DEF_FLASH_CACHE_EN
+/*******************************************************************************
+* Function Name  : FLASH_Cache_Sector
+* Description    : Find a sector in the sector cache, reading it into the
+*                  least recently used way of its set on a miss
+* Input          : base - 4 KByte aligned address
+* Output         : None
+* Return         : cached sector data
+*******************************************************************************/
+static uint8_t *FLASH_Cache_Sector( uint32_t base )
+{
+    uint8_t n, w, victim;
+
+    n = ( base / SPI_FLASH_SectorSize ) & ( DEF_FLASH_CACHE_SETS - 1 );
+    victim = 0;
+    for( w = 0; w < DEF_FLASH_CACHE_WAYS; w++ )
+    {
+        if( Flash_Cache_Tag[ n ][ w ] == ( base | 1 ) )
+        {
+#if DEF_FLASH_STATS_EN
+            Flash_Stats.Cache_Hits++;
+#endif
+            Flash_Cache_Used[ n ][ w ] = ++Flash_Cache_Clock;
+            return Flash_Cache_Data[ n ][ w ];
+        }
+        if( ( Flash_Cache_Tag[ n ][ victim ] != 0 )
+         && ( ( Flash_Cache_Tag[ n ][ w ] == 0 ) || ( Flash_Cache_Used[ n ][ w ] < Flash_Cache_Used[ n ][ victim ] ) ) )
+        {
+            victim = w;
+        }
+    }
+#if DEF_FLASH_STATS_EN
+    Flash_Stats.Cache_Misses++;
+#endif
+    FLASH_RD_Block_Start( base );
+    FLASH_RD_Block( Flash_Cache_Data[ n ][ victim ], SPI_FLASH_SectorSize );
+    FLASH_RD_Block_End( );
+
+    /* A suspended erase may be clearing this sector, do not keep it */
+    Flash_Cache_Tag[ n ][ victim ] = Flash_Job_Suspended ? 0 : ( base | 1 );
+    Flash_Cache_Used[ n ][ victim ] = ++Flash_Cache_Clock;
+    return Flash_Cache_Data[ n ][ victim ];
+}
+#endif
+
+/*******************************************************************************
+* Function Name  : FLASH_Cache_Read
+* Description    : Read through the sector cache. A miss reads the whole
+*                  4 KByte sector in one command, later reads of it come
+*                  from RAM until a program or erase touches it.
+*                  For data read again and again: boot sector, FAT, root
+*                  directory, USB READ10.
+* Input          : address
+*                  *pbuf
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Cache_Read( uint32_t address, uint8_t *pbuf, uint32_t len )
+{
+#if DEF_FLASH_CACHE_EN
+    uint32_t irq, base, count;
+    uint8_t  *sector;
+
+    irq = FLASH_Bus_Enter( );
+    while( len )
+    {
+        base = address & ~( SPI_FLASH_SectorSize - 1 );
+        count = base + SPI_FLASH_SectorSize - address;
+        if( count > len )
+        {
+            count = len;
+        }
+        sector = FLASH_Cache_Sector( base );
+        memcpy( pbuf, sector + ( address - base ), count );
+        address += count;
+        pbuf += count;
+        len -= count;
+    }
+    FLASH_Bus_Exit( irq );
+#else
+    FLASH_RD_Block_Start( address );
+    FLASH_RD_Block( pbuf, len );
+    FLASH_RD_Block_End( );
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Cache_Flush
+* Description    : Empty the line and sector caches, for changes made
+*                  behind this driver
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Cache_Flush( void )
+{
+    FLASH_Cache_Invalidate( 0, 0xFFFFFFFF );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_RD_Block_DMA
+* Description    : FLASH read block by SPI1 RX/TX DMA, returns at once.
+*                  Must be called between FLASH_RD_Block_Start and
+*                  FLASH_RD_Block_End, the end of the transfer is reported by
+*                  Flash_DMA_Status, FLASH_DMA_Check and the callback.
+* Input          : *pbuf
+*                  len (1 - DEF_FLASH_DMA_MAX_LEN)
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_RD_Block_DMA( uint8_t *pbuf, uint32_t len )
+{
+    DMA_InitTypeDef DMA_InitStructure = {0};
+
+    Flash_DMA_Status = DEF_FLASH_DMA_READ;
+
+    /* Drop a byte possibly left in the receive register */
+    (void)SPI_I2S_ReceiveData( SPI1 );
+
+    /* RX: SPI1 data register -> buffer */
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uintptr_t)&SPI1->DATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uintptr_t)pbuf;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralSRC;
+    DMA_InitStructure.DMA_BufferSize = len;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_VeryHigh;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init( DEF_FLASH_DMA_RX_CH, &DMA_InitStructure );
+
+    /* TX: clock out dummy bytes */
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uintptr_t)&Flash_DMA_Dummy;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Disable;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_Init( DEF_FLASH_DMA_TX_CH, &DMA_InitStructure );
+
+    DMA_ClearFlag( DMA1_FLAG_GL2 | DMA1_FLAG_GL3 );
+    DMA_ITConfig( DEF_FLASH_DMA_RX_CH, DMA_IT_TC, ENABLE );
+    DMA_Cmd( DEF_FLASH_DMA_RX_CH, ENABLE );
+    DMA_Cmd( DEF_FLASH_DMA_TX_CH, ENABLE );
+    SPI_I2S_DMACmd( SPI1, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, ENABLE );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_DMA_Finish
+* Description    : Release the DMA channels after the last byte was received
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_DMA_Finish( void )
+{
+    uint8_t status;
+
+    SPI_I2S_DMACmd( SPI1, SPI_I2S_DMAReq_Rx | SPI_I2S_DMAReq_Tx, DISABLE );
+    DMA_ITConfig( DEF_FLASH_DMA_RX_CH, DMA_IT_TC, DISABLE );
+    DMA_ITConfig( DEF_FLASH_DMA_TX_CH, DMA_IT_TC, DISABLE );
+    DMA_Cmd( DEF_FLASH_DMA_RX_CH, DISABLE );
+    DMA_Cmd( DEF_FLASH_DMA_TX_CH, DISABLE );
+    DMA_ClearFlag( DMA1_FLAG_GL2 | DMA1_FLAG_GL3 );
+
+    if( Flash_DMA_Status == DEF_FLASH_DMA_WRITE )
+    {
+        /* The last byte is still shifting out when TX DMA completes */
+        while( SPI_I2S_GetFlagStatus( SPI1, SPI_I2S_FLAG_TXE ) == RESET );
+        while( SPI_I2S_GetFlagStatus( SPI1, SPI_I2S_FLAG_BSY ) != RESET );
+        PIN_FLASH_CS_HIGH( );
+
+        /* Received bytes were discarded, clear the overrun */
+        (void)SPI_I2S_ReceiveData( SPI1 );
+        (void)SPI_I2S_GetFlagStatus( SPI1, SPI_I2S_FLAG_OVR );
+    }
+
+    status = Flash_DMA_Status;
+    Flash_DMA_Status = DEF_FLASH_DMA_IDLE;
+    if( Flash_DMA_Callback )
+    {
+        Flash_DMA_Callback( status );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_DMA_Check
+* Description    : Poll the running DMA transfer, finish it when complete.
+*                  Safe to call from the main loop and from other interrupts.
+* Input          : None
+* Output         : None
+* Return         : 0 = idle, otherwise the status of the running transfer
+*******************************************************************************/
+uint8_t FLASH_DMA_Check( void )
+{
+    NVIC_DisableIRQ( DMA1_Channel2_IRQn );
+    NVIC_DisableIRQ( DMA1_Channel3_IRQn );
+    if( ( ( Flash_DMA_Status == DEF_FLASH_DMA_READ ) && DMA_GetFlagStatus( DMA1_FLAG_TC2 ) )
+     || ( ( Flash_DMA_Status == DEF_FLASH_DMA_WRITE ) && DMA_GetFlagStatus( DMA1_FLAG_TC3 ) ) )
+    {
+        FLASH_DMA_Finish( );
+    }
+    NVIC_EnableIRQ( DMA1_Channel2_IRQn );
+    NVIC_EnableIRQ( DMA1_Channel3_IRQn );
+    return Flash_DMA_Status;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_DMA_Wait
+* Description    : Wait for the running DMA transfer to finish
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_DMA_Wait( void )
+{
+    while( FLASH_DMA_Check( ) != DEF_FLASH_DMA_IDLE );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_DMA_Set_Callback
+* Description    : Set the function called when a DMA transfer completes.
+*                  It runs in interrupt context when the transfer ends by IRQ.
+* Input          : callback - NULL to disable
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_DMA_Set_Callback( void ( *callback )( uint8_t status ) )
+{
+    Flash_DMA_Callback = callback;
+}
+
+/*******************************************************************************
+* Function Name  : DMA1_Channel2_IRQHandler
+* Description    : SPI1 RX DMA transfer complete
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void DMA1_Channel2_IRQHandler( void )
+{
+    if( ( Flash_DMA_Status == DEF_FLASH_DMA_READ ) && DMA_GetITStatus( DMA1_IT_TC2 ) )
+    {
+        FLASH_DMA_Finish( );
+    }
+    DMA_ClearITPendingBit( DMA1_IT_GL2 );
+}
+
+/*******************************************************************************
+* Function Name  : DMA1_Channel3_IRQHandler
+* Description    : SPI1 TX DMA transfer complete, ends the page program command
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void DMA1_Channel3_IRQHandler( void )
+{
+    if( ( Flash_DMA_Status == DEF_FLASH_DMA_WRITE ) && DMA_GetITStatus( DMA1_IT_TC3 ) )
+    {
+        FLASH_DMA_Finish( );
+    }
+    DMA_ClearITPendingBit( DMA1_IT_GL3 );
+}
+
+/*******************************************************************************
+* Function Name  : W25XXX_WR_Page_Start
+* Description    : Send a page program command, does not wait for the
+*                  program cycle. Data goes by DMA when it is long enough,
+*                  in which case the command ends when the DMA completes.
+* Input          : address
+*                  len
+*                  *pbuf
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void W25XXX_WR_Page_Start( uint8_t *pbuf, uint32_t address, uint32_t len )
+{
+#if DEF_FLASH_DMA_EN
+    if( len >= DEF_FLASH_DMA_MIN_LEN )
+    {
+        W25XXX_WR_Page_DMA( pbuf, address, len );
+        return;
+    }
+#endif
+    FLASH_WriteEnable( );
+    PIN_FLASH_CS_LOW( );
+    FLASH_Send_Cmd_Addr( CMD_FLASH_BYTE_PROG, address, 0 );
+    if( len > Flash_Geometry.Page_Size )
+    {
+        len = Flash_Geometry.Page_Size;
+    }
+    spi_xfer( pbuf, NULL, len );
+    PIN_FLASH_CS_HIGH( );
+    FLASH_Cache_Invalidate( address, len );
+    FLASH_Stats_Issue( CMD_FLASH_BYTE_PROG, address, len );
+}
+
+/*******************************************************************************
+* Function Name  : W25XXX_WR_Page
+* Description    : Flash page program
+* Input          : address
+*                  len
+*                  *pbuf
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void W25XXX_WR_Page( uint8_t *pbuf, uint32_t address, uint32_t len )
+{
+    FLASH_Job_Wait_Step( 0 );
+    W25XXX_WR_Page_Start( pbuf, address, len );
+    FLASH_Wait_Ready( );
+}
+
+/*******************************************************************************
+* Function Name  : W25XXX_WR_Page_DMA
+* Description    : Flash page program, data sent by SPI1 TX DMA. Returns once
+*                  the transfer is started, RX data is discarded. CS# is
+*                  released when the DMA completes, after which the chip
+*                  programs the page; poll FLASH_Check_Busy for the end.
+* Input          : address
+*                  len
+*                  *pbuf (must stay valid until the DMA completes)
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void W25XXX_WR_Page_DMA( uint8_t *pbuf, uint32_t address, uint32_t len )
+{
+    DMA_InitTypeDef DMA_InitStructure = {0};
+
+    if( len > Flash_Geometry.Page_Size )
+    {
+        len = Flash_Geometry.Page_Size;
+    }
+    if( len == 0 )
+    {
+        return;
+    }
+
+    FLASH_WriteEnable( );
+    PIN_FLASH_CS_LOW( );
+    FLASH_Send_Cmd_Addr( CMD_FLASH_BYTE_PROG, address, 0 );
+
+    Flash_DMA_Status = DEF_FLASH_DMA_WRITE;
+
+    DMA_InitStructure.DMA_PeripheralBaseAddr = (uintptr_t)&SPI1->DATAR;
+    DMA_InitStructure.DMA_MemoryBaseAddr = (uintptr_t)pbuf;
+    DMA_InitStructure.DMA_DIR = DMA_DIR_PeripheralDST;
+    DMA_InitStructure.DMA_BufferSize = len;
+    DMA_InitStructure.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+    DMA_InitStructure.DMA_MemoryInc = DMA_MemoryInc_Enable;
+    DMA_InitStructure.DMA_PeripheralDataSize = DMA_PeripheralDataSize_Byte;
+    DMA_InitStructure.DMA_MemoryDataSize = DMA_MemoryDataSize_Byte;
+    DMA_InitStructure.DMA_Mode = DMA_Mode_Normal;
+    DMA_InitStructure.DMA_Priority = DMA_Priority_High;
+    DMA_InitStructure.DMA_M2M = DMA_M2M_Disable;
+    DMA_Init( DEF_FLASH_DMA_TX_CH, &DMA_InitStructure );
+
+    DMA_ClearFlag( DMA1_FLAG_GL3 );
+    DMA_ITConfig( DEF_FLASH_DMA_TX_CH, DMA_IT_TC, ENABLE );
+    DMA_Cmd( DEF_FLASH_DMA_TX_CH, ENABLE );
+    SPI_I2S_DMACmd( SPI1, SPI_I2S_DMAReq_Tx, ENABLE );
+    FLASH_Cache_Invalidate( address, len );
+    FLASH_Stats_Issue( CMD_FLASH_BYTE_PROG, address, len );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Check_Busy
+* Description    : Check whether a DMA transfer or an internal program/erase
+*                  cycle is still running, without waiting
+* Input          : None
+* Output         : None
+* Return         : 0 = ready, 1 = busy
+*******************************************************************************/
+uint8_t FLASH_Check_Busy( void )
+{
+#if DEF_FLASH_STATS_EN
+    uint64_t cycles;
+#endif
+
+    if( FLASH_DMA_Check( ) != DEF_FLASH_DMA_IDLE )
+    {
+        return 1;
+    }
+    if( FLASH_ReadStatusReg( ) & 0x01 )
+    {
+        return 1;
+    }
+#if DEF_FLASH_STATS_EN
+    /* A suspended erase also reads as ready. Busy time is issue to WIP
+       clear without the suspended time, whoever polled: FLASH_Wait_Ready,
+       FLASH_Job_Poll or FLASH_Job_Flush */
+    if( ( Flash_Stats_Op != 0xFF ) && ( Flash_Job_Suspended == 0 ) )
+    {
+        cycles = FLASH_Cycles( ) - Flash_Stats_Op_Start;
+        FLASH_Stats_Latency( Flash_Stats_Op, cycles );
+        cycles -= Flash_Stats_Op_Paused;
+        Flash_Stats.Busy_Total[ Flash_Stats_Op ] += cycles;
+        if( cycles > Flash_Stats.Busy_Max[ Flash_Stats_Op ] )
+        {
+            Flash_Stats.Busy_Max[ Flash_Stats_Op ] = ( cycles > 0xFFFFFFFF ) ? 0xFFFFFFFF : (uint32_t)cycles;
+        }
+        Flash_Stats_Op = 0xFF;
+    }
+#endif
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Wait_Ready
+* Description    : Wait for FLASH_Check_Busy to report ready
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Wait_Ready( void )
+{
+    while( FLASH_Check_Busy( ) );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Bus_Enter
+* Description    : Keep DEF_FLASH_USER_IRQn from touching the flash while the
+*                  job engine talks to it
+* Input          : None
+* Output         : None
+* Return         : previous enable state of DEF_FLASH_USER_IRQn
+*******************************************************************************/
+static uint32_t FLASH_Bus_Enter( void )
+{
+    uint32_t irq;
+
+    irq = NVIC_GetStatusIRQ( DEF_FLASH_USER_IRQn );
+    NVIC_DisableIRQ( DEF_FLASH_USER_IRQn );
+    return irq;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Bus_Exit
+* Description    : Restore DEF_FLASH_USER_IRQn after FLASH_Bus_Enter
+* Input          : irq - value returned by FLASH_Bus_Enter
+* Output         : None
+* Return         : None
+*******************************************************************************/
+static void FLASH_Bus_Exit( uint32_t irq )
+{
+    if( irq )
+    {
+        NVIC_EnableIRQ( DEF_FLASH_USER_IRQn );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Add
+* Description    : Append a job to the queue
+* Input          : type, *pbuf, address, len, done
+* Output         : None
+* Return         : 0 = queued, 1 = queue full
+*******************************************************************************/
+static uint8_t FLASH_Job_Add( uint8_t type, uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    FLASH_JOB *job;
+    uint32_t  irq;
+    uint8_t   next;
+
+    irq = FLASH_Bus_Enter( );
+    next = ( Flash_Job_Head + 1 ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+    if( next == Flash_Job_Tail )
+    {
+        FLASH_Bus_Exit( irq );
+        return 1;
+    }
+    job = &Flash_Job_Queue[ Flash_Job_Head ];
+    job->Type = type;
+    job->pBuf = pbuf;
+    job->Address = address;
+    job->Len = len;
+    job->Offset = 0;
+    job->State = DEF_FLASH_UPD_COMPARE;
+    job->Pages = 0;
+    job->Retry = 0;
+    job->Done = done;
+    Flash_Job_Head = next;
+    FLASH_Bus_Exit( irq );
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Erase
+* Description    : Queue a 4 KByte sector erase, FLASH_Job_Poll runs it
+* Input          : address
+*                  done - called with NULL and 0 when the erase has finished
+* Output         : None
+* Return         : 0 = queued, 1 = queue full
+*******************************************************************************/
+uint8_t FLASH_Job_Erase( uint32_t address, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    return FLASH_Job_Add( DEF_FLASH_JOB_ERASE, NULL, address, SPI_FLASH_SectorSize, done );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Erase_Range
+* Description    : Queue an erase of a 4 KByte aligned range, run with the
+*                  largest erase commands that fit, one per poll step
+* Input          : address - 4 KByte aligned
+*                  len - multiple of 4 KByte
+*                  done - called with NULL and 0 when the whole range is erased
+* Output         : None
+* Return         : 0 = queued, 1 = queue full or range not aligned
+*******************************************************************************/
+uint8_t FLASH_Job_Erase_Range( uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    if( ( address % SPI_FLASH_SectorSize ) || ( len % SPI_FLASH_SectorSize ) || ( len == 0 ) )
+    {
+        return 1;
+    }
+    return FLASH_Job_Add( DEF_FLASH_JOB_ERASE, NULL, address, len, done );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Program
+* Description    : Queue a program of any length, FLASH_Job_Poll splits it
+*                  into pages. The area must already be erased.
+* Input          : *pbuf - must stay unchanged until done is called
+*                  address
+*                  len
+*                  done - called with pbuf when the last page has finished, status
+*                         0 = success, 1 = still wrong after the verify retries
+* Output         : None
+* Return         : 0 = queued, 1 = queue full
+*******************************************************************************/
+uint8_t FLASH_Job_Program( uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    return FLASH_Job_Add( DEF_FLASH_JOB_PROG, pbuf, address, len, done );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Update
+* Description    : Queue a rewrite of one 4 KByte sector that only does the
+*                  work the new data needs: nothing if the sector already
+*                  holds it, only the changed pages if every change clears
+*                  bits, otherwise erase and program the pages that are not
+*                  blank.
+* Input          : *pbuf - 4 KByte, must stay unchanged until done is called
+*                  address - 4 KByte aligned
+*                  done - called with pbuf when the sector holds the data, status
+*                         0 = success, 1 = still wrong after the verify retries
+* Output         : None
+* Return         : 0 = queued, 1 = queue full or not aligned
+*******************************************************************************/
+uint8_t FLASH_Job_Update( uint8_t *pbuf, uint32_t address, void ( *done )( uint8_t *pbuf, uint8_t status ) )
+{
+    if( ( address % SPI_FLASH_SectorSize ) || ( ( SPI_FLASH_SectorSize / Flash_Geometry.Page_Size ) > 32 ) )
+    {
+        return 1;
+    }
+    return FLASH_Job_Add( DEF_FLASH_JOB_UPDATE, pbuf, address, SPI_FLASH_SectorSize, done );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Update_Step
+* Description    : Advance an update job by one step: compare one chunk
+*                  with the chip, start the sector erase, or start one page
+*                  program. Sets Offset to Len once nothing is left to do.
+* Input          : *job
+* Output         : None
+* Return         : 1 = a chip operation was started, 0 = none
+*******************************************************************************/
+static uint8_t FLASH_Job_Update_Step( FLASH_JOB *job )
+{
+    uint32_t i, count, page;
+    uint8_t  *pnew;
+
+    if( job->State != DEF_FLASH_UPD_PROG )
+    {
+        count = job->Len - job->Offset;
+        if( count > DEF_FLASH_UPD_CMP_LEN )
+        {
+            count = DEF_FLASH_UPD_CMP_LEN;
+        }
+        FLASH_RD_Block_Start( job->Address + job->Offset );
+        FLASH_RD_Block( Flash_Job_Cmp_Buf, count );
+        FLASH_RD_Block_End( );
+
+        pnew = job->pBuf + job->Offset;
+        for( i = 0; i < count; i++ )
+        {
+            if( Flash_Job_Cmp_Buf[ i ] != pnew[ i ] )
+            {
+                job->Pages |= 1UL << ( ( job->Offset + i ) / Flash_Geometry.Page_Size );
+                if( ( Flash_Job_Cmp_Buf[ i ] & pnew[ i ] ) != pnew[ i ] )
+                {
+                    job->State = DEF_FLASH_UPD_ERASE;
+                }
+            }
+        }
+        job->Offset += count;
+        if( job->Offset < job->Len )
+        {
+            return 0;
+        }
+
+        job->Offset = 0;
+        if( job->State == DEF_FLASH_UPD_ERASE )
+        {
+            /* After the erase only pages that are not blank need programming */
+            job->Pages = 0;
+            for( i = 0; i < job->Len; i++ )
+            {
+                if( job->pBuf[ i ] != 0xFF )
+                {
+                    job->Pages |= 1UL << ( i / Flash_Geometry.Page_Size );
+                }
+            }
+            job->State = DEF_FLASH_UPD_PROG;
+            if( job->Pages == 0 )
+            {
+                job->Offset = job->Len;
+            }
+            FLASH_Erase_Start( Flash_Geometry.Erase_4K_Cmd, job->Address );
+            Flash_Job_Step_Cmd = Flash_Geometry.Erase_4K_Cmd;
+            return 1;
+        }
+        job->State = DEF_FLASH_UPD_PROG;
+    }
+
+    if( job->Pages == 0 )
+    {
+        /* Sector already holds the data */
+        job->Offset = job->Len;
+        return 0;
+    }
+    for( page = 0; ( job->Pages & ( 1UL << page ) ) == 0; page++ );
+    job->Pages &= ~( 1UL << page );
+    if( job->Pages == 0 )
+    {
+        job->Offset = job->Len;
+    }
+    W25XXX_WR_Page_Start( job->pBuf + page * Flash_Geometry.Page_Size,
+                          job->Address + page * Flash_Geometry.Page_Size, Flash_Geometry.Page_Size );
+    Flash_Job_Step_Cmd = CMD_FLASH_BYTE_PROG;
+    return 1;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Poll
+* Description    : Advance the job engine without waiting. Call it from the
+*                  main loop or a timer tick; each call at most checks the
+*                  busy state and starts the next erase or page program.
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Job_Poll( void )
+{
+    FLASH_JOB *job;
+    uint32_t  irq, count;
+    uint8_t   cmd, status;
+
+    irq = FLASH_Bus_Enter( );
+    if( Flash_Job_Tail != Flash_Job_Head )
+    {
+        FLASH_Stream_Close( );
+    }
+    while( ( Flash_Job_Tail != Flash_Job_Head ) && ( Flash_Bus_Lock == 0 ) )
+    {
+        job = &Flash_Job_Queue[ Flash_Job_Tail ];
+        if( Flash_Job_Suspended )
+        {
+            /* The reads that preempted the erase are done */
+            FLASH_Resume( );
+            Flash_Job_Suspended = 0;
+            break;
+        }
+        if( Flash_Job_Running )
+        {
+            if( FLASH_Check_Busy( ) )
+            {
+                break;
+            }
+            Flash_Job_Running = 0;
+        }
+
+        if( job->Offset >= job->Len )
+        {
+            status = 0;
+#if DEF_FLASH_WRITE_VERIFY
+            if( ( job->Type != DEF_FLASH_JOB_ERASE ) && FLASH_Verify( job->pBuf, job->Address, job->Len ) )
+            {
+                status = 1;
+                if( job->Retry < DEF_FLASH_VERIFY_RETRY )
+                {
+                    /* Run the job again, an update job compares, erases and programs as needed */
+                    job->Retry++;
+                    job->Offset = 0;
+                    job->State = DEF_FLASH_UPD_COMPARE;
+                    job->Pages = 0;
+                    break;
+                }
+            }
+#endif
+            /* Job complete, status 1 if the data is still wrong after every retry */
+            Flash_Job_Tail = ( Flash_Job_Tail + 1 ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+            if( job->Done )
+            {
+                job->Done( job->pBuf, status );
+            }
+            continue;
+        }
+
+        if( job->Type == DEF_FLASH_JOB_ERASE )
+        {
+            cmd = FLASH_Erase_Pick( job->Address + job->Offset, job->Len - job->Offset, &count );
+            FLASH_Erase_Start( cmd, job->Address + job->Offset );
+            Flash_Job_Step_Cmd = cmd;
+            job->Offset += count;
+        }
+        else if( job->Type == DEF_FLASH_JOB_UPDATE )
+        {
+            if( FLASH_Job_Update_Step( job ) == 0 )
+            {
+                /* Compare chunks run one per call to keep the interrupt
+                   latency short; a finished job completes right away */
+                if( job->Offset >= job->Len )
+                {
+                    continue;
+                }
+                break;
+            }
         }
         else
         {
-            while( NumOfPage-- )
+            count = Flash_Geometry.Page_Size - ( ( job->Address + job->Offset ) % Flash_Geometry.Page_Size );
+            if( count > job->Len - job->Offset )
+            {
+                count = job->Len - job->Offset;
+            }
+            W25XXX_WR_Page_Start( job->pBuf + job->Offset, job->Address + job->Offset, count );
+            Flash_Job_Step_Cmd = CMD_FLASH_BYTE_PROG;
+            job->Offset += count;
+        }
+        Flash_Job_Running = 1;
+        break;
+    }
+#if DEF_FLASH_PD_EN
+    /* Idle: no job, no block read or DMA in progress, an idle read stream may be ended */
+    if( ( Flash_Job_Tail == Flash_Job_Head ) && ( Flash_Power_State == DEF_FLASH_PWR_ACTIVE )
+     && ( ( Flash_Bus_Lock == 0 ) || Flash_Stream_Open ) && ( Flash_DMA_Status == DEF_FLASH_DMA_IDLE )
+     && ( FLASH_Cycles( ) - Flash_Last_Access >= DEF_FLASH_PD_IDLE_MS * ( SystemCoreClock / 1000 ) ) )
+    {
+        FLASH_Power_Down( );
+    }
+#endif
+    FLASH_Bus_Exit( irq );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Pending
+* Description    : Number of queued or running jobs
+* Input          : None
+* Output         : None
+* Return         : job count
+*******************************************************************************/
+uint8_t FLASH_Job_Pending( void )
+{
+    return ( Flash_Job_Head - Flash_Job_Tail ) & ( DEF_FLASH_JOB_QUEUE_SIZE - 1 );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Job_Flush
+* Description    : Run the job engine until every queued job has finished
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Job_Flush( void )
+{
+    while( FLASH_Job_Pending( ) )
+    {
+        FLASH_Job_Poll( );
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_CRC_Feed
+* Description    : Feed bytes to the CRC unit as little endian words. Bytes
+*                  of an unfinished word stay in *word / *fill, so the
+*                  result depends only on the byte sequence, not on how it
+*                  was split.
+* Input          : *pbuf
+*                  len
+*                  *word - partial word
+*                  *fill - bytes in *word
+* Output         : *word, *fill
+* Return         : None
+*******************************************************************************/
+static void FLASH_CRC_Feed( const uint8_t *pbuf, uint32_t len, uint32_t *word, uint8_t *fill )
+{
+    while( len-- )
+    {
+        *word |= (uint32_t)*pbuf++ << ( *fill * 8 );
+        if( ++( *fill ) == 4 )
+        {
+            CRC_CalcCRC( *word );
+            *word = 0;
+            *fill = 0;
+        }
+    }
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_CRC_End
+* Description    : Feed the last partial word, zero padded, and read the CRC
+* Input          : word, fill - as left by FLASH_CRC_Feed
+* Output         : None
+* Return         : CRC
+*******************************************************************************/
+static uint32_t FLASH_CRC_End( uint32_t word, uint8_t fill )
+{
+    if( fill )
+    {
+        CRC_CalcCRC( word );
+    }
+    return CRC_GetCRC( );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Verify_Readback
+* Description    : Read a range back by DMA in DEF_FLASH_UPD_CMP_LEN chunks
+*                  through the CRC unit and compare with an expected CRC
+* Input          : address
+*                  len
+*                  crc - CRC of the data that was written
+* Output         : None
+* Return         : 0 = equal, 1 = differs
+*******************************************************************************/
+static uint8_t FLASH_Verify_Readback( uint32_t address, uint32_t len, uint32_t crc )
+{
+    uint32_t count, word;
+    uint8_t  fill;
+
+    CRC_ResetDR( );
+    word = 0;
+    fill = 0;
+    FLASH_RD_Block_Start( address );
+    while( len )
+    {
+        count = ( len > DEF_FLASH_UPD_CMP_LEN ) ? DEF_FLASH_UPD_CMP_LEN : len;
+        FLASH_RD_Block( Flash_Job_Cmp_Buf, count );
+        FLASH_CRC_Feed( Flash_Job_Cmp_Buf, count, &word, &fill );
+        len -= count;
+    }
+    FLASH_RD_Block_End( );
+    if( FLASH_CRC_End( word, fill ) != crc )
+    {
+        Flash_Verify_Errors++;
+        return 1;
+    }
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Verify
+* Description    : Check that a range of the chip holds the given data, by
+*                  CRC of both on the CRC unit
+* Input          : *pbuf
+*                  address
+*                  len
+* Output         : None
+* Return         : 0 = equal, 1 = differs
+*******************************************************************************/
+uint8_t FLASH_Verify( uint8_t *pbuf, uint32_t address, uint32_t len )
+{
+    uint32_t word;
+    uint8_t  fill;
+
+    CRC_ResetDR( );
+    word = 0;
+    fill = 0;
+    FLASH_CRC_Feed( pbuf, len, &word, &fill );
+    return FLASH_Verify_Readback( address, len, FLASH_CRC_End( word, fill ) );
+}
+
+/*******************************************************************************
+* Function Name  : W25XXX_WR_Block
+* Description    : W25XXX block write. With DEF_FLASH_WRITE_VERIFY each page
+*                  goes through the CRC unit while the chip programs it, the
+*                  block is then read back and a mismatch is programmed again
+*                  up to DEF_FLASH_VERIFY_RETRY times.
+* Input          : address
+*                  len
+*                  *pbuf
+* Output         : None
+* Return         : 0 = success, 1 = verify failed
+*******************************************************************************/
+uint8_t W25XXX_WR_Block( uint8_t *pbuf, uint32_t address, uint32_t len )
+{
+    uint32_t count, offset;
+#if DEF_FLASH_WRITE_VERIFY
+    uint32_t word;
+    uint8_t  fill, retry;
+
+    for( retry = 0; ; retry++ )
+    {
+        CRC_ResetDR( );
+        word = 0;
+        fill = 0;
+#endif
+        /* Split at page boundaries, the page size comes from FLASH_IC_Check */
+        for( offset = 0; offset < len; offset += count )
+        {
+            count = Flash_Geometry.Page_Size - ( ( address + offset ) % Flash_Geometry.Page_Size );
+            if( count > len - offset )
             {
-                W25XXX_WR_Page( pbuf, address, SPI_FLASH_PageSize );
-                address +=  SPI_FLASH_PageSize;
-                pbuf += SPI_FLASH_PageSize;
+                count = len - offset;
             }
-            W25XXX_WR_Page( pbuf, address, NumOfSingle );
+            FLASH_Job_Wait_Step( 0 );
+            W25XXX_WR_Page_Start( pbuf + offset, address + offset, count );
+#if DEF_FLASH_WRITE_VERIFY
+            FLASH_CRC_Feed( pbuf + offset, count, &word, &fill );
+#endif
+            FLASH_Wait_Ready( );
+        }
+#if DEF_FLASH_WRITE_VERIFY
+        if( FLASH_Verify_Readback( address, len, FLASH_CRC_End( word, fill ) ) == 0 )
+        {
+            return 0;
+        }
+        if( retry >= DEF_FLASH_VERIFY_RETRY )
+        {
+            return 1;
+        }
+    }
+#else
+    return 0;
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Read_SFDP
+* Description    : Read the Serial Flash Discoverable Parameters area
+* Input          : address - SFDP address
+*                  *pbuf
+*                  len
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Read_SFDP( uint32_t address, uint8_t *pbuf, uint32_t len )
+{
+    uint8_t  buf[ 5 ];
+
+    buf[ 0 ] = CMD_FLASH_READ_SFDP;
+    buf[ 1 ] = (uint8_t)( address >> 16 );
+    buf[ 2 ] = (uint8_t)( address >> 8 );
+    buf[ 3 ] = (uint8_t)address;
+    buf[ 4 ] = DEF_DUMMY_BYTE;
+    PIN_FLASH_CS_LOW( );
+    spi_xfer( buf, NULL, 5 );
+    spi_xfer( NULL, pbuf, len );
+    PIN_FLASH_CS_HIGH( );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_SFDP_Parse
+* Description    : Fill the geometry from the JEDEC Basic Flash Parameter Table
+* Input          : *geo
+* Output         : *geo, only changed when a valid table is found
+* Return         : 0 = success, 1 = no SFDP support
+*******************************************************************************/
+uint8_t FLASH_SFDP_Parse( FLASH_GEOMETRY *geo )
+{
+    uint8_t  hdr[ 16 ];
+    uint32_t bfpt[ DEF_SFDP_BFPT_MAX_DWORDS ];
+    uint32_t ptr, dw, bits;
+    uint8_t  nph, i, n, len, size;
+
+    FLASH_Read_SFDP( 0, hdr, 8 );
+    if( ( (uint32_t)hdr[ 0 ] | ( (uint32_t)hdr[ 1 ] << 8 ) | ( (uint32_t)hdr[ 2 ] << 16 ) | ( (uint32_t)hdr[ 3 ] << 24 ) )
+        != DEF_SFDP_SIGNATURE )
+    {
+        return 1;
+    }
+    nph = hdr[ 6 ] + 1;
+
+    /* Find the basic parameter table, the first header must be it */
+    len = 0;
+    ptr = 0;
+    for( i = 0; i < nph; i++ )
+    {
+        FLASH_Read_SFDP( 8 + (uint32_t)i * 8, hdr, 8 );
+        if( ( ( (uint16_t)hdr[ 7 ] << 8 ) | hdr[ 0 ] ) == DEF_SFDP_BFPT_ID )
+        {
+            len = hdr[ 3 ];
+            ptr = (uint32_t)hdr[ 4 ] | ( (uint32_t)hdr[ 5 ] << 8 ) | ( (uint32_t)hdr[ 6 ] << 16 );
+            break;
         }
     }
+    if( len < 9 )
+    {
+        return 1;
+    }
+    if( len > DEF_SFDP_BFPT_MAX_DWORDS )
+    {
+        len = DEF_SFDP_BFPT_MAX_DWORDS;
+    }
+    FLASH_Read_SFDP( ptr, (uint8_t *)bfpt, (uint32_t)len * 4 );              /* little endian core */
+
+    /* DWORD1: 4K erase, fast read support, address bytes */
+    dw = bfpt[ 0 ];
+    geo->Erase_4K_Cmd = ( ( dw & 0x03 ) == 0x01 ) ? (uint8_t)( dw >> 8 ) : 0x00;
+    geo->Addr_Mode = ( dw >> 17 ) & 0x03;
+    if( geo->Addr_Mode > DEF_FLASH_ADDR_4B )
+    {
+        geo->Addr_Mode = DEF_FLASH_ADDR_3B;
+    }
+
+    /* DWORD2: density in bits */
+    dw = bfpt[ 1 ];
+    if( dw & 0x80000000 )
+    {
+        bits = dw & 0x7FFFFFFF;
+        geo->Capacity = ( bits >= 35 ) ? 0x80000000 : ( ( bits >= 3 ) ? ( (uint32_t)1 << ( bits - 3 ) ) : 0 );
+    }
     else
     {
-        if( NumOfPage == 0 )
+        geo->Capacity = ( dw >> 3 ) + 1;
+    }
+
+    /* DWORD3: 1-1-4, DWORD4: 1-1-2 fast read */
+    geo->Read_114_Cmd = 0x00;
+    geo->Read_112_Cmd = 0x00;
+    if( bfpt[ 0 ] & ( 1 << 22 ) )
+    {
+        geo->Read_114_Cmd = (uint8_t)( bfpt[ 2 ] >> 24 );
+        geo->Read_114_Dummy = ( ( bfpt[ 2 ] >> 16 ) & 0x1F ) + ( ( bfpt[ 2 ] >> 21 ) & 0x07 );
+    }
+    if( bfpt[ 0 ] & ( 1 << 16 ) )
+    {
+        geo->Read_112_Cmd = (uint8_t)( bfpt[ 3 ] >> 8 );
+        geo->Read_112_Dummy = ( bfpt[ 3 ] & 0x1F ) + ( ( bfpt[ 3 ] >> 5 ) & 0x07 );
+    }
+
+    /* DWORD8, DWORD9: erase types, size is 2^N bytes */
+    for( i = 0; i < 4; i++ )
+    {
+        dw = bfpt[ 7 + ( i >> 1 ) ] >> ( ( i & 1 ) * 16 );
+        size = (uint8_t)dw;
+        geo->Erase_Cmd[ i ] = (uint8_t)( dw >> 8 );
+        geo->Erase_Size[ i ] = ( size && ( size < 32 ) ) ? ( (uint32_t)1 << size ) : 0;
+        if( ( geo->Erase_Size[ i ] == 4096 ) && ( geo->Erase_4K_Cmd == 0x00 ) )
         {
-            if( NumOfSingle > count )
-            {
-                temp = NumOfSingle - count;
-                W25XXX_WR_Page( pbuf, address, count );
-                address +=  count;
-                pbuf += count;
-                W25XXX_WR_Page( pbuf, address, temp );
-            }
-            else
-            {
-                W25XXX_WR_Page( pbuf, address, len );
-            }
+            geo->Erase_4K_Cmd = geo->Erase_Cmd[ i ];
         }
-        else
+    }
+    if( geo->Erase_4K_Cmd == 0x00 )
+    {
+        /* The USB disk needs 4K sectors, keep the standard opcode */
+        geo->Erase_4K_Cmd = CMD_FLASH_SECTOR_ERASE;
+    }
+
+    /* DWORD11 (JESD216A): page size is 2^N bytes */
+    geo->Page_Size = SPI_FLASH_PageSize;
+    if( len >= 11 )
+    {
+        n = ( bfpt[ 10 ] >> 4 ) & 0x0F;
+        if( n && ( n <= 8 ) )
         {
-            len -= count;
-            NumOfPage =  len / SPI_FLASH_PageSize;
-            NumOfSingle = len % SPI_FLASH_PageSize;
-            W25XXX_WR_Page( pbuf, address, count );
-            address +=  count;
-            pbuf += count;
-            while( NumOfPage-- )
+            geo->Page_Size = (uint16_t)1 << n;
+        }
+    }
+
+    /* DWORD12, DWORD13 (JESD216B): suspend/resume opcodes */
+    if( len >= 13 )
+    {
+        geo->Suspend_Cmd = 0x00;
+        if( ( bfpt[ 11 ] & 0x80000000 ) == 0 )
+        {
+            geo->Suspend_Cmd = (uint8_t)( bfpt[ 12 ] >> 24 );
+            geo->Resume_Cmd = (uint8_t)( bfpt[ 12 ] >> 16 );
+        }
+    }
+
+    geo->SFDP_Valid = 1;
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_SPI_Set_Prescaler
+* Description    : Change the SPI1 clock prescaler
+* Input          : prescaler - SPI_BaudRatePrescaler_x
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_SPI_Set_Prescaler( uint16_t prescaler )
+{
+    while( SPI_I2S_GetFlagStatus( SPI1, SPI_I2S_FLAG_BSY ) != RESET );
+    SPI_Cmd( SPI1, DISABLE );
+    SPI1->CTLR1 = ( SPI1->CTLR1 & ~SPI_BaudRatePrescaler_256 ) | prescaler;
+    SPI_Cmd( SPI1, ENABLE );
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_SPI_Prescaler_For
+* Description    : Smallest SPI1 prescaler that keeps SCK within a limit
+* Input          : max_hz - highest clock the flash accepts
+* Output         : None
+* Return         : SPI_BaudRatePrescaler_x
+*******************************************************************************/
+static uint16_t FLASH_SPI_Prescaler_For( uint32_t max_hz )
+{
+    RCC_ClocksTypeDef RCC_Clocks;
+    uint16_t prescaler;
+    uint32_t div;
+
+    RCC_GetClocksFreq( &RCC_Clocks );
+    prescaler = SPI_BaudRatePrescaler_2;
+    div = 2;
+    while( ( RCC_Clocks.PCLK2_Frequency / div > max_hz ) && ( prescaler != SPI_BaudRatePrescaler_256 ) )
+    {
+        prescaler += SPI_BaudRatePrescaler_4;
+        div <<= 1;
+    }
+    return prescaler;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Set_Read_Mode
+* Description    : Select the read command used by FLASH_RD_Block_Start and
+*                  set the matching SPI1 clock and high speed receive mode.
+*                  Dual/Quad Output need IO1/IO2/IO3 wired as data inputs;
+*                  they are refused when DEF_FLASH_DATA_LINES is too small
+*                  or the chip does not report the command in SFDP.
+* Input          : mode - DEF_FLASH_READ_xx
+* Output         : None
+* Return         : 0 = success, 1 = mode not supported
+*******************************************************************************/
+uint8_t FLASH_Set_Read_Mode( uint8_t mode )
+{
+    uint16_t prescaler;
+    uint8_t  cmd, dummy;
+
+    switch( mode )
+    {
+        case DEF_FLASH_READ_NORMAL:
+            cmd = CMD_FLASH_READ;
+            dummy = 0;
+            break;
+
+        case DEF_FLASH_READ_FAST:
+            cmd = CMD_FLASH_FAST_READ;
+            dummy = 1;
+            break;
+
+        case DEF_FLASH_READ_DUAL:
+            if( ( DEF_FLASH_DATA_LINES < 2 ) || ( Flash_Geometry.Read_112_Cmd == 0x00 ) )
             {
-                W25XXX_WR_Page( pbuf, address, SPI_FLASH_PageSize );
-                address += SPI_FLASH_PageSize;
-                pbuf += SPI_FLASH_PageSize;
+                return 1;
             }
-            if( NumOfSingle != 0 )
+            cmd = Flash_Geometry.Read_112_Cmd;
+            dummy = ( Flash_Geometry.Read_112_Dummy + 7 ) / 8;
+            break;
+
+        case DEF_FLASH_READ_QUAD:
+            if( ( DEF_FLASH_DATA_LINES < 4 ) || ( Flash_Geometry.Read_114_Cmd == 0x00 ) )
             {
-                W25XXX_WR_Page( pbuf, address, NumOfSingle );
+                return 1;
             }
+            cmd = Flash_Geometry.Read_114_Cmd;
+            dummy = ( Flash_Geometry.Read_114_Dummy + 7 ) / 8;
+            break;
+
+        default:
+            return 1;
+    }
+
+    Flash_Geometry.Read_Cmd = cmd;
+    Flash_Geometry.Read_Dummy = dummy;
+    Flash_Read_Mode = mode;
+
+    /* Never faster than the board passed in FLASH_SPI_Calibrate */
+    if( mode == DEF_FLASH_READ_NORMAL )
+    {
+        SPI1->HSCR &= ~SPI_HSCR_HSRXEN;
+        prescaler = FLASH_SPI_Prescaler_For( DEF_FLASH_NORMAL_MAX_HZ );
+    }
+    else
+    {
+        /* Sample MISO late so the highest clocks read reliably */
+        SPI1->HSCR |= SPI_HSCR_HSRXEN;
+        prescaler = FLASH_SPI_Prescaler_For( DEF_FLASH_FAST_MAX_HZ );
+    }
+    if( prescaler < Flash_SPI_Cal_Prescaler )
+    {
+        prescaler = Flash_SPI_Cal_Prescaler;
+    }
+    FLASH_SPI_Set_Prescaler( prescaler );
+    return 0;
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_SPI_Cal_Check
+* Description    : Read the JEDEC ID, the SFDP header and the signature block
+*                  at the current clock and compare them with the reference
+* Input          : id - reference JEDEC ID
+*                  *sfdp - reference SFDP header, NULL: no SFDP
+* Output         : None
+* Return         : 0 = all equal, 1 = mismatch
+*******************************************************************************/
+static uint8_t FLASH_SPI_Cal_Check( uint32_t id, const uint8_t *sfdp )
+{
+    uint8_t  buf[ 32 ];
+    uint32_t i;
+
+    if( FLASH_ReadJEDECID( ) != id )
+    {
+        return 1;
+    }
+    if( sfdp )
+    {
+        FLASH_Read_SFDP( 0, buf, 8 );
+        if( memcmp( buf, sfdp, 8 ) != 0 )
+        {
+            return 1;
+        }
+    }
+    for( i = 0; i < DEF_FLASH_SPI_CAL_LEN; i += sizeof( buf ) )
+    {
+        FLASH_RD_Block_Start( DEF_FLASH_SPI_CAL_ADDR + i );
+        FLASH_RD_Block( buf, sizeof( buf ) );
+        FLASH_RD_Block_End( );
+        if( memcmp( buf, &Flash_Job_Cmp_Buf[ i ], sizeof( buf ) ) != 0 )
+        {
+            return 1;
         }
     }
+    return 0;
 }
 
+/*******************************************************************************
+* Function Name  : FLASH_SPI_Calibrate
+* Description    : Find the fastest SPI1 clock this board reads reliably.
+*                  The JEDEC ID, the SFDP header and the signature block at
+*                  DEF_FLASH_SPI_CAL_ADDR are read once at
+*                  DEF_FLASH_SPI_CAL_REF, then the prescaler steps down
+*                  towards the limit of the read mode; each step must read
+*                  them back DEF_FLASH_SPI_CAL_PASSES times unchanged. The
+*                  last clean step is kept in Flash_SPI_Cal_Prescaler and
+*                  later FLASH_Set_Read_Mode calls do not go faster.
+*                  Call it after FLASH_IC_Check has selected the read mode,
+*                  with no job queued.
+* Input          : None
+* Output         : None
+* Return         : prescaler in use, SPI_BaudRatePrescaler_x
+*******************************************************************************/
+uint16_t FLASH_SPI_Calibrate( void )
+{
+    RCC_ClocksTypeDef RCC_Clocks;
+    uint8_t  sfdp[ 8 ];
+    uint16_t limit, prescaler, best;
+    uint32_t id;
+    uint8_t  i;
+
+    /* Fastest clock the read mode allows */
+    Flash_SPI_Cal_Prescaler = SPI_BaudRatePrescaler_2;
+    FLASH_Set_Read_Mode( Flash_Read_Mode );
+    limit = SPI1->CTLR1 & SPI_BaudRatePrescaler_256;
 
+    /* Reference */
+    best = ( limit > DEF_FLASH_SPI_CAL_REF ) ? limit : DEF_FLASH_SPI_CAL_REF;
+    FLASH_SPI_Set_Prescaler( best );
+    id = FLASH_ReadJEDECID( );
+    if( Flash_Geometry.SFDP_Valid )
+    {
+        FLASH_Read_SFDP( 0, sfdp, sizeof( sfdp ) );
+    }
+    FLASH_RD_Block_Start( DEF_FLASH_SPI_CAL_ADDR );
+    FLASH_RD_Block( Flash_Job_Cmp_Buf, DEF_FLASH_SPI_CAL_LEN );
+    FLASH_RD_Block_End( );
+
+    for( prescaler = best; prescaler > limit; )
+    {
+        prescaler -= SPI_BaudRatePrescaler_4;
+        FLASH_SPI_Set_Prescaler( prescaler );
+        for( i = 0; i < DEF_FLASH_SPI_CAL_PASSES; i++ )
+        {
+            if( FLASH_SPI_Cal_Check( id, Flash_Geometry.SFDP_Valid ? sfdp : NULL ) )
+            {
+                break;
+            }
+        }
+        if( i < DEF_FLASH_SPI_CAL_PASSES )
+        {
+            break;
+        }
+        best = prescaler;
+    }
+
+    Flash_SPI_Cal_Prescaler = best;
+    FLASH_SPI_Set_Prescaler( best );
+    RCC_GetClocksFreq( &RCC_Clocks );
+    printf("Flash_SPI_Clock: %u Hz\n", (unsigned)( RCC_Clocks.PCLK2_Frequency >> ( ( best >> 3 ) + 1 ) ) );
+    return best;
+}
 
 /*******************************************************************************
 * Function Name  : FLASH_IC_Check
@@ -412,6 +2657,32 @@ void FLASH_IC_Check( void )
     Flash_Sector_Count = 0x00;
     Flash_Sector_Size = 0x00;
 
+    /* Winbond W25Q parts suspend erases, older W25X parts do not */
+    if( ( ( Flash_ID >> 16 ) == 0xEF ) && ( ( ( Flash_ID >> 8 ) & 0xFF ) != 0x30 ) )
+    {
+        Flash_Geometry.Suspend_Cmd = CMD_FLASH_SUSPEND;
+        Flash_Geometry.Resume_Cmd = CMD_FLASH_RESUME;
+    }
+
+    /* Prefer the parameters the chip reports about itself */
+    if( ( Flash_ID != 0xFFFFFF ) && ( Flash_ID != 0x000000 ) && ( FLASH_SFDP_Parse( &Flash_Geometry ) == 0 ) )
+    {
+        printf("Flash_SFDP: %u bytes, page %u, read %02x, 4K erase %02x\n",
+               (unsigned)Flash_Geometry.Capacity, Flash_Geometry.Page_Size,
+               Flash_Geometry.Read_Cmd, Flash_Geometry.Erase_4K_Cmd );
+        if( Flash_Geometry.Capacity >= DEF_UDISK_SECTOR_SIZE )
+        {
+            Flash_Sector_Count = Flash_Geometry.Capacity / DEF_UDISK_SECTOR_SIZE;
+            Flash_Sector_Size = DEF_UDISK_SECTOR_SIZE;
+            FLASH_Addr_Mode_Select( );
+            FLASH_Set_Read_Mode( DEF_FLASH_READ_MODE );
+#if DEF_FLASH_SPI_CAL_EN
+            FLASH_SPI_Calibrate( );
+#endif
+            return;
+        }
+    }
+
     switch( Flash_ID )
     {
         /* W25XXX */
@@ -458,9 +2729,17 @@ void FLASH_IC_Check( void )
             count = 256;
             break;
         default:
-            if( ( Flash_ID != 0xFFFFFFFF ) && ( Flash_ID != 0x00000000 ) )
+            if( ( Flash_ID != 0xFFFFFF ) && ( Flash_ID != 0x000000 ) )
             {
-                count = 16;
+                /* JEDEC capacity byte is log2 of the size in bytes */
+                if( ( ( Flash_ID & 0xFF ) >= 0x11 ) && ( ( Flash_ID & 0xFF ) <= 0x19 ) )
+                {
+                    count = ( (uint32_t)1 << ( Flash_ID & 0xFF ) ) / ( 1024 * 1024 / 8 );
+                }
+                else
+                {
+                    count = 16;
+                }
             }
             else
             {
@@ -472,8 +2751,14 @@ void FLASH_IC_Check( void )
 
     if( count )
     {
+        Flash_Geometry.Capacity = count;
         Flash_Sector_Count = count / DEF_UDISK_SECTOR_SIZE;
         Flash_Sector_Size = DEF_UDISK_SECTOR_SIZE;
+        FLASH_Addr_Mode_Select( );
+        FLASH_Set_Read_Mode( DEF_FLASH_READ_MODE );
+#if DEF_FLASH_SPI_CAL_EN
+        FLASH_SPI_Calibrate( );
+#endif
     }
     else
     {
@@ -482,3 +2767,91 @@ void FLASH_IC_Check( void )
     }
 }
 
+/*******************************************************************************
+* Function Name  : FLASH_Stats_Reset
+* Description    : Clear Flash_Stats
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Stats_Reset( void )
+{
+#if DEF_FLASH_STATS_EN
+    memset( &Flash_Stats, 0, sizeof( Flash_Stats ) );
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : FLASH_Stats_Dump
+* Description    : Print Flash_Stats: byte counts, per operation count and
+*                  busy time, latency histograms and the most erased sectors
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void FLASH_Stats_Dump( void )
+{
+#if DEF_FLASH_STATS_EN
+    static const char *const name[ DEF_FLASH_OP_NUM ] = { "read", "prog", "erase4K", "erase32K", "erase64K", "eraseChip" };
+    uint32_t mhz, sector, hot, count, last;
+    uint8_t  op, n;
+
+    mhz = SystemCoreClock / 1000000;
+    printf("Flash_Stats: read %u KByte, programmed %u KByte\n",
+           (unsigned)( Flash_Stats.Read_Bytes >> 10 ), (unsigned)( Flash_Stats.Prog_Bytes >> 10 ) );
+    for( op = 0; op < DEF_FLASH_OP_NUM; op++ )
+    {
+        if( Flash_Stats.Op_Count[ op ] == 0 )
+        {
+            continue;
+        }
+        printf("%-9s %8u ops, busy total %u ms, max %u us\n", name[ op ], (unsigned)Flash_Stats.Op_Count[ op ],
+               (unsigned)( Flash_Stats.Busy_Total[ op ] / mhz / 1000 ), (unsigned)( Flash_Stats.Busy_Max[ op ] / mhz ) );
+        printf("          latency us:");
+        for( n = 0; n < DEF_FLASH_STATS_BUCKETS; n++ )
+        {
+            if( Flash_Stats.Latency_Hist[ op ][ n ] )
+            {
+                printf(" <%u:%u", (unsigned)( 1 << n ), (unsigned)Flash_Stats.Latency_Hist[ op ][ n ] );
+            }
+        }
+        printf("\n");
+    }
+    if( Flash_Stats.Line_Hits || Flash_Stats.Line_Misses )
+    {
+        printf("line cache %u hits, %u misses\n", (unsigned)Flash_Stats.Line_Hits, (unsigned)Flash_Stats.Line_Misses );
+    }
+    if( Flash_Stats.Cache_Hits || Flash_Stats.Cache_Misses )
+    {
+        printf("sector cache %u hits, %u misses\n", (unsigned)Flash_Stats.Cache_Hits, (unsigned)Flash_Stats.Cache_Misses );
+    }
+
+    /* Most erased sectors, highest first */
+    last = 0x10000;
+    hot = 0;
+    while( hot < DEF_FLASH_STATS_HOT )
+    {
+        count = 0;
+        for( sector = 0; sector < DEF_FLASH_STATS_SECTORS; sector++ )
+        {
+            if( ( Flash_Stats.Erase_Count[ sector ] > count ) && ( Flash_Stats.Erase_Count[ sector ] < last ) )
+            {
+                count = Flash_Stats.Erase_Count[ sector ];
+            }
+        }
+        if( count == 0 )
+        {
+            break;
+        }
+        for( sector = 0; ( sector < DEF_FLASH_STATS_SECTORS ) && ( hot < DEF_FLASH_STATS_HOT ); sector++ )
+        {
+            if( Flash_Stats.Erase_Count[ sector ] == count )
+            {
+                printf("hot sector %u (0x%06x): %u erases\n", (unsigned)sector, (unsigned)( sector * SPI_FLASH_SectorSize ), (unsigned)count );
+                hot++;
+            }
+        }
+        last = count;
+    }
+#endif
+}
@@ -30,16 +30,40 @@
 /* SPI Serial Flash OPERATION INSTRUCTIONS */
 #define CMD_FLASH_READ             0x03                                         /* Read Memory at 25 MHz */
 #define CMD_FLASH_SECTOR_ERASE     0x20                                         /* Erase 4 KByte of memory array */
+#define CMD_FLASH_BLOCK_ERASE_32K  0x52                                         /* Erase 32 KByte block of memory array */
+#define CMD_FLASH_BLOCK_ERASE_64K  0xD8                                         /* Erase 64 KByte block of memory array */
+#define CMD_FLASH_CHIP_ERASE       0xC7                                         /* Erase Full Memory Array */
 #define CMD_FLASH_BYTE_PROG        0x02                                         /* To Program One Data Byte */
 #define CMD_FLASH_RDSR             0x05                                         /* Read-Status-Register */
+#define CMD_FLASH_RDSR2            0x35                                         /* Read-Status-Register-2 */
+#define CMD_FLASH_SUSPEND          0x75                                         /* Erase/Program Suspend */
+#define CMD_FLASH_RESUME           0x7A                                         /* Erase/Program Resume */
 #define CMD_FLASH_EWSR             0x50                                         /* Enable-Write-Status-Register */
 #define CMD_FLASH_WREN             0x06                                         /* Write-Enable */
 #define CMD_FLASH_WRDI             0x04                                         /* Write-Disable */
 #define CMD_FLASH_JEDEC_ID         0x9F                                         /* JEDEC ID read */
 #define CMD_FLASH_UNIQUE_ID        0x4B                                         /* UNIQUE ID read */
+#define CMD_FLASH_FAST_READ        0x0B                                         /* Fast Read, 8 dummy clocks */
+#define CMD_FLASH_READ_SFDP        0x5A                                         /* Read SFDP table, 8 dummy clocks */
+#define CMD_FLASH_DUAL_READ        0x3B                                         /* Fast Read Dual Output */
+#define CMD_FLASH_QUAD_READ        0x6B                                         /* Fast Read Quad Output */
+#define CMD_FLASH_READ_4B          0x13                                         /* Read Memory, 4-byte address */
+#define CMD_FLASH_FAST_READ_4B     0x0C                                         /* Fast Read, 4-byte address */
+#define CMD_FLASH_DUAL_READ_4B     0x3C                                         /* Fast Read Dual Output, 4-byte address */
+#define CMD_FLASH_QUAD_READ_4B     0x6C                                         /* Fast Read Quad Output, 4-byte address */
+#define CMD_FLASH_BYTE_PROG_4B     0x12                                         /* Page Program, 4-byte address */
+#define CMD_FLASH_SECTOR_ERASE_4B  0x21                                         /* Erase 4 KByte, 4-byte address */
+#define CMD_FLASH_BLOCK_ERASE_32K_4B 0x5C                                       /* Erase 32 KByte, 4-byte address */
+#define CMD_FLASH_BLOCK_ERASE_64K_4B 0xDC                                       /* Erase 64 KByte, 4-byte address */
+#define CMD_FLASH_ENTER_4B         0xB7                                         /* Enter 4-byte address mode */
+#define CMD_FLASH_EXIT_4B          0xE9                                         /* Exit 4-byte address mode */
+#define CMD_FLASH_POWER_DOWN       0xB9                                         /* Deep power-down */
+#define CMD_FLASH_RELEASE_PD       0xAB                                         /* Release from deep power-down */
+#define CMD_FLASH_SET_BURST_WRAP   0x77                                         /* Set Burst with Wrap, Quad I/O reads only */
 
 /******************************************************************************/
 #define DEF_DUMMY_BYTE             0xFF
+#define DEF_SPI_XFER_16B_MIN       4                                            /* spi_xfer: even lengths from here use 16-bit frames */
 
 /******************************************************************************/
 /* FLASH Parameter Definition */
@@ -47,6 +71,166 @@
 #define SPI_FLASH_PageSize         256
 #define SPI_FLASH_PerWritePageSize 256
 
+/******************************************************************************/
+/* Read Mode Definition */
+#define DEF_FLASH_READ_NORMAL      0x00                                         /* Read (0x03), no dummy */
+#define DEF_FLASH_READ_FAST        0x01                                         /* Fast Read (0x0B), 1 dummy byte */
+#define DEF_FLASH_READ_DUAL        0x02                                         /* Fast Read Dual Output (0x3B) */
+#define DEF_FLASH_READ_QUAD        0x03                                         /* Fast Read Quad Output (0x6B) */
+
+#define DEF_FLASH_READ_MODE        DEF_FLASH_READ_FAST                          /* Mode selected by FLASH_IC_Check */
+#define DEF_FLASH_DATA_LINES       1                                            /* Data lines wired to the flash, SPI1 has MISO only */
+#define DEF_FLASH_NORMAL_MAX_HZ    50000000                                     /* Read (0x03) clock limit */
+#define DEF_FLASH_FAST_MAX_HZ      104000000                                    /* Fast Read clock limit */
+
+/* SPI clock calibration, see FLASH_SPI_Calibrate */
+#define DEF_FLASH_SPI_CAL_EN       1                                            /* 1: FLASH_IC_Check tunes the SPI1 prescaler */
+#define DEF_FLASH_SPI_CAL_REF      SPI_BaudRatePrescaler_64                     /* Reference reads, slow enough for any wiring */
+#define DEF_FLASH_SPI_CAL_ADDR     0x000000                                     /* Signature block compared at each step */
+#define DEF_FLASH_SPI_CAL_LEN      256                                          /* Signature block length, multiple of 32, <= DEF_FLASH_UPD_CMP_LEN */
+#define DEF_FLASH_SPI_CAL_PASSES   4                                            /* Clean reads needed to accept a prescaler */
+
+/******************************************************************************/
+/* SFDP (JESD216) Definition */
+#define DEF_SFDP_SIGNATURE         0x50444653                                   /* "SFDP" */
+#define DEF_SFDP_BFPT_ID           0xFF00                                       /* JEDEC Basic Flash Parameter Table */
+#define DEF_SFDP_BFPT_MAX_DWORDS   16                                           /* DWORDs parsed from the BFPT */
+#define DEF_FLASH_SR2_SUS          0x80                                         /* Status Register-2 suspend bit */
+
+/* Address bytes */
+#define DEF_FLASH_ADDR_3B          0x00                                         /* 3-byte address only */
+#define DEF_FLASH_ADDR_3B_4B       0x01                                         /* 3-byte or 4-byte address */
+#define DEF_FLASH_ADDR_4B          0x02                                         /* 4-byte address only */
+#define DEF_FLASH_3B_LIMIT         0x1000000                                    /* Highest size reached with 3 address bytes */
+#define DEF_FLASH_4B_OPCODES       1                                            /* Parts over 16 MByte: 1 = 0x13/0x12/0x21.. opcodes, 0 = enter 4-byte mode (0xB7) */
+
+/* Flash geometry and command set */
+typedef struct _FLASH_GEOMETRY
+{
+    uint8_t  SFDP_Valid;                                                        /* 1: filled from SFDP, 0: from JEDEC ID */
+    uint8_t  Addr_Mode;                                                         /* DEF_FLASH_ADDR_xx */
+    uint16_t Page_Size;                                                         /* Program page size */
+    uint32_t Capacity;                                                          /* Total size in bytes */
+    uint8_t  Erase_Cmd[ 4 ];                                                    /* Erase type opcodes */
+    uint32_t Erase_Size[ 4 ];                                                   /* Erase type sizes, 0: not supported */
+    uint8_t  Erase_4K_Cmd;                                                      /* 4 KByte erase opcode */
+    uint8_t  Read_Cmd;                                                          /* Read opcode used by FLASH_RD_Block_Start */
+    uint8_t  Read_Dummy;                                                        /* Dummy bytes after the address */
+    uint8_t  Read_112_Cmd;                                                      /* 1-1-2 Fast Read opcode, 0: not supported */
+    uint8_t  Read_112_Dummy;                                                    /* 1-1-2 dummy + mode clocks */
+    uint8_t  Read_114_Cmd;                                                      /* 1-1-4 Fast Read opcode, 0: not supported */
+    uint8_t  Read_114_Dummy;                                                    /* 1-1-4 dummy + mode clocks */
+    uint8_t  Suspend_Cmd;                                                       /* Erase suspend opcode, 0: not supported */
+    uint8_t  Resume_Cmd;                                                        /* Erase resume opcode */
+    uint8_t  Addr_Bytes;                                                        /* Address bytes sent, 3 or 4 */
+    uint8_t  Addr_4B_Cmd;                                                       /* 1: send the 4-byte address opcodes */
+}FLASH_GEOMETRY;
+
+/******************************************************************************/
+/* SPI FLASH DMA Definition */
+#define DEF_FLASH_DMA_EN           1                                            /* 1: bulk transfers use SPI1 DMA */
+#define DEF_FLASH_DMA_MIN_LEN      16                                           /* Shorter blocks are polled byte by byte */
+#define DEF_FLASH_DMA_MAX_LEN      65535                                        /* Largest count of one transfer, CNTR is 16 bits */
+#define DEF_FLASH_DMA_RX_CH        DMA1_Channel2                                /* SPI1_RX DMA channel */
+#define DEF_FLASH_DMA_TX_CH        DMA1_Channel3                                /* SPI1_TX DMA channel */
+
+/* Read stream, see FLASH_Stream_Read */
+#define DEF_FLASH_STREAM_SKIP_MAX  8                                            /* Forward gaps clocked past instead of a new command */
+
+/* Line cache, see FLASH_Line_Read */
+#define DEF_FLASH_LINE_EN          1                                            /* 1: small metadata reads go through the line cache */
+#define DEF_FLASH_LINE_SIZE        32                                           /* Aligned line read per miss: 8, 16, 32 or 64 */
+#define DEF_FLASH_LINE_NUM         16                                           /* Lines kept, power of 2 */
+
+/* Sector cache, see FLASH_Cache_Read. SETS x WAYS x 4 KByte of the 128 KByte RAM in Ld/Link.ld */
+#define DEF_FLASH_CACHE_EN         1                                            /* 1: keep whole 4 KByte sectors in RAM */
+#define DEF_FLASH_CACHE_SETS       4                                            /* Sets, power of 2, picked by sector number */
+#define DEF_FLASH_CACHE_WAYS       4                                            /* Sectors per set, least recently used replaced */
+#define DEF_FLASH_CACHE_MAX_KB     96                                           /* RAM the cache may take, checked at build time */
+
+/******************************************************************************/
+/* SPI FLASH Power Definition, see FLASH_Job_Poll */
+#define DEF_FLASH_PD_EN            1                                            /* 1: deep power-down when idle */
+#define DEF_FLASH_PD_IDLE_MS       50                                           /* Idle time before power-down */
+#define DEF_FLASH_PD_WAKE_US       3                                            /* tRES1, release to first command */
+
+/* Power state */
+#define DEF_FLASH_PWR_ACTIVE       0x00
+#define DEF_FLASH_PWR_DOWN         0x01                                         /* 0xB9 sent */
+#define DEF_FLASH_PWR_WAKING       0x02                                         /* 0xAB sent, tRES1 running */
+
+/******************************************************************************/
+/* SPI FLASH Statistics Definition, see FLASH_Stats_Dump */
+#define DEF_FLASH_STATS_EN         1                                            /* 1: keep Flash_Stats */
+#define DEF_FLASH_STATS_SECTORS    1024                                         /* 4 KByte sectors with an erase counter */
+#define DEF_FLASH_STATS_BUCKETS    24                                           /* Latency buckets, n: 2^(n-1) <= us < 2^n */
+#define DEF_FLASH_STATS_HOT        8                                            /* Most erased sectors printed */
+
+/* Operation types */
+#define DEF_FLASH_OP_READ          0                                            /* Block read, start to end */
+#define DEF_FLASH_OP_PROG          1                                            /* Page program */
+#define DEF_FLASH_OP_ERASE_4K      2
+#define DEF_FLASH_OP_ERASE_32K     3
+#define DEF_FLASH_OP_ERASE_64K     4
+#define DEF_FLASH_OP_ERASE_CHIP    5
+#define DEF_FLASH_OP_NUM           6
+
+/* Counters, times are in RISC-V core cycles (mcycle) */
+typedef struct _FLASH_STATS
+{
+    uint64_t Read_Bytes;                                                        /* Array bytes read */
+    uint64_t Prog_Bytes;                                                        /* Array bytes programmed */
+    uint32_t Op_Count[ DEF_FLASH_OP_NUM ];                                      /* Operations issued */
+    uint64_t Busy_Total[ DEF_FLASH_OP_NUM ];                                    /* Issue to WIP clear, suspended time excluded */
+    uint32_t Busy_Max[ DEF_FLASH_OP_NUM ];                                      /* Longest single operation */
+    uint32_t Latency_Hist[ DEF_FLASH_OP_NUM ][ DEF_FLASH_STATS_BUCKETS ];       /* Issue to ready, log2 of us */
+    uint16_t Erase_Count[ DEF_FLASH_STATS_SECTORS ];                            /* Erases per 4 KByte sector */
+    uint32_t Line_Hits;                                                         /* FLASH_Line_Read lines found cached */
+    uint32_t Line_Misses;                                                       /* Lines read from the chip */
+    uint32_t Cache_Hits;                                                        /* FLASH_Cache_Read sectors found cached */
+    uint32_t Cache_Misses;                                                      /* Sectors read from the chip */
+}FLASH_STATS;
+
+/* DMA transfer status */
+#define DEF_FLASH_DMA_IDLE         0x00                                         /* No DMA transfer running */
+#define DEF_FLASH_DMA_READ         0x01                                         /* Block read running */
+#define DEF_FLASH_DMA_WRITE        0x02                                         /* Page program data running */
+
+/******************************************************************************/
+/* Write Verify Definition, see FLASH_Verify */
+#define DEF_FLASH_WRITE_VERIFY     1                                            /* 1: written data is read back and checked by the CRC unit */
+#define DEF_FLASH_VERIFY_RETRY     1                                            /* Times a failed write is redone */
+
+/******************************************************************************/
+/* Flash Job Engine Definition */
+#define DEF_FLASH_JOB_QUEUE_SIZE   8                                            /* Queued erase/program jobs, power of 2 */
+#define DEF_FLASH_USER_IRQn        USBFS_IRQn                                   /* Interrupt that also uses the flash */
+#define DEF_FLASH_RESUME_MIN_US    500                                          /* Erase time between resume and the next suspend, at least tSUS (20 us) */
+
+/* Job type */
+#define DEF_FLASH_JOB_ERASE        0x01                                         /* Erase, largest blocks that fit */
+#define DEF_FLASH_JOB_PROG         0x02                                         /* Program any length */
+#define DEF_FLASH_JOB_UPDATE       0x03                                         /* Compare, then erase/program as needed */
+
+/* Update job state */
+#define DEF_FLASH_UPD_COMPARE      0x00                                         /* Reading back, only 1->0 changes so far */
+#define DEF_FLASH_UPD_ERASE        0x01                                         /* Reading back, a 0->1 change was seen */
+#define DEF_FLASH_UPD_PROG         0x02                                         /* Programming the changed pages */
+#define DEF_FLASH_UPD_CMP_LEN      256                                          /* Bytes read back per poll step */
+
+typedef struct _FLASH_JOB
+{
+    uint8_t  Type;                                                              /* DEF_FLASH_JOB_xx */
+    uint8_t  *pBuf;                                                             /* Program data, kept until Done */
+    uint32_t Address;                                                           /* Start address */
+    uint32_t Len;                                                               /* Program length */
+    uint32_t Offset;                                                            /* Bytes already handled */
+    uint8_t  State;                                                             /* DEF_FLASH_UPD_xx, update jobs only */
+    uint32_t Pages;                                                             /* Bit n: page n still to program */
+    uint8_t  Retry;                                                             /* Failed verifies so far */
+    void ( *Done )( uint8_t *pbuf, uint8_t status );                            /* Completion callback, may be NULL; status 1: verify failed */
+}FLASH_JOB;
+
 /******************************************************************************/
 /* SPI FLASH Type */
 #define DEF_TYPE_W25XXX            0                                            /* W25XXX */
@@ -76,23 +260,69 @@ extern volatile uint8_t  Flash_Type;
 extern volatile uint32_t Flash_ID;                                              /* FLASH ID */
 extern volatile uint32_t Flash_Sector_Count;                                    /* FLASH sector number */
 extern volatile uint16_t Flash_Sector_Size;                                     /* FLASH sector size */
+extern volatile uint8_t  Flash_DMA_Status;                                      /* Current DMA transfer status */
+extern FLASH_GEOMETRY    Flash_Geometry;                                        /* Detected flash geometry */
+extern volatile uint8_t  Flash_Read_Mode;                                       /* Current read mode */
+#if DEF_FLASH_STATS_EN
+extern FLASH_STATS       Flash_Stats;                                           /* Operation statistics */
+#endif
+extern volatile uint32_t Flash_Verify_Errors;                                   /* Writes that read back wrong */
+extern volatile uint16_t Flash_SPI_Cal_Prescaler;                               /* Fastest prescaler passed by FLASH_SPI_Calibrate */
 
 /******************************************************************************/
 /* external functions */
 extern void FLASH_Port_Init( void );
+extern void spi_xfer( const uint8_t *tx, uint8_t *rx, uint32_t len );
 extern uint8_t SPI_FLASH_SendByte( uint8_t byte );
 extern uint8_t SPI_FLASH_ReadByte( void );
 extern uint32_t FLASH_ReadJEDECID( void );
-extern uint32_t FLASH_ReadUNIQUEID( void );
+extern uint64_t FLASH_ReadUNIQUEID( void );
 extern void FLASH_WriteEnable( void );
 extern void FLASH_WriteDisable( void );
 extern uint8_t FLASH_ReadStatusReg( void );
+extern uint8_t FLASH_ReadStatusReg2( void );
+extern uint8_t FLASH_Suspend( void );
+extern void FLASH_Resume( void );
+extern void FLASH_Power_Down( void );
+extern void FLASH_Wake( void );
 extern void FLASH_IC_Check( void );
+extern void FLASH_Read_SFDP( uint32_t address, uint8_t *pbuf, uint32_t len );
+extern uint8_t FLASH_SFDP_Parse( FLASH_GEOMETRY *geo );
+extern void FLASH_SPI_Set_Prescaler( uint16_t prescaler );
+extern uint8_t FLASH_Set_Read_Mode( uint8_t mode );
+extern uint16_t FLASH_SPI_Calibrate( void );
 extern void FLASH_Erase_Sector( uint32_t address );
+extern void FLASH_Erase_Block_32K( uint32_t address );
+extern void FLASH_Erase_Block_64K( uint32_t address );
+extern void FLASH_Erase_Chip( void );
+extern uint8_t FLASH_Erase_Range( uint32_t address, uint32_t len );
 extern void FLASH_RD_Block_Start( uint32_t address );
 extern void FLASH_RD_Block( uint8_t *pbuf, uint32_t len );
 extern void FLASH_RD_Block_End( void );
-extern void W25XXX_WR_Block( uint8_t *pbuf, uint32_t address, uint32_t len );
+extern void FLASH_Stream_Read( uint32_t address, uint8_t *pbuf, uint32_t len );
+extern void FLASH_Stream_Close( void );
+extern void FLASH_RD_Line( uint32_t address, uint8_t *pbuf );
+extern void FLASH_Line_Read( uint32_t address, uint8_t *pbuf, uint32_t len );
+extern void FLASH_Cache_Read( uint32_t address, uint8_t *pbuf, uint32_t len );
+extern void FLASH_Cache_Flush( void );
+extern void FLASH_RD_Block_DMA( uint8_t *pbuf, uint32_t len );
+extern uint8_t FLASH_DMA_Check( void );
+extern void FLASH_DMA_Wait( void );
+extern void FLASH_DMA_Set_Callback( void ( *callback )( uint8_t status ) );
+extern void W25XXX_WR_Page( uint8_t *pbuf, uint32_t address, uint32_t len );
+extern void W25XXX_WR_Page_DMA( uint8_t *pbuf, uint32_t address, uint32_t len );
+extern uint8_t FLASH_Check_Busy( void );
+extern uint8_t FLASH_Job_Erase( uint32_t address, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern uint8_t FLASH_Job_Erase_Range( uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern uint8_t FLASH_Job_Program( uint8_t *pbuf, uint32_t address, uint32_t len, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern uint8_t FLASH_Job_Update( uint8_t *pbuf, uint32_t address, void ( *done )( uint8_t *pbuf, uint8_t status ) );
+extern void FLASH_Job_Poll( void );
+extern uint8_t FLASH_Job_Pending( void );
+extern void FLASH_Job_Flush( void );
+extern uint8_t W25XXX_WR_Block( uint8_t *pbuf, uint32_t address, uint32_t len );
+extern uint8_t FLASH_Verify( uint8_t *pbuf, uint32_t address, uint32_t len );
+extern void FLASH_Stats_Reset( void );
+extern void FLASH_Stats_Dump( void );
 
 #ifdef __cplusplus
 }
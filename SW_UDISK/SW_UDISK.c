@@ -13,13 +13,14 @@
 /******************************************************************************/
 /* Header Files */
 #include <SPI_FLASH.h>
+#include <BLOCK_DEV.h>
 #include <SW_UDISK.h>
 #include "ch32v30x_usbfs_device.h"
 #include "ch32v30x_spi.h"
 /******************************************************************************/
 /* Variable Definition */
 
-__attribute__ ((aligned(4))) uint8_t  UDisk_Down_Buffer[DEF_FLASH_SECTOR_SIZE];
+__attribute__ ((aligned(4))) uint8_t  UDisk_Down_Buffer[DEF_UDISK_DOWN_BUF_NUM][DEF_FLASH_SECTOR_SIZE];
 __attribute__ ((aligned(4))) uint8_t  UDisk_Pack_Buffer[DEF_UDISK_PACK_64];
 
 /******************************************************************************/
@@ -154,6 +155,34 @@ volatile uint16_t UDISK_Pack_Size = DEF_UDISK_PACK_64;
 BULK_ONLY_CMD mBOC;
 uint8_t   *pEndp2_Buf;
 
+/* Sector write buffers handed to the flash job engine */
+volatile uint8_t  Udisk_Down_Wait = 0x00;                                       /* EP3 held at NAK, no free buffer */
+volatile uint8_t  UDisk_Write_Error = 0x00;                                     /* A sector write failed, the host is not told yet */
+volatile uint8_t  UDisk_Down_Buf_Cur = 0x00;                                    /* Buffer being filled */
+volatile uint8_t  UDisk_Down_Buf_Busy[ DEF_UDISK_DOWN_BUF_NUM ];                /* Buffer queued for programming */
+volatile uint32_t UDisk_Down_Buf_Lba[ DEF_UDISK_DOWN_BUF_NUM ];                 /* Sector held by the buffer */
+uint8_t   *pUDisk_Up_Ram = NULL;                                                /* Read sector served from a buffer */
+volatile uint8_t  UDisk_Up_Hint = DEF_BLK_RD_SEQ;                               /* Read hint for the current READ10 */
+volatile uint32_t UDisk_Pre_Erase_Start = 0x00;                                 /* Range erased in blocks for this WRITE10 */
+volatile uint32_t UDisk_Pre_Erase_End = 0x00;
+BLK_DEV   *UDisk_Dev = NULL;                                                    /* Medium behind the disk */
+void      ( *UDisk_Write_Notify )( BLK_DEV *dev, uint32_t address, uint32_t len ) = NULL; /* Told of every sector the host writes */
+
+
+/*******************************************************************************
+* Function Name  : UDISK_Init
+* Description    : Put the disk on a block device and enable it
+* Input          : *dev - initialized block device, Sector_Size must divide
+*                  DEF_FLASH_SECTOR_SIZE
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void UDISK_Init( BLK_DEV *dev )
+{
+    UDisk_Dev = dev;
+    Udisk_Capability = dev->Capacity / DEF_UDISK_SECTOR_SIZE;
+    Udisk_Status |= DEF_UDISK_EN_FLAG;
+}
 
 /*******************************************************************************
 * Function Name  : USIDK_CMD_Deal_Status
@@ -233,6 +262,8 @@ void UDISK_SCSI_CMD_Deal( void )
     if( ( mBOC.mCBW.mCBW_Sig[ 0 ] == 'U' ) && ( mBOC.mCBW.mCBW_Sig[ 1 ] == 'S' ) 
       &&( mBOC.mCBW.mCBW_Sig[ 2 ] == 'B' ) && ( mBOC.mCBW.mCBW_Sig[ 3 ] == 'C' ) )
     {
+        /* Let a sleeping medium wake up while the CBW is decoded */
+        BLK_Prepare( UDisk_Dev );
         Udisk_CBW_Tag_Save[ 0 ] = mBOC.mCBW.mCBW_Tag[ 0 ];
         Udisk_CBW_Tag_Save[ 1 ] = mBOC.mCBW.mCBW_Tag[ 1 ];
         Udisk_CBW_Tag_Save[ 2 ] = mBOC.mCBW.mCBW_Tag[ 2 ];
@@ -255,7 +286,19 @@ void UDISK_SCSI_CMD_Deal( void )
             }
         }
         Udisk_Transfer_Status |= DEF_UDISK_CSW_UP_FLAG;
-        
+
+        if( UDisk_Write_Error && ( mBOC.mCBW.mCBW_CB_Buf[ 0 ] != CMD_U_REQUEST_SENSE )
+                              && ( mBOC.mCBW.mCBW_CB_Buf[ 0 ] != CMD_U_INQUIRY ) )
+        {
+            /* Deferred error: a sector of an earlier WRITE10 failed after
+               its CSW had gone out, this command reports it instead */
+            UDisk_Write_Error = 0x00;
+            UDISK_CMD_Deal_Status( 0x03, 0x0C, 0x01 );
+            Udisk_Transfer_Status |= DEF_UDISK_BLUCK_UP_FLAG;
+            UDISK_CMD_Deal_Fail( );
+            return;
+        }
+
         /* SCSI command packet processing */ 
         switch( mBOC.mCBW.mCBW_CB_Buf[ 0 ] )
         {
@@ -339,6 +382,10 @@ void UDISK_SCSI_CMD_Deal( void )
                 if( ( Udisk_Status & DEF_UDISK_EN_FLAG ) )
                 {                    
                     CMD_RD_WR_Deal_Pre( );
+                    /* Short reads are mostly boot sector, FAT and directory and go
+                       through the sector cache; long file reads stream past it,
+                       where the flash read hides behind each pack's USB transfer */
+                    UDisk_Up_Hint = ( UDISK_Transfer_DataLen <= DEF_FLASH_SECTOR_SIZE ) ? DEF_BLK_RD_META : DEF_BLK_RD_SEQ;
                 }
                 else
                 {
@@ -354,6 +401,7 @@ void UDISK_SCSI_CMD_Deal( void )
                 if( Udisk_Status & DEF_UDISK_EN_FLAG )
                 {        
                     CMD_RD_WR_Deal_Pre( );
+                    UDISK_Write_Pre_Erase( );
                 }
                 else
                 {
@@ -621,18 +669,30 @@ void UDISK_Up_CSW( void )
 *******************************************************************************/
 void UDISK_Up_OnePack( void )
 {    
-    uint8_t *pbuf = NULL;
+    uint8_t  *pbuf;
+    uint32_t address;
 
-#if (STORAGE_MEDIUM == MEDIUM_SPI_FLASH)
-    if( UDISK_Sec_Pack_Count == 0x00 )     
+    if( UDISK_Sec_Pack_Count == 0x00 )
     {
-        FLASH_RD_Block_Start( UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE );
+        /* A sector still waiting to be programmed is read from its buffer */
+        pUDisk_Up_Ram = UDISK_Down_Buf_Find( UDISK_Cur_Sec_Lba );
+    }
+    address = UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE + (uint32_t)UDISK_Sec_Pack_Count * UDISK_Pack_Size;
+    if( pUDisk_Up_Ram )
+    {
+        pbuf = pUDisk_Up_Ram + (uint32_t)UDISK_Sec_Pack_Count * UDISK_Pack_Size;
+    }
+    else if( UDisk_Dev->Caps & DEF_BLK_CAP_MAPPED )
+    {
+        pbuf = UDisk_Dev->Base + address;
+    }
+    else
+    {
+        /* Sequential packs continue one open read; cached packs are copied
+           one by one, an eviction between packs only costs a reread */
+        BLK_Read( UDisk_Dev, address, UDisk_Pack_Buffer, UDISK_Pack_Size, UDisk_Up_Hint );
+        pbuf = UDisk_Pack_Buffer;
     }
-    FLASH_RD_Block( UDisk_Pack_Buffer, UDISK_Pack_Size );
-    pbuf = UDisk_Pack_Buffer;
-#elif (STORAGE_MEDIUM == MEDIUM_INTERAL_FLASH)
-    pbuf = (uint8_t*)(IFLASH_UDISK_START_ADDR + UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE + UDISK_Pack_Size * UDISK_Sec_Pack_Count);
-#endif
 
     /* USB upload this package data */
     USBFS_Endp_DataUp(DEF_UEP2, pbuf,UDISK_Pack_Size, DEF_UEP_CPY_LOAD );
@@ -643,9 +703,6 @@ void UDISK_Up_OnePack( void )
 
     if( UDISK_Sec_Pack_Count == ( DEF_UDISK_SECTOR_SIZE / UDISK_Pack_Size ) )
     {
-#if (STORAGE_MEDIUM == MEDIUM_SPI_FLASH)
-        PIN_FLASH_CS_HIGH( );
-#endif
         UDISK_Sec_Pack_Count = 0x00;
         UDISK_Cur_Sec_Lba++;
     }
@@ -656,6 +713,105 @@ void UDISK_Up_OnePack( void )
     }
 }
 
+/*******************************************************************************
+* Function Name  : UDISK_Down_Buf_Find
+* Description    : Find the newest write buffer still holding a sector
+* Input          : lba - sector number
+* Output         : None
+* Return         : buffer, NULL if the sector is not pending
+*******************************************************************************/
+uint8_t *UDISK_Down_Buf_Find( uint32_t lba )
+{
+    uint8_t i, n;
+
+    n = UDisk_Down_Buf_Cur;
+    for( i = 0; i < DEF_UDISK_DOWN_BUF_NUM; i++ )
+    {
+        n = ( n + DEF_UDISK_DOWN_BUF_NUM - 1 ) % DEF_UDISK_DOWN_BUF_NUM;
+        if( UDisk_Down_Buf_Busy[ n ] && ( UDisk_Down_Buf_Lba[ n ] == lba ) )
+        {
+            return UDisk_Down_Buffer[ n ];
+        }
+    }
+    return NULL;
+}
+
+/*******************************************************************************
+* Function Name  : UDISK_Write_Pre_Erase
+* Description    : Queue one large block erase for the part of a WRITE10 that
+*                  covers whole erase blocks, its sectors skip the 4K erase.
+*                  Not with DEF_UDISK_WRITE_COMPARE: the erase would go out
+*                  before the data is known, so sectors the host rewrites
+*                  unchanged would lose the compare skip and an aborted
+*                  command would leave the rest of the block blank.
+* Input          : None
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void UDISK_Write_Pre_Erase( void )
+{
+#if !DEF_UDISK_WRITE_COMPARE
+    uint32_t start, end, blk;
+#endif
+
+    UDisk_Pre_Erase_Start = 0x00;
+    UDisk_Pre_Erase_End = 0x00;
+#if !DEF_UDISK_WRITE_COMPARE
+    /* Smallest erase block above the sector size */
+    blk = UDisk_Dev->Block_Size;
+    if( blk == 0 )
+    {
+        return;
+    }
+
+    start = UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE;
+    end = start + UDISK_Transfer_DataLen;
+    start = ( ( start + blk - 1 ) / blk ) * blk;
+    end = ( end / blk ) * blk;
+    if( ( end > start ) && ( BLK_Erase( UDisk_Dev, start, end - start ) == DEF_BLK_OK ) )
+    {
+        UDisk_Pre_Erase_Start = start;
+        UDisk_Pre_Erase_End = end;
+    }
+#endif
+}
+
+/*******************************************************************************
+* Function Name  : UDISK_Down_Buf_Done
+* Description    : Block device callback, a sector buffer has been written.
+*                  A failed write is reported with sense 03/0C: in the CSW
+*                  of its WRITE10 if that has not gone out yet, else as a
+*                  deferred error on the next command.
+* Input          : pbuf - the written buffer
+*                  status - DEF_BLK_OK or DEF_BLK_ERR_xx
+* Output         : None
+* Return         : None
+*******************************************************************************/
+void UDISK_Down_Buf_Done( uint8_t *pbuf, uint8_t status )
+{
+    uint8_t i;
+
+    if( status != DEF_BLK_OK )
+    {
+        UDisk_Write_Error = 0x01;
+    }
+
+    for( i = 0; i < DEF_UDISK_DOWN_BUF_NUM; i++ )
+    {
+        if( pbuf == UDisk_Down_Buffer[ i ] )
+        {
+            UDisk_Down_Buf_Busy[ i ] = 0x00;
+        }
+    }
+
+    /* Let the host send again once the buffer being filled is free */
+    if( Udisk_Down_Wait && ( UDisk_Down_Buf_Busy[ UDisk_Down_Buf_Cur ] == 0x00 ) )
+    {
+        Udisk_Down_Wait = 0x00;
+        USBFSD->UEP3_RX_CTRL = ( USBFSD->UEP3_RX_CTRL & ~USBFS_UEP_R_RES_MASK ) | USBFS_UEP_R_RES_ACK;
+    }
+}
+
 /*******************************************************************************
 * Function Name  : UDISK_Down_OnePack
 * Description    : UDISK download a pack
@@ -667,15 +823,19 @@ void UDISK_Down_OnePack( uint8_t *pbuf, uint16_t packlen )
 {
     uint32_t address;
     uint32_t sec_start_addr;
+    uint8_t  *pdown;
+    uint8_t  s;
+
     if( UDISK_Sec_Pack_Count == 0x00 )
     {
-        address = (uint32_t)UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE;
-        sec_start_addr = ( address / DEF_FLASH_SECTOR_SIZE ) * DEF_FLASH_SECTOR_SIZE;
-#if (STORAGE_MEDIUM == MEDIUM_SPI_FLASH)
-        FLASH_Erase_Sector(sec_start_addr);
-#endif
+        /* Normally EP3 is held at NAK until the buffer is free */
+        while( UDisk_Down_Buf_Busy[ UDisk_Down_Buf_Cur ] )
+        {
+            BLK_Poll( UDisk_Dev );
+        }
     }
-    memcpy(UDisk_Down_Buffer + (uint32_t)UDISK_Sec_Pack_Count * UDISK_Pack_Size ,pbuf, UDISK_Pack_Size);
+    pdown = UDisk_Down_Buffer[ UDisk_Down_Buf_Cur ];
+    memcpy(pdown + (uint32_t)UDISK_Sec_Pack_Count * UDISK_Pack_Size ,pbuf, UDISK_Pack_Size);
     UDISK_Sec_Pack_Count++;
     UDISK_Transfer_DataLen -= UDISK_Pack_Size;
 
@@ -684,13 +844,63 @@ void UDISK_Down_OnePack( uint8_t *pbuf, uint16_t packlen )
         address = (uint32_t)UDISK_Cur_Sec_Lba * DEF_UDISK_SECTOR_SIZE;
         sec_start_addr = ( address / DEF_FLASH_SECTOR_SIZE ) * DEF_FLASH_SECTOR_SIZE;
 
-#if (STORAGE_MEDIUM == MEDIUM_SPI_FLASH)
-        W25XXX_WR_Block(UDisk_Down_Buffer, sec_start_addr, DEF_FLASH_SECTOR_SIZE );
-#elif (STORAGE_MEDIUM == MEDIUM_INTERAL_FLASH)
-        IFlash_Prog_512(IFLASH_UDISK_START_ADDR + sec_start_addr,(uint32_t*)UDisk_Down_Buffer);
+        /* On an asynchronous medium erase and program run from BLK_Poll,
+           not in this interrupt; others program now and call the callback */
+        UDisk_Down_Buf_Lba[ UDisk_Down_Buf_Cur ] = UDISK_Cur_Sec_Lba;
+        UDisk_Down_Buf_Busy[ UDisk_Down_Buf_Cur ] = 0x01;
+        if( ( sec_start_addr >= UDisk_Pre_Erase_Start ) && ( sec_start_addr < UDisk_Pre_Erase_End ) )
+        {
+            /* Already erased by UDISK_Write_Pre_Erase */
+            while( ( s = BLK_Prog( UDisk_Dev, pdown, sec_start_addr, DEF_FLASH_SECTOR_SIZE, UDISK_Down_Buf_Done ) ) == DEF_BLK_ERR_BUSY )
+            {
+                BLK_Poll( UDisk_Dev );
+            }
+        }
+        else
+        {
+#if DEF_UDISK_WRITE_COMPARE
+            /* FAT and directory sectors are often rewritten unchanged */
+            while( ( s = BLK_Write( UDisk_Dev, pdown, sec_start_addr, DEF_FLASH_SECTOR_SIZE, UDISK_Down_Buf_Done ) ) == DEF_BLK_ERR_BUSY )
+            {
+                BLK_Poll( UDisk_Dev );
+            }
+#else
+            while( ( s = BLK_Erase( UDisk_Dev, sec_start_addr, DEF_FLASH_SECTOR_SIZE ) ) == DEF_BLK_ERR_BUSY )
+            {
+                BLK_Poll( UDisk_Dev );
+            }
+            if( s == DEF_BLK_OK )
+            {
+                while( ( s = BLK_Prog( UDisk_Dev, pdown, sec_start_addr, DEF_FLASH_SECTOR_SIZE, UDISK_Down_Buf_Done ) ) == DEF_BLK_ERR_BUSY )
+                {
+                    BLK_Poll( UDisk_Dev );
+                }
+            }
 #endif
+        }
+        if( s != DEF_BLK_OK )
+        {
+            /* Write failed before it was queued: free the buffer, the CSW reports it */
+            UDISK_Down_Buf_Done( pdown, s );
+        }
+        if( UDisk_Write_Notify )
+        {
+            /* Lets the firmware's own view of the disk, such as a FAT cache, follow the host */
+            UDisk_Write_Notify( UDisk_Dev, sec_start_addr, DEF_FLASH_SECTOR_SIZE );
+        }
+        UDisk_Down_Buf_Cur = ( UDisk_Down_Buf_Cur + 1 ) % DEF_UDISK_DOWN_BUF_NUM;
+        BLK_Poll( UDisk_Dev );
+        if( UDisk_Down_Buf_Busy[ UDisk_Down_Buf_Cur ] )
+        {
+            Udisk_Down_Wait = 0x01;
+        }
         if( UDISK_Transfer_DataLen == 0x00 )
         {
+            if( UDisk_Write_Error )
+            {
+                UDisk_Write_Error = 0x00;
+                UDISK_CMD_Deal_Status( 0x03, 0x0C, 0x01 );
+            }
             Udisk_Transfer_Status &= ~DEF_UDISK_BLUCK_DOWN_FLAG;
             UDISK_Up_CSW( );
         }
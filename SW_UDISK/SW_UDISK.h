@@ -98,10 +98,14 @@ typedef union _BULK_ONLY_CMD
     #define DEF_CFG_DISK_SEC_SIZE      4096                                                /* Disk sector size */
     #define DEF_FLASH_SECTOR_SIZE      4096                                                /* Flash sector size */
     #define DEF_UDISK_SECTOR_SIZE      DEF_CFG_DISK_SEC_SIZE                               /* UDisk sector size */
+    #define DEF_UDISK_DOWN_BUF_NUM     2                                                   /* Sectors buffered while flash jobs run */
+    #define DEF_UDISK_WRITE_COMPARE    1                                                   /* Compare before write, skip unneeded erase/program */
 #elif (STORAGE_MEDIUM == MEDIUM_INTERAL_FLASH)
     #define DEF_CFG_DISK_SEC_SIZE      512                                                 /* Disk sector size */
     #define DEF_FLASH_SECTOR_SIZE      512                                                 /* Flash sector size */
     #define DEF_UDISK_SECTOR_SIZE      DEF_CFG_DISK_SEC_SIZE                               /* UDisk sector size */
+    #define DEF_UDISK_DOWN_BUF_NUM     1                                                   /* Sectors buffered while flash jobs run */
+    #define DEF_UDISK_WRITE_COMPARE    1                                                   /* Compare before write, rewrite only changed 256-byte pages */
 #endif
 
 #define DEF_UDISK_PACK_512    	       512
@@ -132,12 +136,18 @@ extern BULK_ONLY_CMD	mBOC;
 extern volatile uint8_t  Udisk_Status;
 extern volatile uint8_t  Udisk_Transfer_Status;
 extern volatile uint32_t Udisk_Capability;
+extern volatile uint8_t  Udisk_Down_Wait;
+extern volatile uint8_t  UDisk_Write_Error;
 extern uint8_t  UDISK_Inquity_Tab[ ];
 extern uint8_t  const  UDISK_Rd_Format_Capacity[ ];
 extern uint8_t  const  UDISK_Rd_Capacity[ ];
 extern uint8_t  const  UDISK_Mode_Sense_1A[ ];
 extern uint8_t  const  UDISK_Mode_Senese_5A[ ];
 
+extern struct _BLK_DEV *UDisk_Dev;
+extern void ( *UDisk_Write_Notify )( struct _BLK_DEV *dev, uint32_t address, uint32_t len );
+
+extern void UDISK_Init( struct _BLK_DEV *dev );
 extern void UDISK_CMD_Deal_Status( uint8_t key, uint8_t asc, uint8_t status );
 extern void UDISK_CMD_Deal_Fail( void );
 extern void UDISK_SCSI_CMD_Deal( void );
@@ -147,6 +157,9 @@ extern void UDISK_Up_OnePack( void );
 extern void UDISK_Out_EP_Deal( uint8_t *pbuf, uint16_t packlen );
 extern void UDISK_In_EP_Deal( void );
 extern void UDISK_Down_OnePack( uint8_t *pbuf, uint16_t packlen );
+extern uint8_t *UDISK_Down_Buf_Find( uint32_t lba );
+extern void UDISK_Down_Buf_Done( uint8_t *pbuf, uint8_t status );
+extern void UDISK_Write_Pre_Erase( void );
 
 #ifdef __cplusplus
 }
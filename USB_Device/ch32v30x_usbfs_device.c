@@ -338,7 +338,11 @@ void USBFS_IRQHandler( void )
                             USBFSD->UEP3_RX_CTRL ^= USBFS_UEP_R_TOG;
                             USBFSD->UEP3_RX_CTRL = (USBFSD->UEP3_RX_CTRL & ~USBFS_UEP_R_RES_MASK) | USBFS_UEP_R_RES_NAK;
                             UDISK_Out_EP_Deal(UDisk_Out_Buf,len);
-                            USBFSD->UEP3_RX_CTRL = (USBFSD->UEP3_RX_CTRL & ~USBFS_UEP_R_RES_MASK) | USBFS_UEP_R_RES_ACK;
+                            /* Stay at NAK while every sector buffer waits for the flash */
+                            if( Udisk_Down_Wait == 0x00 )
+                            {
+                                USBFSD->UEP3_RX_CTRL = (USBFSD->UEP3_RX_CTRL & ~USBFS_UEP_R_RES_MASK) | USBFS_UEP_R_RES_ACK;
+                            }
                         }
                         break;
                 }
@@ -19,6 +19,7 @@
 #include "ch32v30x_usbfs_device.h"
 #include "debug.h"
 #include "SPI_FLASH.h"
+#include "BLOCK_DEV.h"
 #include "SW_UDISK.h"
 #include "FAT12.h"
 
@@ -31,7 +32,9 @@
  */
 int main(void)
 {
-    struct BPB bpb;
+    struct FAT12_VOLUME vol;
+    BLK_DEV *disk;
+    uint64_t uid;
 
     SystemCoreClockUpdate( );
     Delay_Init( );
@@ -43,8 +46,18 @@ int main(void)
     FLASH_Port_Init( );
     // FLASH ID check
     FLASH_IC_Check( );
-
-    printf("Flash unique chip ID: %08X\n",(uint32_t)FLASH_ReadUNIQUEID( ));
+    // Block device shared by UDISK and FAT12
+#if ( STORAGE_MEDIUM == MEDIUM_SPI_FLASH )
+    BLK_SPI_Flash_Init( );
+    disk = &BLK_Dev_SPI_Flash;
+#else
+    // Zero-wait internal flash region reserved in Ld/Link.ld
+    BLK_IFlash_Init( );
+    disk = &BLK_Dev_IFlash;
+#endif
+
+    uid = FLASH_ReadUNIQUEID( );
+    printf("Flash unique chip ID: %08X%08X\n",(uint32_t)( uid >> 32 ),(uint32_t)uid);
     printf( "FAT12 W25Q32 4M-byte SPI NOR Flash Storage file list:\n" );
 	printf("==============================================\n");
 
@@ -67,33 +80,60 @@ int main(void)
 
 /*
     // Enable Udisk
-    Udisk_Capability = Flash_Sector_Count;
-    Udisk_Status |= DEF_UDISK_EN_FLAG;
+    UDISK_Init( disk );
+    UDisk_Write_Notify = fat12_disk_written;
 	// USBFSD device init
 	USBFS_RCC_Init( );
     USBFS_Device_Init( ENABLE );
 */
 
     // Show files name position and size from the UDISK
-    // Load the BIOS Parameter Block
-    load_bpb_spi(&bpb);
-    // List files in the root directory
-    list_files_spi(&bpb);
-
-    printf("==================== END =====================\n\n");
-
-    // Example: Get file size of a specific file
-    const char *filename_to_find = "WSCLI.HTM";
-    uint32_t file_size = get_file_size_spi(&bpb, filename_to_find);
-
-    if (file_size > 0) {
-        printf("Size of file %s: %u bytes\n", filename_to_find, file_size);
+    // Mount the volume: one boot sector read, BPB checked
+    if (fat12_mount(&vol, disk) != FAT12_OK) {
+        // Nothing to list or read, vol holds no valid BPB
+        printf("No valid FAT12 volume\n");
     } else {
-        printf("File %s not found\n", filename_to_find);
+        // List files in the root directory
+        list_files_spi(&vol.bpb);
+
+        printf("==================== END =====================\n\n");
+
+        // Example: Get file size of a specific file
+        const char *filename_to_find = "WSCLI.HTM";
+        uint32_t file_size = get_file_size_spi(&vol.bpb, filename_to_find);
+
+        if (file_size > 0) {
+            printf("Size of file %s: %u bytes\n", filename_to_find, file_size);
+        } else {
+            printf("File %s not found\n", filename_to_find);
+        }
+
+        // Example: Stream the same file through a small buffer, no full-file copy
+        struct FAT12_FILE file;
+        uint8_t chunk[64];
+        uint32_t total = 0, sum = 0;
+        int32_t n;
+
+        if (fat12_open(&vol, &file, filename_to_find) == FAT12_OK) {
+            while ((n = fat12_read(&file, chunk, sizeof(chunk))) > 0) {
+                for (int32_t i = 0; i < n; i++) {
+                    sum += chunk[i];
+                }
+                total += n;
+            }
+            fat12_close(&file);
+            printf("Streamed %u bytes of %s, byte sum %u\n", total, filename_to_find, sum);
+        }
     }
 
-    while(1) {
+#if DEF_FLASH_STATS_EN
+    // Flash operation counters and latencies since boot
+    FLASH_Stats_Dump( );
+#endif
 
+    while(1) {
+        // Run queued flash erase/program jobs (UDISK writes)
+        BLK_Poll( disk );
     }
 
     return 0;